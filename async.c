@@ -0,0 +1,684 @@
+/* Needed for pipe(), fcntl() and the pthread functions. */
+#define _POSIX_C_SOURCE 199506L
+
+#include "async.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef THREADSAFE
+#include <pthread.h>
+
+#define MUTEX_INIT(mutex) \
+    { int result = pthread_mutex_init(&mutex, NULL); assert(result == 0); }
+
+#define MUTEX_DESTROY(mutex) \
+    { int result = pthread_mutex_destroy(&mutex); assert(result == 0); }
+
+#define MUTEX_LOCK(mutex) \
+    { int result = pthread_mutex_lock(&mutex); assert(result == 0); }
+
+#define MUTEX_UNLOCK(mutex) \
+    { int result = pthread_mutex_unlock(&mutex); assert(result == 0); }
+
+#else  /* def THREADSAFE */
+#warning "THREADSAFE not defined; requests are executed synchronously!"
+#define MUTEX_INIT(mutex)    ((void)0)
+#define MUTEX_DESTROY(mutex) ((void)0)
+#define MUTEX_LOCK(mutex)    ((void)0)
+#define MUTEX_UNLOCK(mutex)  ((void)0)
+#endif  /* def THREADSAFE */
+
+/*  Number of worker threads started if none is specified. */
+#define DEFAULT_THREADS 4
+
+/*  Largest number of requests executed by a worker as a single batch. */
+#define MAX_BATCH 64
+
+/*  Request operations. */
+#define ASYNC_IDENTIFY_NODE     1
+#define ASYNC_IDENTIFY_TRIPLE   2
+#define ASYNC_RESOLVE_NODE      3
+#define ASYNC_RESOLVE_TRIPLE    4
+#define ASYNC_ADD_TRIPLE        5
+#define ASYNC_REMOVE_TRIPLE     6
+#define ASYNC_FIND_TRIPLE       7
+#define ASYNC_FIND_TRIPLES      8
+
+typedef struct async_request
+{
+    unsigned operation;
+    model_handle model;         /* NULL for dictionary requests */
+    async_callback_t callback;  /* NULL to use the completion queue */
+    void *context;
+
+    /* Arguments. */
+    void *data;                 /* node data of an identify_node request */
+    size_t size;
+    triple_t triple;            /* triple or pattern */
+    nid_t nid;                  /* node, triple, or previous triple */
+    unsigned count;             /* number of triples requested */
+
+    /* Results. */
+    nid_t result;
+    triple_t result_triple;
+    unsigned result_count;
+    const void *result_data;
+    size_t result_size;
+    nid_t *result_nids;
+
+    int done;
+    struct async_request *next; /* next request in its queue */
+} async_request_t;
+
+/*  Queues are singly linked lists of requests. */
+typedef struct queue
+{
+    async_request_t *head, *tail;
+} queue_t;
+
+static queue_t requests;        /* requests not taken by a worker yet */
+static queue_t completed;       /* completion queue */
+static int completion_pipe[2];  /* readable while 'completed' is not empty */
+
+#ifdef THREADSAFE
+static pthread_t *workers;
+static unsigned worker_count;
+static model_handle *busy_models;   /* models a worker executes requests on */
+static int stopping;
+
+/*  Protects all of the above and the 'done' flags of requests. */
+static pthread_mutex_t async_mutex;
+static pthread_cond_t requests_cond, done_cond;
+#endif
+
+
+/*  Appends a request to a queue. */
+static void push_request(queue_t *queue, async_request_t *request)
+{
+    request->next = NULL;
+    if(queue->tail != NULL)
+        queue->tail->next = request;
+    else
+        queue->head = request;
+    queue->tail = request;
+}
+
+
+/*  Removes the request following 'previous' (or the first request, if
+    'previous' is NULL) from a queue, and returns it. */
+static async_request_t *unlink_request( queue_t *queue,
+                                        async_request_t *previous )
+{
+    async_request_t *request;
+
+    request = previous != NULL ? previous->next : queue->head;
+    if(previous != NULL)
+        previous->next = request->next;
+    else
+        queue->head = request->next;
+    if(queue->tail == request)
+        queue->tail = previous;
+
+    return request;
+}
+
+
+/*  Executes a request. */
+static void execute_request(async_request_t *request)
+{
+    switch(request->operation)
+    {
+    case ASYNC_IDENTIFY_NODE:
+        request->result = identify_node(request->data, request->size);
+        break;
+
+    case ASYNC_IDENTIFY_TRIPLE:
+        request->result = identify_triple(&request->triple);
+        break;
+
+    case ASYNC_RESOLVE_NODE:
+        request->result_data = resolve_node( request->nid, NULL,
+                                             &request->result_size );
+        break;
+
+    case ASYNC_RESOLVE_TRIPLE:
+        request->result_triple = resolve_triple(request->nid);
+        break;
+
+    case ASYNC_ADD_TRIPLE:
+        request->result_count = add_triple(request->model, request->nid);
+        break;
+
+    case ASYNC_REMOVE_TRIPLE:
+        request->result_count = remove_triple(request->model, request->nid);
+        break;
+
+    case ASYNC_FIND_TRIPLE:
+        request->result = find_triple( request->model, &request->triple,
+                                       request->nid );
+        break;
+
+    case ASYNC_FIND_TRIPLES:
+        request->result_nids = (nid_t*)malloc(
+            (request->count > 0 ? request->count : 1) * sizeof(nid_t) );
+        assert(request->result_nids);
+        request->result_count = find_triples( request->model,
+            &request->triple, request->nid, request->count,
+            request->result_nids );
+        break;
+
+    default:
+        assert(0);
+    }
+}
+
+
+/*  Marks a request as complete, and calls its callback or adds it to the
+    completion queue. */
+static void complete_request(async_request_t *request)
+{
+    async_callback_t callback;
+    char byte;
+    ssize_t written;
+
+    MUTEX_LOCK(async_mutex);
+    request->done = 1;
+    callback = request->callback;
+    if(callback == NULL)
+    {
+        if(completed.head == NULL)
+        {
+            byte = 0;
+            written = write(completion_pipe[1], &byte, 1);
+            assert(written == 1);
+        }
+        push_request(&completed, request);
+    }
+#ifdef THREADSAFE
+    pthread_cond_broadcast(&done_cond);
+#endif
+    MUTEX_UNLOCK(async_mutex);
+
+    if(callback != NULL)
+        callback(request);
+}
+
+
+static int is_find_request(const async_request_t *request)
+{
+    return request->operation == ASYNC_FIND_TRIPLE ||
+           request->operation == ASYNC_FIND_TRIPLES;
+}
+
+
+/*  Compares find requests by pattern, for qsort(). */
+static int compare_find_requests(const void *a, const void *b)
+{
+    const async_request_t *request_a = *(async_request_t * const *)a;
+    const async_request_t *request_b = *(async_request_t * const *)b;
+
+    return memcmp( &request_a->triple, &request_b->triple,
+                   sizeof(triple_t) );
+}
+
+
+/*  Executes a batch of requests on the same model, in order, except that
+    consecutive finds are executed in pattern order. */
+static void execute_batch(async_request_t **batch, unsigned size)
+{
+    unsigned begin, end, n;
+
+    for(begin = 0; begin < size; begin = end)
+    {
+        end = begin + 1;
+        if(is_find_request(batch[begin]))
+        {
+            while(end < size && is_find_request(batch[end]))
+                ++end;
+            qsort( batch + begin, end - begin, sizeof(async_request_t*),
+                   compare_find_requests );
+        }
+        for(n = begin; n < end; ++n)
+        {
+            execute_request(batch[n]);
+            complete_request(batch[n]);
+        }
+    }
+}
+
+
+#ifdef THREADSAFE
+/*  Determines if a worker is executing requests on a model. */
+static int is_busy_model(model_handle model)
+{
+    unsigned n;
+
+    for(n = 0; n < worker_count; ++n)
+    {
+        if(busy_models[n] == model)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*  Takes a batch of queued requests: the first request on a model that no
+    other worker is executing requests on (or that only uses the
+    dictionaries), and the requests queued after it on the same model.
+    Returns the size of the batch, which is 0 if no request can be taken.
+    The caller must hold async_mutex. */
+static unsigned take_batch(async_request_t **batch)
+{
+    async_request_t *request, *previous;
+    model_handle model;
+    unsigned size;
+
+    previous = NULL;
+    for(request = requests.head; request != NULL; request = request->next)
+    {
+        if(request->model == NULL || !is_busy_model(request->model))
+            break;
+        previous = request;
+    }
+    if(request == NULL)
+        return 0;
+
+    model = request->model;
+    size = 0;
+    while(request != NULL && size < MAX_BATCH)
+    {
+        if(request->model == model)
+        {
+            batch[size++] = unlink_request(&requests, previous);
+            request = previous != NULL ? previous->next : requests.head;
+        }
+        else
+        {
+            previous = request;
+            request = request->next;
+        }
+    }
+
+    return size;
+}
+
+
+static void *run_worker(void *argument)
+{
+    async_request_t *batch[MAX_BATCH];
+    model_handle *busy_model;
+    unsigned size;
+
+    busy_model = (model_handle*)argument;
+    MUTEX_LOCK(async_mutex);
+    for(;;)
+    {
+        size = take_batch(batch);
+        if(size == 0)
+        {
+            if(stopping && requests.head == NULL)
+                break;
+            pthread_cond_wait(&requests_cond, &async_mutex);
+            continue;
+        }
+
+        /* Dictionary requests are independent, so other workers may execute
+           them meanwhile. */
+        *busy_model = batch[0]->model;
+        MUTEX_UNLOCK(async_mutex);
+
+        execute_batch(batch, size);
+
+        MUTEX_LOCK(async_mutex);
+        *busy_model = NULL;
+
+        /* Requests on the model may be waiting for this batch to finish. */
+        pthread_cond_broadcast(&requests_cond);
+    }
+    MUTEX_UNLOCK(async_mutex);
+
+    return NULL;
+}
+#endif
+
+
+void async_initialize(unsigned threads)
+{
+    int result;
+#ifdef THREADSAFE
+    unsigned n;
+#endif
+
+    requests.head = requests.tail = NULL;
+    completed.head = completed.tail = NULL;
+    result = pipe(completion_pipe);
+    assert(result == 0);
+    result = fcntl(completion_pipe[0], F_SETFL, O_NONBLOCK);
+    assert(result == 0);
+
+#ifdef THREADSAFE
+    MUTEX_INIT(async_mutex);
+    result = pthread_cond_init(&requests_cond, NULL);
+    assert(result == 0);
+    result = pthread_cond_init(&done_cond, NULL);
+    assert(result == 0);
+
+    stopping = 0;
+    worker_count = threads > 0 ? threads : DEFAULT_THREADS;
+    busy_models = (model_handle*)calloc(worker_count, sizeof(model_handle));
+    workers = (pthread_t*)malloc(worker_count * sizeof(pthread_t));
+    assert(busy_models && workers);
+    for(n = 0; n < worker_count; ++n)
+    {
+        result = pthread_create( &workers[n], NULL, run_worker,
+                                 &busy_models[n] );
+        assert(result == 0);
+    }
+#endif
+}
+
+
+void async_finalize()
+{
+    int result;
+#ifdef THREADSAFE
+    unsigned n;
+
+    MUTEX_LOCK(async_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&requests_cond);
+    MUTEX_UNLOCK(async_mutex);
+    for(n = 0; n < worker_count; ++n)
+    {
+        result = pthread_join(workers[n], NULL);
+        assert(result == 0);
+    }
+    free(workers);
+    free(busy_models);
+
+    result = pthread_cond_destroy(&requests_cond);
+    assert(result == 0);
+    result = pthread_cond_destroy(&done_cond);
+    assert(result == 0);
+    MUTEX_DESTROY(async_mutex);
+#endif
+
+    result = close(completion_pipe[0]);
+    assert(result == 0);
+    result = close(completion_pipe[1]);
+    assert(result == 0);
+}
+
+
+/*  Allocates a request. */
+static async_request_t *new_request( unsigned operation, model_handle model,
+                                     async_callback_t callback,
+                                     void *context )
+{
+    async_request_t *request;
+
+    request = (async_request_t*)calloc(1, sizeof(async_request_t));
+    assert(request);
+    request->operation = operation;
+    request->model = model;
+    request->callback = callback;
+    request->context = context;
+
+    return request;
+}
+
+
+/*  Queues a request for execution by a worker. */
+static async_handle submit_request(async_request_t *request)
+{
+#ifdef THREADSAFE
+    MUTEX_LOCK(async_mutex);
+    push_request(&requests, request);
+    pthread_cond_signal(&requests_cond);
+    MUTEX_UNLOCK(async_mutex);
+#else
+    execute_request(request);
+    complete_request(request);
+#endif
+
+    return request;
+}
+
+
+async_handle async_identify_node( const void *data, size_t size,
+                                  async_callback_t callback, void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_IDENTIFY_NODE, NULL, callback, context);
+    request->data = malloc(size > 0 ? size : 1);
+    assert(request->data);
+    memcpy(request->data, data, size);
+    request->size = size;
+
+    return submit_request(request);
+}
+
+
+async_handle async_identify_triple( const triple_t *triple,
+                                    async_callback_t callback,
+                                    void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_IDENTIFY_TRIPLE, NULL, callback, context);
+    request->triple = *triple;
+
+    return submit_request(request);
+}
+
+
+async_handle async_resolve_node( nid_t nid, async_callback_t callback,
+                                 void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_RESOLVE_NODE, NULL, callback, context);
+    request->nid = nid;
+
+    return submit_request(request);
+}
+
+
+async_handle async_resolve_triple( nid_t nid, async_callback_t callback,
+                                   void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_RESOLVE_TRIPLE, NULL, callback, context);
+    request->nid = nid;
+
+    return submit_request(request);
+}
+
+
+async_handle async_add_triple( model_handle model, nid_t nid,
+                               async_callback_t callback, void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_ADD_TRIPLE, model, callback, context);
+    request->nid = nid;
+
+    return submit_request(request);
+}
+
+
+async_handle async_remove_triple( model_handle model, nid_t nid,
+                                  async_callback_t callback, void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_REMOVE_TRIPLE, model, callback, context);
+    request->nid = nid;
+
+    return submit_request(request);
+}
+
+
+async_handle async_find_triple( model_handle model, const triple_t *pattern,
+                                nid_t previous, async_callback_t callback,
+                                void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_FIND_TRIPLE, model, callback, context);
+    request->triple = *pattern;
+    request->nid = previous;
+
+    return submit_request(request);
+}
+
+
+async_handle async_find_triples( model_handle model, const triple_t *pattern,
+                                 nid_t previous, unsigned count,
+                                 async_callback_t callback, void *context )
+{
+    async_request_t *request;
+
+    request = new_request(ASYNC_FIND_TRIPLES, model, callback, context);
+    request->triple = *pattern;
+    request->nid = previous;
+    request->count = count;
+
+    return submit_request(request);
+}
+
+
+int async_fd()
+{
+    return completion_pipe[0];
+}
+
+
+/*  Removes the request after 'previous' (or the first request if 'previous'
+    is NULL) from the completion queue, making async_fd() unreadable if the
+    queue becomes empty. The caller must hold async_mutex. */
+static void unlink_completed(async_request_t *previous)
+{
+    char byte;
+
+    unlink_request(&completed, previous);
+    if(completed.head == NULL)
+        while(read(completion_pipe[0], &byte, 1) == 1);
+}
+
+
+async_handle async_completed()
+{
+    async_request_t *request;
+
+    MUTEX_LOCK(async_mutex);
+    request = completed.head;
+    if(request != NULL)
+        unlink_completed(NULL);
+    MUTEX_UNLOCK(async_mutex);
+
+    return request;
+}
+
+
+int async_is_done(async_handle request)
+{
+    int done;
+
+    MUTEX_LOCK(async_mutex);
+    done = request->done;
+    MUTEX_UNLOCK(async_mutex);
+
+    return done;
+}
+
+
+void async_wait(async_handle request)
+{
+    assert(request->callback == NULL);
+    MUTEX_LOCK(async_mutex);
+#ifdef THREADSAFE
+    while(!request->done)
+        pthread_cond_wait(&done_cond, &async_mutex);
+#endif
+    MUTEX_UNLOCK(async_mutex);
+}
+
+
+void *async_context(async_handle request)
+{
+    return request->context;
+}
+
+
+nid_t async_nid(async_handle request)
+{
+    assert(request->done);
+    return request->result;
+}
+
+
+triple_t async_triple(async_handle request)
+{
+    assert(request->done);
+    return request->result_triple;
+}
+
+
+unsigned async_count(async_handle request)
+{
+    assert(request->done);
+    return request->result_count;
+}
+
+
+const void *async_data(async_handle request, size_t *size)
+{
+    assert(request->done);
+    *size = request->result_size;
+    return request->result_data;
+}
+
+
+const nid_t *async_nids(async_handle request, unsigned *count)
+{
+    assert(request->done);
+    *count = request->result_count;
+    return request->result_nids;
+}
+
+
+void async_free(async_handle request)
+{
+    MUTEX_LOCK(async_mutex);
+    if(request->callback == NULL && request->done)
+    {
+        /* Remove the request from the completion queue, if it is in it. */
+        async_request_t *previous, *queued;
+
+        previous = NULL;
+        for(queued = completed.head; queued != NULL; queued = queued->next)
+        {
+            if(queued == request)
+            {
+                unlink_completed(previous);
+                break;
+            }
+            previous = queued;
+        }
+    }
+    MUTEX_UNLOCK(async_mutex);
+
+    free(request->data);
+    if(request->result_data != NULL)
+        free_data(request->result_data);
+    free(request->result_nids);
+    free(request);
+}
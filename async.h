@@ -0,0 +1,126 @@
+#ifndef ASYNC_H_INCLUDED
+#define ASYNC_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "tripledb.h"
+
+/*  Asynchronous requests (async.c). Instead of calling the functions in
+    tripledb.h directly, requests for them are queued and executed by a pool
+    of worker threads owned by the library, so a thread that must not block
+    (for example, one running an event loop) can keep many requests in flight
+    at once.
+
+    Requests on the same model are executed in the order in which they were
+    submitted. Consecutive queued requests on the same model are taken from
+    the queue at once by a single worker and executed one after another; each
+    of them still locks the model by itself. Finds within such a batch that
+    are not separated by a modification are executed in pattern order. Requests that only use the dictionaries (the
+    identify_ and resolve_ requests) may be executed in any order.
+
+    When a request has been executed, it is complete. If a callback was given
+    when it was submitted, the callback is called from a worker thread;
+    otherwise, the request is added to the completion queue, from which it is
+    retrieved with async_completed(). async_fd() returns a file descriptor
+    that is readable whenever the completion queue is not empty, so it can be
+    watched with poll() or select() along with other descriptors.
+
+    Every request submitted must be released with async_free() once its
+    results have been read. A model must not be closed while requests on it
+    are outstanding.
+
+    If the library is not compiled with THREADSAFE, requests are executed
+    when they are submitted. */
+
+
+/*  An asynchronous request handle. */
+typedef struct async_request *async_handle;
+
+/*  A function called when a request completes. */
+typedef void (*async_callback_t)(async_handle request);
+
+
+/*  Starts 'threads' worker threads (or a default number if 'threads' is 0).
+    Must be called after tripledb_initialize(). */
+void async_initialize(unsigned threads);
+
+
+/*  Executes all requests submitted, and stops the worker threads. Must be
+    called before tripledb_finalize(). */
+void async_finalize();
+
+
+/*  Submit requests. Each corresponds to the function in tripledb.h of the
+    same name; arguments are copied, so they need not remain valid until the
+    request completes. 'context' can be retrieved with async_context(). */
+async_handle async_identify_node( const void *data, size_t size,
+                                  async_callback_t callback, void *context );
+async_handle async_identify_triple( const triple_t *triple,
+                                    async_callback_t callback,
+                                    void *context );
+async_handle async_resolve_node( nid_t nid, async_callback_t callback,
+                                 void *context );
+async_handle async_resolve_triple( nid_t nid, async_callback_t callback,
+                                   void *context );
+async_handle async_add_triple( model_handle model, nid_t nid,
+                               async_callback_t callback, void *context );
+async_handle async_remove_triple( model_handle model, nid_t nid,
+                                  async_callback_t callback, void *context );
+async_handle async_find_triple( model_handle model, const triple_t *pattern,
+                                nid_t previous, async_callback_t callback,
+                                void *context );
+
+
+/*  Submits a request for up to 'count' triples matching 'pattern' that
+    follow 'previous', as returned by find_triples(). Fewer triples are returned only if no more triples match. */
+async_handle async_find_triples( model_handle model, const triple_t *pattern,
+                                 nid_t previous, unsigned count,
+                                 async_callback_t callback, void *context );
+
+
+/*  Returns a file descriptor that is readable while the completion queue is
+    not empty. It must not be read from or closed by the caller. */
+int async_fd();
+
+
+/*  Removes and returns the first request in the completion queue, or
+    returns NULL if the queue is empty. */
+async_handle async_completed();
+
+
+/*  Determines if a request has completed. */
+int async_is_done(async_handle request);
+
+
+/*  Waits until a request submitted without a callback has completed. */
+void async_wait(async_handle request);
+
+
+/*  Result accessors, which may only be called once a request has completed.
+
+    async_nid() returns the result of an identify_ or find_triple request,
+    async_triple() that of a resolve_triple request, and async_count() that of
+    an add_triple or remove_triple request. async_data() returns the node
+    data of a resolve_node request and sets '*size' to its size; the data is
+    freed by async_free(). async_nids() returns the triples found by a
+    find_triples request and sets '*count' to their number. */
+void *async_context(async_handle request);
+nid_t async_nid(async_handle request);
+triple_t async_triple(async_handle request);
+unsigned async_count(async_handle request);
+const void *async_data(async_handle request, size_t *size);
+const nid_t *async_nids(async_handle request, unsigned *count);
+
+
+/*  Releases a completed request. */
+void async_free(async_handle request);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef ASYNC_H_INCLUDED */
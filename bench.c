@@ -0,0 +1,479 @@
+/*  Benchmarks the triple database on a synthetic graph.
+
+    Usage: bench [scale [seed [directory]]]
+
+    Generates a deterministic university-like graph (in the style of the
+    LUBM benchmark) with 'scale' universities (default: 1) from the random
+    seed 'seed' (default: 1), stores it in a new store in 'directory'
+    (default: bench_store, which must not exist yet), and times the core
+    operations on it. The results are written to standard output as JSON.
+
+    Power-law distributions are used for the courses taken by students, the
+    number of publications per professor, the universities degrees are
+    obtained from, and the predicates of miscellaneous attributes. */
+
+#include "tripledb.h"
+#include "hash.h"
+#include "hashtable.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/*  The number of find_triple() queries per pattern type. */
+#define FIND_QUERIES 1000
+
+/*  The number of universities outside the generated graph. */
+#define EXTERNAL_UNIVERSITIES 1000
+
+/*  The number of miscellaneous attribute predicates. */
+#define EXTRA_PREDICATES 64
+
+/*  A generated triple, referring to nodes by their generation order. */
+typedef struct bench_triple
+{
+    unsigned nodes[3];
+} bench_triple_t;
+
+/*  A Zipf distribution over the integers 0 to size-1. */
+typedef struct zipf
+{
+    double *cdf;
+    unsigned size;
+} zipf_t;
+
+/*  A benchmark result. */
+typedef struct result
+{
+    const char *name;
+    unsigned long operations, matches;
+    double seconds;
+} result_t;
+
+static unsigned random_state;
+
+static char **names;            /* node data, by node number */
+static unsigned names_size, names_capacity;
+static ht_t name_numbers;       /* (char*)name => (unsigned)node number */
+
+static bench_triple_t *triples;
+static unsigned triples_size, triples_capacity;
+
+static result_t results[32];
+static unsigned results_size;
+
+
+/*  Returns the next number from a deterministic pseudo-random sequence
+    (xorshift32). */
+static unsigned next_random()
+{
+    random_state ^= (random_state << 13) & 0xFFFFFFFFu;
+    random_state ^= random_state >> 17;
+    random_state ^= (random_state << 5) & 0xFFFFFFFFu;
+    return random_state;
+}
+
+
+/*  Returns a pseudo-random number between 'low' and 'high' (inclusive). */
+static unsigned random_between(unsigned low, unsigned high)
+{
+    return low + next_random() % (high - low + 1);
+}
+
+
+static void create_zipf(zipf_t *zipf, unsigned size)
+{
+    double sum;
+    unsigned n;
+
+    zipf->cdf = (double*)malloc(size*sizeof(double));
+    assert(zipf->cdf);
+    zipf->size = size;
+    sum = 0;
+    for(n = 0; n < size; ++n)
+    {
+        sum += 1.0/(n + 1);
+        zipf->cdf[n] = sum;
+    }
+}
+
+
+/*  Returns a number drawn from a Zipf distribution; 0 is the most likely. */
+static unsigned random_zipf(const zipf_t *zipf)
+{
+    double value;
+    unsigned low, high, middle;
+
+    value = zipf->cdf[zipf->size - 1] * (next_random() % 1000000) / 1000000.0;
+    low = 0;
+    high = zipf->size - 1;
+    while(low < high)
+    {
+        middle = (low + high)/2;
+        if(zipf->cdf[middle] <= value)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+
+static double now()
+{
+    struct timeval time;
+
+    gettimeofday(&time, NULL);
+    return time.tv_sec + time.tv_usec/1e6;
+}
+
+
+/*  Returns the node number of the given node data, adding it if needed. */
+static unsigned node(const char *name)
+{
+    const void *number;
+
+    number = ht_get(&name_numbers, name, strlen(name), NULL);
+    if(number != NULL)
+        return *(const unsigned*)number;
+
+    if(names_size == names_capacity)
+    {
+        names_capacity = 2*names_capacity + 1024;
+        names = (char**)realloc(names, names_capacity*sizeof(char*));
+        assert(names);
+    }
+    names[names_size] = (char*)malloc(strlen(name) + 1);
+    assert(names[names_size]);
+    strcpy(names[names_size], name);
+    ht_put(&name_numbers, name, strlen(name), &names_size, sizeof(names_size));
+
+    return names_size++;
+}
+
+
+static void add(unsigned subject, unsigned predicate, unsigned object)
+{
+    if(triples_size == triples_capacity)
+    {
+        triples_capacity = 2*triples_capacity + 1024;
+        triples = (bench_triple_t*)realloc( triples,
+            triples_capacity*sizeof(bench_triple_t) );
+        assert(triples);
+    }
+    triples[triples_size].nodes[0] = subject;
+    triples[triples_size].nodes[1] = predicate;
+    triples[triples_size].nodes[2] = object;
+    ++triples_size;
+}
+
+
+/*  Adds a triple with a literal object. */
+static void add_literal(unsigned subject, unsigned predicate, const char *text)
+{
+    add(subject, predicate, node(text));
+}
+
+
+/*  Generates the graph of 'scale' universities. */
+static void generate(unsigned scale)
+{
+    char name[256], text[256];
+    zipf_t external, publications, courses, extras;
+    unsigned type, sub_organization, works_for, member_of, advisor,
+             takes_course, teacher_of, degree_from, publication_author,
+             name_predicate, email, extra[EXTRA_PREDICATES];
+    unsigned university, department, departments, courses_size,
+             professor[18], professors, student, students, publication,
+             n, u, d, p, s, c;
+    unsigned *course;
+
+    ht_create(&name_numbers, hash_fnv1);
+    create_zipf(&external, EXTERNAL_UNIVERSITIES);
+    create_zipf(&publications, 64);
+    create_zipf(&courses, 40);
+    course = (unsigned*)malloc(courses.size*sizeof(unsigned));
+    assert(course);
+    create_zipf(&extras, EXTRA_PREDICATES);
+
+    type = node("http://www.w3.org/1999/02/22-rdf-syntax-ns#type");
+    sub_organization = node("http://lubm.example/ub#subOrganizationOf");
+    works_for = node("http://lubm.example/ub#worksFor");
+    member_of = node("http://lubm.example/ub#memberOf");
+    advisor = node("http://lubm.example/ub#advisor");
+    takes_course = node("http://lubm.example/ub#takesCourse");
+    teacher_of = node("http://lubm.example/ub#teacherOf");
+    degree_from = node("http://lubm.example/ub#degreeFrom");
+    publication_author = node("http://lubm.example/ub#publicationAuthor");
+    name_predicate = node("http://lubm.example/ub#name");
+    email = node("http://lubm.example/ub#emailAddress");
+    for(n = 0; n < EXTRA_PREDICATES; ++n)
+    {
+        sprintf(name, "http://lubm.example/ub#attribute%u", n);
+        extra[n] = node(name);
+    }
+
+    for(u = 0; u < scale; ++u)
+    {
+        sprintf(name, "http://www.University%u.edu", u);
+        university = node(name);
+        add(university, type, node("http://lubm.example/ub#University"));
+
+        departments = random_between(12, 15);
+        for(d = 0; d < departments; ++d)
+        {
+            sprintf(name, "http://www.Department%u.University%u.edu", d, u);
+            department = node(name);
+            add(department, type, node("http://lubm.example/ub#Department"));
+            add(department, sub_organization, university);
+            sprintf(text, "Department%u", d);
+            add_literal(department, name_predicate, text);
+
+            /* Courses. */
+            courses_size = random_between(25, courses.size);
+            for(c = 0; c < courses_size; ++c)
+            {
+                sprintf(name, "%s/Course%u", names[department], c);
+                course[c] = node(name);
+                add(course[c], type, node("http://lubm.example/ub#Course"));
+                sprintf(text, "Course%u", c);
+                add_literal(course[c], name_predicate, text);
+            }
+
+            /* Professors, with a power-law number of publications. */
+            professors = random_between(10, 18);
+            for(p = 0; p < professors; ++p)
+            {
+                sprintf(name, "%s/Professor%u", names[department], p);
+                professor[p] = node(name);
+                add(professor[p], type, node(p < 7 ?
+                    "http://lubm.example/ub#FullProfessor" :
+                    "http://lubm.example/ub#AssociateProfessor" ));
+                add(professor[p], works_for, department);
+                sprintf(text, "Professor%u", p);
+                add_literal(professor[p], name_predicate, text);
+                sprintf(text, "Professor%u@Department%u.University%u.edu",
+                        p, d, u);
+                add_literal(professor[p], email, text);
+                sprintf(name, "http://www.University%u.edu",
+                        random_zipf(&external));
+                add(professor[p], degree_from, node(name));
+                for(n = random_between(1, 2); n > 0; --n)
+                {
+                    add( professor[p], teacher_of,
+                         course[next_random() % courses_size] );
+                }
+                for(n = 1 + random_zipf(&publications); n > 0; --n)
+                {
+                    sprintf(name, "%s/Publication%u", names[professor[p]], n);
+                    publication = node(name);
+                    add(publication, publication_author, professor[p]);
+                }
+            }
+
+            /* Students, taking courses with a power-law popularity. */
+            students = random_between(100, 200);
+            for(s = 0; s < students; ++s)
+            {
+                sprintf(name, "%s/Student%u", names[department], s);
+                student = node(name);
+                add(student, type, node(s < students/4 ?
+                    "http://lubm.example/ub#GraduateStudent" :
+                    "http://lubm.example/ub#UndergraduateStudent" ));
+                add(student, member_of, department);
+                sprintf(text, "Student%u", s);
+                add_literal(student, name_predicate, text);
+                sprintf(text, "Student%u@Department%u.University%u.edu",
+                        s, d, u);
+                add_literal(student, email, text);
+                for(n = random_between(2, 4); n > 0; --n)
+                {
+                    c = random_zipf(&courses) % courses_size;
+                    add(student, takes_course, course[c]);
+                }
+                if(s < students/4 || next_random() % 5 == 0)
+                    add(student, advisor, professor[s % professors]);
+
+                /* Miscellaneous attributes with power-law predicates. */
+                for(n = next_random() % 4; n > 0; --n)
+                {
+                    sprintf(text, "value%u", next_random() % 1000);
+                    add_literal(student, extra[random_zipf(&extras)], text);
+                }
+            }
+        }
+    }
+
+    free(course);
+    free(external.cdf);
+    free(publications.cdf);
+    free(courses.cdf);
+    free(extras.cdf);
+}
+
+
+static void record( const char *name, unsigned long operations,
+                    unsigned long matches, double seconds )
+{
+    assert(results_size < sizeof(results)/sizeof(results[0]));
+    results[results_size].name = name;
+    results[results_size].operations = operations;
+    results[results_size].matches = matches;
+    results[results_size].seconds = seconds;
+    ++results_size;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const char *find_names[8] = {
+        "find_triple_xxx", "find_triple_sxx", "find_triple_xpx",
+        "find_triple_spx", "find_triple_xxo", "find_triple_sxo",
+        "find_triple_xpo", "find_triple_spo" };
+    unsigned scale, seed, n, m, mask, position, queries;
+    unsigned long operations, matches, added;
+    const char *directory;
+    nid_t *nids, *tids, nid;
+    model_handle model, copy;
+    triple_t triple, pattern;
+    double start;
+
+    if(argc > 4)
+    {
+        fprintf(stderr, "usage: %s [scale [seed [directory]]]\n", argv[0]);
+        return 1;
+    }
+    scale = argc > 1 ? (unsigned)atoi(argv[1]) : 1;
+    seed = argc > 2 ? (unsigned)atoi(argv[2]) : 1;
+    directory = argc > 3 ? argv[3] : "bench_store";
+
+    if(mkdir(directory, 0700) != 0 || chdir(directory) != 0)
+    {
+        perror(directory);
+        return 1;
+    }
+
+    random_state = seed != 0 ? seed : 1;
+    generate(scale);
+
+    tripledb_initialize();
+    nids = (nid_t*)malloc(names_size*sizeof(nid_t));
+    tids = (nid_t*)malloc(triples_size*sizeof(nid_t));
+    assert(nids && tids);
+
+    /* Node and triple identification, for new and for existing data. */
+    start = now();
+    for(n = 0; n < names_size; ++n)
+        nids[n] = identify_node(names[n], strlen(names[n]));
+    record("identify_node_new", names_size, 0, now() - start);
+
+    start = now();
+    for(n = 0; n < names_size; ++n)
+        nid = identify_node(names[n], strlen(names[n]));
+    record("identify_node_existing", names_size, 0, now() - start);
+
+    start = now();
+    for(n = 0; n < triples_size; ++n)
+    {
+        for(position = 0; position < 3; ++position)
+            triple.nodes[position] = nids[triples[n].nodes[position]];
+        tids[n] = identify_triple(&triple);
+    }
+    record("identify_triple_new", triples_size, 0, now() - start);
+
+    start = now();
+    for(n = 0; n < triples_size; ++n)
+    {
+        for(position = 0; position < 3; ++position)
+            triple.nodes[position] = nids[triples[n].nodes[position]];
+        nid = identify_triple(&triple);
+    }
+    record("identify_triple_existing", triples_size, 0, now() - start);
+
+    /* Model updates. */
+    model = open_model("bench");
+    start = now();
+    added = 0;
+    for(n = 0; n < triples_size; ++n)
+        added += add_triple(model, tids[n]);
+    record("add_triple", triples_size, added, now() - start);
+
+    /* Pattern queries, for each combination of bound positions. The
+       patterns are taken from generated triples, so each has a match; they
+       are built from the generated node identifiers, so that no triple is
+       resolved while the queries are timed. */
+    for(mask = 0; mask < 8; ++mask)
+    {
+        queries = (mask == 0 ? 1 : FIND_QUERIES);
+        operations = matches = 0;
+        start = now();
+        for(n = 0; n < queries; ++n)
+        {
+            m = (n*7919u) % triples_size;
+            for(position = 0; position < 3; ++position)
+            {
+                if(mask & (1 << position))
+                {
+                    pattern.nodes[position] =
+                        nids[triples[m].nodes[position]];
+                }
+                else
+                    NID_SET_NULL(pattern.nodes[position]);
+            }
+            NID_SET_NULL(nid);
+            do {
+                nid = find_triple(model, &pattern, nid);
+                ++operations;
+            } while(!NID_IS_NULL(nid) && ++matches);
+        }
+        record(find_names[mask], operations, matches, now() - start);
+    }
+
+    /* Whole-model operations. */
+    copy = open_model(NULL);
+    start = now();
+    absorb_model(copy, model);
+    record("absorb_model", added, added, now() - start);
+
+    start = now();
+    matches = empty_model(copy);
+    record("empty_model", added, matches, now() - start);
+    close_model(copy);
+
+    close_model(model);
+    tripledb_finalize();
+
+    /* Report results. */
+    printf("{\n");
+    printf("  \"scale\": %u,\n  \"seed\": %u,\n", scale, seed);
+    printf("  \"nodes\": %u,\n  \"triples\": %u,\n", names_size, triples_size);
+    printf("  \"results\": [\n");
+    for(n = 0; n < results_size; ++n)
+    {
+        printf( "    { \"name\": \"%s\", \"operations\": %lu, "
+                "\"matches\": %lu, \"seconds\": %.6f, "
+                "\"operations_per_second\": %.1f }%s\n",
+                results[n].name, results[n].operations, results[n].matches,
+                results[n].seconds,
+                results[n].seconds > 0 ?
+                    results[n].operations/results[n].seconds : 0.0,
+                n + 1 < results_size ? "," : "" );
+    }
+    printf("  ]\n}\n");
+
+    for(n = 0; n < names_size; ++n)
+        free(names[n]);
+    free(names);
+    free(triples);
+    free(nids);
+    free(tids);
+    ht_destroy(&name_numbers);
+
+    return 0;
+}
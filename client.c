@@ -0,0 +1,488 @@
+#include "client.h"
+#include "protocol.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef THREADSAFE
+#include <pthread.h>
+
+#define MUTEX_INIT(mutex) \
+    { int result = pthread_mutex_init(&mutex, NULL); assert(result == 0); }
+
+#define MUTEX_DESTROY(mutex) \
+    { int result = pthread_mutex_destroy(&mutex); assert(result == 0); }
+
+#define MUTEX_LOCK(mutex) \
+    { int result = pthread_mutex_lock(&mutex); assert(result == 0); }
+
+#define MUTEX_UNLOCK(mutex) \
+    { int result = pthread_mutex_unlock(&mutex); assert(result == 0); }
+
+#else  /* def THREADSAFE */
+#warning "THREADSAFE not defined; the resulting library is not thread safe!"
+#define MUTEX_INIT(mutex)    ((void)0)
+#define MUTEX_DESTROY(mutex) ((void)0)
+#define MUTEX_LOCK(mutex)    ((void)0)
+#define MUTEX_UNLOCK(mutex)  ((void)0)
+#endif  /* def THREADSAFE */
+
+/*  The smallest and largest number of triples fetched by find_triple(). The
+    first batch of a search is small, as often only the first match is used;
+    every following batch is twice as large. */
+#define MIN_FIND_BATCH 16
+#define MAX_FIND_BATCH 1024
+
+/*  The largest number of requests sent before reading their responses. This
+    keeps the responses within the amount of output the server buffers for a
+    connection that is not reading, so neither side blocks the other. */
+#define MAX_PIPELINED 4096
+
+/*  A model handle refers to a model opened on the server. */
+typedef struct model
+{
+    unsigned number;
+} model_t;
+
+/*  Triples fetched from the server by find_triple(). */
+typedef struct find_batch
+{
+    unsigned model;
+    triple_t pattern;
+    nid_t nids[MAX_FIND_BATCH];
+    unsigned size;          /* number of triples fetched; 0 if empty */
+    unsigned requested;     /* number of triples requested */
+    unsigned position;      /* next triple to return */
+} find_batch_t;
+
+static int server = -1;         /* the server socket */
+static char *requests;          /* requests not sent yet */
+static unsigned requests_size, requests_capacity;
+static find_batch_t batch;
+
+#ifdef THREADSAFE
+/*  Protects all of the above; requests and their responses must not be
+    interleaved. */
+static pthread_mutex_t client_mutex;
+#endif
+
+
+/*  Appends a request to the requests to be sent. */
+static void queue_request(unsigned operation, const void *data, unsigned size)
+{
+    request_header_t header;
+
+    if(requests_size + sizeof(header) + size > requests_capacity)
+    {
+        requests_capacity = 2*requests_capacity + sizeof(header) + size;
+        requests = (char*)realloc(requests, requests_capacity);
+        assert(requests);
+    }
+
+    header.size = size;
+    header.operation = operation;
+    memcpy(requests + requests_size, &header, sizeof(header));
+    requests_size += sizeof(header);
+    if(size > 0)
+    {
+        memcpy(requests + requests_size, data, size);
+        requests_size += size;
+    }
+}
+
+
+/*  Sends all queued requests to the server. */
+static void send_requests()
+{
+    unsigned position;
+    ssize_t sent;
+
+    for(position = 0; position < requests_size; position += sent)
+    {
+        sent = write(server, requests + position, requests_size - position);
+        assert(sent > 0);
+    }
+    requests_size = 0;
+}
+
+
+/*  Reads exactly 'size' bytes from the server. */
+static void receive(void *data, unsigned size)
+{
+    unsigned position;
+    ssize_t received;
+
+    for(position = 0; position < size; position += received)
+    {
+        received = read(server, (char*)data + position, size - position);
+        assert(received > 0);
+    }
+}
+
+
+/*  Sends all queued requests and receives the response to the first one,
+    which must contain exactly 'size' bytes of data. If the server rejected
+    a node identifier in the request, the data is set to zero bytes, which
+    reads as a null node identifier, a null triple or a count of 0. */
+static void receive_response(void *data, unsigned size)
+{
+    response_header_t header;
+
+    send_requests();
+    receive(&header, sizeof(header));
+    if(header.status == RESPONSE_INVALID_NID)
+    {
+        assert(header.size == 0);
+        memset(data, 0, size);
+        return;
+    }
+    assert(header.status == RESPONSE_OK);
+    assert(header.size == size);
+    receive(data, size);
+}
+
+
+/*  Sends all queued requests and receives the response to the first one,
+    which may contain any amount of data. Returns a buffer containing the
+    data, which must be freed by the caller, and sets '*size' to its size.
+    Returns NULL and sets '*size' to 0 if the server rejected a node
+    identifier in the request. */
+static void *receive_response_data(unsigned *size)
+{
+    response_header_t header;
+    void *data;
+
+    send_requests();
+    receive(&header, sizeof(header));
+    if(header.status == RESPONSE_INVALID_NID)
+    {
+        assert(header.size == 0);
+        *size = 0;
+        return NULL;
+    }
+    assert(header.status == RESPONSE_OK);
+    data = malloc(header.size > 0 ? header.size : 1);
+    assert(data != NULL);
+    receive(data, header.size);
+    *size = header.size;
+
+    return data;
+}
+
+
+/*  Performs a request with a response of a fixed size. */
+static void call( unsigned operation, const void *request, unsigned size,
+                  void *response, unsigned response_size )
+{
+    MUTEX_LOCK(client_mutex);
+    queue_request(operation, request, size);
+    receive_response(response, response_size);
+    MUTEX_UNLOCK(client_mutex);
+}
+
+
+int tripledb_connect(const char *path)
+{
+    struct sockaddr_un address;
+
+    assert(server < 0);
+
+    if(strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server < 0)
+        return -1;
+    if(connect(server, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(server);
+        server = -1;
+        return -1;
+    }
+    batch.size = 0;
+
+    /* Initialize synchronization primitives. */
+    MUTEX_INIT(client_mutex);
+
+    return 0;
+}
+
+
+void tripledb_initialize()
+{
+    const char *path;
+    int result;
+
+    path = getenv("TRIPLEDB_SOCKET");
+    result = tripledb_connect(path != NULL ? path : PROTOCOL_SOCKET_PATH);
+    assert(result == 0);
+}
+
+
+void tripledb_initialize_options(const tripledb_options_t *options)
+{
+    tripledb_initialize();
+}
+
+
+void tripledb_finalize()
+{
+    close(server);
+    server = -1;
+    free(requests);
+    requests = NULL;
+    requests_size = requests_capacity = 0;
+
+    /* Finalize synchronization primitives. */
+    MUTEX_DESTROY(client_mutex);
+}
+
+
+model_handle open_model(const char *name)
+{
+    model_t *model;
+
+    model = (model_t*)malloc(sizeof(model_t));
+    assert(model);
+    call( REQUEST_OPEN_MODEL, name, name != NULL ? strlen(name) + 1 : 0,
+          &model->number, sizeof(model->number) );
+
+    return model;
+}
+
+
+void close_model(model_handle model)
+{
+    if(model != NULL)
+    {
+        call( REQUEST_CLOSE_MODEL, &model->number, sizeof(model->number),
+              NULL, 0 );
+        free(model);
+    }
+}
+
+
+nid_t identify_node(const void *data, size_t size)
+{
+    nid_t nid;
+
+    call(REQUEST_IDENTIFY_NODE, data, size, &nid, sizeof(nid));
+
+    return nid;
+}
+
+
+nid_t identify_triple(triple_t *triple)
+{
+    nid_t nid;
+
+    call(REQUEST_IDENTIFY_TRIPLE, triple, sizeof(*triple), &nid, sizeof(nid));
+
+    return nid;
+}
+
+
+const void *resolve_node(nid_t nid, void *data, size_t *size)
+{
+    void *node_data;
+    unsigned node_size;
+
+    MUTEX_LOCK(client_mutex);
+    queue_request(REQUEST_RESOLVE_NODE, &nid, sizeof(nid));
+    node_data = receive_response_data(&node_size);
+    MUTEX_UNLOCK(client_mutex);
+
+    if(node_data == NULL)
+    {
+        /* Rejected by the server. */
+        *size = 0;
+        return NULL;
+    }
+    if(data != NULL)
+    {
+        if(node_size <= *size)
+        {
+            /* Fill external buffer with node data. */
+            memcpy(data, node_data, node_size);
+        }
+        else
+        {
+            /* External buffer too small; only set data size. */
+            data = NULL;
+        }
+        free(node_data);
+        node_data = data;
+    }
+    *size = node_size;
+
+    return node_data;
+}
+
+
+void free_data(const void *data)
+{
+    free((void*)data);
+}
+
+
+triple_t resolve_triple(nid_t nid)
+{
+    triple_t triple;
+
+    call(REQUEST_RESOLVE_TRIPLE, &nid, sizeof(nid), &triple, sizeof(triple));
+
+    return triple;
+}
+
+
+/*  Adds or removes triples, pipelining the requests. */
+static unsigned update_triples( unsigned operation, model_handle model,
+                                const nid_t *nids, unsigned count )
+{
+    model_triple_request_t request;
+    unsigned n, m, result, total;
+
+    MUTEX_LOCK(client_mutex);
+    batch.size = 0;
+    request.model = model->number;
+    total = 0;
+    for(n = 0; n < count; n += m)
+    {
+        for(m = 0; m < MAX_PIPELINED && n + m < count; ++m)
+        {
+            request.nid = nids[n + m];
+            queue_request(operation, &request, sizeof(request));
+        }
+        for(m = 0; m < MAX_PIPELINED && n + m < count; ++m)
+        {
+            receive_response(&result, sizeof(result));
+            total += result;
+        }
+    }
+    MUTEX_UNLOCK(client_mutex);
+
+    return total;
+}
+
+
+unsigned add_triple(model_handle model, nid_t nid)
+{
+    return update_triples(REQUEST_ADD_TRIPLE, model, &nid, 1);
+}
+
+
+unsigned add_triples(model_handle model, const nid_t *nids, unsigned count)
+{
+    return update_triples(REQUEST_ADD_TRIPLE, model, nids, count);
+}
+
+
+unsigned remove_triple(model_handle model, nid_t nid)
+{
+    return update_triples(REQUEST_REMOVE_TRIPLE, model, &nid, 1);
+}
+
+
+unsigned remove_triples(model_handle model, const nid_t *nids, unsigned count)
+{
+    return update_triples(REQUEST_REMOVE_TRIPLE, model, nids, count);
+}
+
+
+/*  Fetches the next batch of triples for a search. */
+static void fetch_batch(unsigned count, nid_t previous)
+{
+    find_triples_request_t request;
+    nid_t *nids;
+    unsigned size;
+
+    request.model = batch.model;
+    request.pattern = batch.pattern;
+    request.previous = previous;
+    request.count = count;
+    queue_request(REQUEST_FIND_TRIPLES, &request, sizeof(request));
+    nids = (nid_t*)receive_response_data(&size);
+    assert(size % sizeof(nid_t) == 0 && size <= count*sizeof(nid_t));
+
+    if(size > 0)
+        memcpy(batch.nids, nids, size);
+    free(nids);
+    batch.size = size/sizeof(nid_t);
+    batch.requested = count;
+    batch.position = 0;
+}
+
+
+nid_t find_triple(model_handle model, triple_t *pattern, nid_t previous)
+{
+    nid_t nid;
+
+    MUTEX_LOCK(client_mutex);
+    if( batch.size > 0 && batch.model == model->number &&
+        memcmp(&batch.pattern, pattern, sizeof(triple_t)) == 0 &&
+        batch.position > 0 &&
+        NID_IS_EQUAL(previous, batch.nids[batch.position - 1]) )
+    {
+        /* Continue a search. */
+        if(batch.position == batch.size && batch.size == batch.requested)
+        {
+            fetch_batch( batch.requested < MAX_FIND_BATCH/2 ?
+                         2*batch.requested : MAX_FIND_BATCH, previous );
+        }
+    }
+    else
+    {
+        /* Start a new search. */
+        batch.model = model->number;
+        batch.pattern = *pattern;
+        fetch_batch(MIN_FIND_BATCH, previous);
+    }
+
+    if(batch.position < batch.size)
+    {
+        nid = batch.nids[batch.position++];
+    }
+    else
+    {
+        /* No more matching triples; the search can not be continued. */
+        NID_SET_NULL(nid);
+        batch.size = 0;
+    }
+    MUTEX_UNLOCK(client_mutex);
+
+    return nid;
+}
+
+
+unsigned empty_model(model_handle model)
+{
+    unsigned count;
+
+    MUTEX_LOCK(client_mutex);
+    batch.size = 0;
+    MUTEX_UNLOCK(client_mutex);
+    call( REQUEST_EMPTY_MODEL, &model->number, sizeof(model->number),
+          &count, sizeof(count) );
+
+    return count;
+}
+
+
+void absorb_model(model_handle destination, model_handle source)
+{
+    absorb_model_request_t request;
+
+    MUTEX_LOCK(client_mutex);
+    batch.size = 0;
+    MUTEX_UNLOCK(client_mutex);
+    request.destination = destination->number;
+    request.source = source->number;
+    call(REQUEST_ABSORB_MODEL, &request, sizeof(request), NULL, 0);
+}
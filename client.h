@@ -0,0 +1,56 @@
+#ifndef CLIENT_H_INCLUDED
+#define CLIENT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "tripledb.h"
+
+/*  The client library (client.c) implements the following functions declared
+    in tripledb.h by forwarding them to a triple database server (server.c):
+
+        tripledb_initialize(), tripledb_initialize_options(),
+        tripledb_finalize(), open_model(), close_model(), identify_node(),
+        identify_triple(), resolve_node(), free_data(), resolve_triple(),
+        add_triple(), remove_triple(), remove_triples(), find_triple(),
+        empty_model(), absorb_model()
+
+    A program linked with the client library instead of the triple database
+    library uses the store owned by the server. tripledb_initialize()
+    connects to the socket named by the TRIPLEDB_SOCKET environment variable,
+    or to PROTOCOL_SOCKET_PATH (see protocol.h) if it is not set; options
+    passed to tripledb_initialize_options() are ignored, as the store is
+    configured by the server.
+
+    remove_triples() sends all requests to the server before waiting for a
+    response, like add_triples() below.
+
+    find_triple() fetches matching triples from the server in batches, so
+    iterating over a large result requires few round trips. Batches fetched
+    before a modification made through this client are discarded.
+
+    Node identifiers are validated by the server (see is_valid_nid()) instead
+    of failing an assertion. A function passed a node identifier that does
+    not exist returns the null node identifier, a null triple or 0, and
+    resolve_node() returns NULL and sets '*size' to 0. */
+
+
+/*  Connects to the server listening on the socket at 'path', instead of
+    calling tripledb_initialize(). Returns 0 on success, or -1 if no
+    connection could be made. */
+int tripledb_connect(const char *path);
+
+
+/*  Adds 'count' triples to the given model, like calling add_triple() for
+    each of them, but sending all requests to the server before waiting for
+    a response. Returns the number of triples added. */
+unsigned add_triples(model_handle model, const nid_t *nids, unsigned count);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef CLIENT_H_INCLUDED */
@@ -0,0 +1,249 @@
+#include "inference.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+
+/*  State of the evaluation of a single rule. */
+typedef struct inference
+{
+    model_handle target, source;
+    model_handle delta;         /* triples inferred in the previous round */
+    model_handle inferred;      /* triples inferred in the current round */
+    const rule_t *rule;
+    unsigned delta_pattern;     /* body pattern matched against 'delta' */
+    nid_t bindings[RULE_MAX_VARIABLES + 1];
+    unsigned added;
+} inference_t;
+
+
+/*  Returns the node a term currently refers to; the null node for an unbound
+    variable. */
+static nid_t term_node(const inference_t *inference, const rule_term_t *term)
+{
+    assert(term->variable <= RULE_MAX_VARIABLES);
+    return term->variable == 0 ? term->node
+                               : inference->bindings[term->variable];
+}
+
+
+/*  Determines if the given triple is contained in a model. */
+static int contains_triple(model_handle model, triple_t *triple)
+{
+    nid_t nid;
+
+    NID_SET_NULL(nid);
+    return !NID_IS_NULL(find_triple(model, triple, nid));
+}
+
+
+/*  Binds the unbound variables in 'pattern' to the respective nodes in
+    'triple'. The variables that were bound are stored in 'bound'. Returns
+    0 if a variable occurring more than once in the pattern cannot be bound
+    consistently, or 1 otherwise. */
+static int bind_pattern( inference_t *inference, const rule_pattern_t *pattern,
+                         const triple_t *triple, unsigned *bound )
+{
+    unsigned term, variable;
+    int consistent;
+
+    consistent = 1;
+    for(term = 0; term < 3; ++term)
+    {
+        bound[term] = 0;
+        variable = pattern->terms[term].variable;
+        if(variable == 0)
+            continue;
+
+        if(NID_IS_NULL(inference->bindings[variable]))
+        {
+            inference->bindings[variable] = triple->nodes[term];
+            bound[term] = variable;
+        }
+        else
+        if(!NID_IS_EQUAL(inference->bindings[variable], triple->nodes[term]))
+        {
+            consistent = 0;
+        }
+    }
+
+    return consistent;
+}
+
+
+/*  Unbinds the variables bound by bind_pattern(). */
+static void unbind_pattern(inference_t *inference, const unsigned *bound)
+{
+    unsigned term;
+
+    for(term = 0; term < 3; ++term)
+    {
+        if(bound[term] != 0)
+            NID_SET_NULL(inference->bindings[bound[term]]);
+    }
+}
+
+
+/*  Instantiates the head of the rule with the current bindings, and adds
+    the resulting triple to the inferred model if it is new. */
+static void infer_head(inference_t *inference)
+{
+    triple_t triple;
+    unsigned term;
+    nid_t nid;
+
+    for(term = 0; term < 3; ++term)
+    {
+        triple.nodes[term] =
+            term_node(inference, &inference->rule->head.terms[term]);
+        assert(!NID_IS_NULL(triple.nodes[term]));
+    }
+
+    if( contains_triple(inference->source, &triple) ||
+        contains_triple(inference->target, &triple) )
+    {
+        return;
+    }
+
+    nid = identify_triple(&triple);
+    inference->added += add_triple(inference->inferred, nid);
+}
+
+
+/*  Matches the body patterns of the rule from 'position' onwards, and infers
+    the head for every complete match. The pattern at 'delta_pattern' is
+    matched against the delta, the patterns before it against the other
+    triples, and the patterns after it against all triples. */
+static void match_body(inference_t *inference, unsigned position)
+{
+    const rule_pattern_t *pattern;
+    model_handle models[2];
+    unsigned models_size, n, term, bound[3];
+    triple_t query, triple;
+    nid_t nid;
+
+    if(position == inference->rule->body_size)
+    {
+        infer_head(inference);
+        return;
+    }
+
+    /* Select the models to match this pattern against. */
+    models_size = 0;
+    if(position == inference->delta_pattern)
+    {
+        models[models_size++] = inference->delta;
+    }
+    else
+    {
+        models[models_size++] = inference->source;
+        if(inference->target != inference->source)
+            models[models_size++] = inference->target;
+    }
+
+    pattern = &inference->rule->body[position];
+    for(term = 0; term < 3; ++term)
+        query.nodes[term] = term_node(inference, &pattern->terms[term]);
+
+    for(n = 0; n < models_size; ++n)
+    {
+        NID_SET_NULL(nid);
+        while(nid = find_triple(models[n], &query, nid), !NID_IS_NULL(nid))
+        {
+            triple = resolve_triple(nid);
+
+            /* Patterns before the delta pattern only match triples from
+               before the previous round, so that a match of several triples
+               in the delta is only found for the first of them. */
+            if( position < inference->delta_pattern &&
+                contains_triple(inference->delta, &triple) )
+            {
+                continue;
+            }
+
+            if(bind_pattern(inference, pattern, &triple, bound))
+                match_body(inference, position + 1);
+            unbind_pattern(inference, bound);
+        }
+    }
+}
+
+
+/*  Verifies that every variable in the head of a rule occurs in its body. */
+static int is_valid_rule(const rule_t *rule)
+{
+    unsigned head_term, pattern, term, variable;
+    int found;
+
+    for(head_term = 0; head_term < 3; ++head_term)
+    {
+        variable = rule->head.terms[head_term].variable;
+        if(variable == 0)
+            continue;
+        if(variable > RULE_MAX_VARIABLES)
+            return 0;
+
+        found = 0;
+        for(pattern = 0; pattern < rule->body_size; ++pattern)
+        {
+            for(term = 0; term < 3; ++term)
+                found |= rule->body[pattern].terms[term].variable == variable;
+        }
+        if(!found)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+unsigned infer_triples( model_handle target, model_handle source,
+                        const rule_t *rules, unsigned rules_size )
+{
+    inference_t inference;
+    unsigned rule, variable, added, total;
+
+    for(rule = 0; rule < rules_size; ++rule)
+        assert(is_valid_rule(&rules[rule]));
+
+    inference.target = target;
+    inference.source = source;
+    for(variable = 0; variable <= RULE_MAX_VARIABLES; ++variable)
+        NID_SET_NULL(inference.bindings[variable]);
+
+    /* Initially, all existing triples are new. */
+    inference.delta = open_model(NULL);
+    absorb_model(inference.delta, source);
+    if(target != source)
+        absorb_model(inference.delta, target);
+
+    total = 0;
+    do {
+        inference.inferred = open_model(NULL);
+        inference.added = 0;
+
+        for(rule = 0; rule < rules_size; ++rule)
+        {
+            inference.rule = &rules[rule];
+            for( inference.delta_pattern = 0;
+                 inference.delta_pattern < rules[rule].body_size;
+                 ++inference.delta_pattern )
+            {
+                match_body(&inference, 0);
+            }
+        }
+
+        /* Add the triples inferred in this round to the target model; they
+           form the delta for the next round. */
+        added = inference.added;
+        absorb_model(target, inference.inferred);
+        total += added;
+
+        close_model(inference.delta);
+        inference.delta = inference.inferred;
+    } while(added > 0);
+
+    close_model(inference.delta);
+
+    return total;
+}
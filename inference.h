@@ -0,0 +1,64 @@
+#ifndef INFERENCE_H_INCLUDED
+#define INFERENCE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "tripledb.h"
+
+/*  The maximum number of distinct variables in a rule. */
+#define RULE_MAX_VARIABLES 16
+
+/*  A term in a rule pattern: either a variable or a fixed node. */
+typedef struct rule_term
+{
+    unsigned variable;  /* variable number (1 to RULE_MAX_VARIABLES),
+                           or 0 for a fixed node */
+    nid_t node;         /* fixed node identifier; ignored for variables */
+} rule_term_t;
+
+/*  A triple pattern in a rule, consisting of a subject, predicate and object
+    term. */
+typedef struct rule_pattern
+{
+    rule_term_t terms[3];
+} rule_pattern_t;
+
+/*  An inference rule. For every assignment of nodes to variables for which
+    all patterns in the body match a triple, the triple described by the head
+    pattern is inferred. Every variable in the head must occur in the body.
+
+    For example, transitivity of a property P is expressed by the body
+    (?1, P, ?2), (?2, P, ?3) and the head (?1, P, ?3). */
+typedef struct rule
+{
+    rule_pattern_t head;
+    const rule_pattern_t *body;
+    unsigned body_size;
+} rule_t;
+
+
+/*  Applies the given rules to the triples in the 'source' and 'target' models
+    until no new triples can be inferred, and adds the inferred triples to the
+    'target' model. 'source' may be equal to 'target'.
+
+    Rules are evaluated semi-naively: in each round, every rule is evaluated
+    only for matches in which at least one body pattern matches a triple
+    inferred in the previous round, and each such match is found once, for
+    the first body pattern that matches such a triple. A match is therefore
+    found only in the round after the newest of its triples was inferred,
+    and never again. The triples inferred in a round are collected in an
+    anonymous model and added to the target model with absorb_model().
+
+    Returns the number of triples added to the target model. */
+unsigned infer_triples( model_handle target, model_handle source,
+                        const rule_t *rules, unsigned rules_size );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef INFERENCE_H_INCLUDED */
@@ -0,0 +1,96 @@
+#ifndef PROTOCOL_H_INCLUDED
+#define PROTOCOL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "tripledb.h"
+
+/*  The protocol spoken between the triple database server (server.c) and its
+    client library (client.c) over a Unix domain socket.
+
+    Every request consists of a request header followed by 'size' bytes of
+    request data, and is answered by a response header followed by 'size'
+    bytes of response data. Integers and node identifiers are sent in host
+    byte order, as client and server always run on the same machine.
+
+    Requests on a connection are processed in order and their responses are
+    sent in the same order, so a client may send any number of requests
+    before reading their responses (pipelining). */
+
+typedef struct request_header
+{
+    unsigned size;      /* size of the request data in bytes */
+    unsigned operation; /* one of the REQUEST_ constants */
+} request_header_t;
+
+typedef struct response_header
+{
+    unsigned size;      /* size of the response data in bytes */
+    unsigned status;    /* one of the RESPONSE_ constants */
+} response_header_t;
+
+/*  Requests. Model handles are sent as the unsigned model number returned by
+    REQUEST_OPEN_MODEL; they are only valid on the connection that opened
+    them, and are closed when the connection is closed.
+
+    Request                 Request data                Response data */
+#define REQUEST_OPEN_MODEL       1  /* name (see below)         model number */
+#define REQUEST_CLOSE_MODEL      2  /* model number             - */
+#define REQUEST_IDENTIFY_NODE    3  /* node data                nid */
+#define REQUEST_IDENTIFY_TRIPLE  4  /* triple                   nid */
+#define REQUEST_RESOLVE_NODE     5  /* nid                      node data */
+#define REQUEST_RESOLVE_TRIPLE   6  /* nid                      triple */
+#define REQUEST_ADD_TRIPLE       7  /* model_triple_request_t   count */
+#define REQUEST_REMOVE_TRIPLE    8  /* model_triple_request_t   count */
+#define REQUEST_FIND_TRIPLES     9  /* find_triples_request_t   nids */
+#define REQUEST_EMPTY_MODEL     10  /* model number             count */
+#define REQUEST_ABSORB_MODEL    11  /* absorb_model_request_t   - */
+
+/*  Model names are sent including their terminating zero byte, so that
+    empty request data (an anonymous model) differs from an empty name. */
+
+typedef struct model_triple_request
+{
+    unsigned model;
+    nid_t nid;          /* triple node identifier */
+} model_triple_request_t;
+
+/*  Returns up to 'count' triples matching 'pattern' that follow 'previous',
+    as find_triple() would return them in successive calls. Fewer than
+    'count' triples are returned only if no more triples match. */
+typedef struct find_triples_request
+{
+    unsigned model;
+    triple_t pattern;
+    nid_t previous;
+    unsigned count;
+} find_triples_request_t;
+
+typedef struct absorb_model_request
+{
+    unsigned destination, source;
+} absorb_model_request_t;
+
+/*  Response status. A request that refers to a node identifier that does
+    not exist (see is_valid_nid()), or a node identifier of the wrong kind,
+    is answered with RESPONSE_INVALID_NID and no response data. A request
+    that cannot be processed otherwise, such as a request with data of the
+    wrong size, is not answered; instead, the server closes the connection. */
+#define RESPONSE_OK              0
+#define RESPONSE_INVALID_NID     1
+
+/*  The largest amount of request or response data accepted. */
+#define PROTOCOL_MAX_SIZE   (1 << 24)
+
+/*  The default path of the server socket. */
+#define PROTOCOL_SOCKET_PATH    "tripledb.sock"
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef PROTOCOL_H_INCLUDED */
@@ -0,0 +1,547 @@
+/*  tripledbd: serves a triple database over a Unix domain socket, so that
+    several processes can share a store (see protocol.h and client.c).
+
+    Usage: tripledbd [directory [socket]]
+
+    The store in 'directory' (default: the current directory) is opened and
+    served on the socket 'socket' (default: PROTOCOL_SOCKET_PATH), which is
+    relative to the store directory. The server runs until it is interrupted.
+
+    All connections are served by a single thread, using an event loop that
+    waits for socket events with poll(). Every request that has been received
+    completely is processed as soon as its connection becomes readable, and the
+    responses are sent back together, so pipelined requests cost a single
+    read and write per batch. Node identifiers received from clients are
+    validated before use, so a request referring to a nonexistent node is
+    answered with an error status (see protocol.h) instead of failing an
+    assertion in the server. */
+
+#include "tripledb.h"
+#include "protocol.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*  The largest number of triples returned for a single find request. */
+#define MAX_FIND_COUNT 4096
+
+/*  The amount of buffer space used for reading requests. */
+#define READ_SIZE 65536
+
+/*  Reading requests from a connection is suspended while more than this
+    amount of response data has not been sent yet. */
+#define MAX_PENDING_OUTPUT (1 << 20)
+
+typedef struct buffer
+{
+    char *data;
+    unsigned size, capacity;
+} buffer_t;
+
+typedef struct connection
+{
+    int fd;                 /* -1 once the connection has been closed */
+    buffer_t input, output;
+    unsigned output_sent;   /* bytes of 'output' that have been sent */
+    model_handle *models;   /* by model number; NULL if not in use */
+    unsigned models_size;
+} connection_t;
+
+static volatile sig_atomic_t interrupted;
+
+
+static void interrupt(int signal_number)
+{
+    interrupted = 1;
+}
+
+
+/*  Ensures a buffer has room for 'size' more bytes. */
+static void reserve_buffer(buffer_t *buffer, unsigned size)
+{
+    if(buffer->size + size > buffer->capacity)
+    {
+        buffer->capacity = 2*buffer->capacity;
+        if(buffer->capacity < buffer->size + size)
+            buffer->capacity = buffer->size + size;
+        buffer->data = (char*)realloc(buffer->data, buffer->capacity);
+        assert(buffer->data);
+    }
+}
+
+
+/*  Appends a response with the given status to the output buffer of a
+    connection. */
+static void respond_status( connection_t *connection, unsigned status,
+                            const void *data, unsigned size )
+{
+    response_header_t header;
+
+    header.size = size;
+    header.status = status;
+    reserve_buffer(&connection->output, sizeof(header) + size);
+    memcpy( connection->output.data + connection->output.size,
+            &header, sizeof(header) );
+    connection->output.size += sizeof(header);
+    if(size > 0)
+    {
+        memcpy(connection->output.data + connection->output.size, data, size);
+        connection->output.size += size;
+    }
+}
+
+
+/*  Appends a successful response to the output buffer of a connection. */
+static void respond(connection_t *connection, const void *data, unsigned size)
+{
+    respond_status(connection, RESPONSE_OK, data, size);
+}
+
+
+/*  Returns the open model with the given model number, or NULL if there is
+    no such model. */
+static model_handle get_model(connection_t *connection, unsigned number)
+{
+    return number < connection->models_size ?
+           connection->models[number] : NULL;
+}
+
+
+/*  Opens a model and assigns it a model number. */
+static unsigned open_connection_model( connection_t *connection,
+                                       const char *name )
+{
+    unsigned number;
+
+    for(number = 0; number < connection->models_size; ++number)
+    {
+        if(connection->models[number] == NULL)
+            break;
+    }
+    if(number == connection->models_size)
+    {
+        connection->models = (model_handle*)realloc( connection->models,
+            (number + 1)*sizeof(model_handle) );
+        assert(connection->models);
+        ++connection->models_size;
+    }
+    connection->models[number] = open_model(name);
+    assert(connection->models[number]);
+
+    return number;
+}
+
+
+/*  Processes a single request, appending its response to the output buffer
+    of the connection. Returns 0 if the request was processed, or -1 if it was
+    invalid. */
+static int process_request( connection_t *connection, unsigned operation,
+                            const char *data, unsigned size )
+{
+    model_triple_request_t model_triple;
+    find_triples_request_t find;
+    absorb_model_request_t absorb;
+    model_handle model, source;
+    triple_t triple;
+    nid_t nid, *nids;
+    const void *node_data;
+    size_t node_size;
+    unsigned number, count;
+
+    switch(operation)
+    {
+    case REQUEST_OPEN_MODEL:
+        if(size > 0 && data[size - 1] != '\0')
+            return -1;
+        number = open_connection_model(connection, size > 0 ? data : NULL);
+        respond(connection, &number, sizeof(number));
+        return 0;
+
+    case REQUEST_CLOSE_MODEL:
+        if(size != sizeof(number))
+            return -1;
+        memcpy(&number, data, sizeof(number));
+        model = get_model(connection, number);
+        if(model == NULL)
+            return -1;
+        close_model(model);
+        connection->models[number] = NULL;
+        respond(connection, NULL, 0);
+        return 0;
+
+    case REQUEST_IDENTIFY_NODE:
+        nid = identify_node(data, size);
+        respond(connection, &nid, sizeof(nid));
+        return 0;
+
+    case REQUEST_IDENTIFY_TRIPLE:
+        if(size != sizeof(triple))
+            return -1;
+        memcpy(&triple, data, sizeof(triple));
+        if( !is_valid_nid(triple.nodes[0]) || !is_valid_nid(triple.nodes[1]) ||
+            !is_valid_nid(triple.nodes[2]) )
+        {
+            respond_status(connection, RESPONSE_INVALID_NID, NULL, 0);
+            return 0;
+        }
+        nid = identify_triple(&triple);
+        respond(connection, &nid, sizeof(nid));
+        return 0;
+
+    case REQUEST_RESOLVE_NODE:
+        if(size != sizeof(nid))
+            return -1;
+        memcpy(&nid, data, sizeof(nid));
+        if(NID_IS_TRIPLE(nid) || !is_valid_nid(nid))
+        {
+            respond_status(connection, RESPONSE_INVALID_NID, NULL, 0);
+            return 0;
+        }
+        node_data = resolve_node(nid, NULL, &node_size);
+        respond(connection, node_data, node_size);
+        free_data(node_data);
+        return 0;
+
+    case REQUEST_RESOLVE_TRIPLE:
+        if(size != sizeof(nid))
+            return -1;
+        memcpy(&nid, data, sizeof(nid));
+        if(!NID_IS_TRIPLE(nid) || !is_valid_nid(nid))
+        {
+            respond_status(connection, RESPONSE_INVALID_NID, NULL, 0);
+            return 0;
+        }
+        triple = resolve_triple(nid);
+        respond(connection, &triple, sizeof(triple));
+        return 0;
+
+    case REQUEST_ADD_TRIPLE:
+    case REQUEST_REMOVE_TRIPLE:
+        if(size != sizeof(model_triple))
+            return -1;
+        memcpy(&model_triple, data, sizeof(model_triple));
+        model = get_model(connection, model_triple.model);
+        if(model == NULL)
+            return -1;
+        if(!NID_IS_TRIPLE(model_triple.nid) || !is_valid_nid(model_triple.nid))
+        {
+            respond_status(connection, RESPONSE_INVALID_NID, NULL, 0);
+            return 0;
+        }
+        count = operation == REQUEST_ADD_TRIPLE ?
+                add_triple(model, model_triple.nid) :
+                remove_triple(model, model_triple.nid);
+        respond(connection, &count, sizeof(count));
+        return 0;
+
+    case REQUEST_FIND_TRIPLES:
+        if(size != sizeof(find))
+            return -1;
+        memcpy(&find, data, sizeof(find));
+        model = get_model(connection, find.model);
+        if(model == NULL)
+            return -1;
+        if( !NID_IS_NULL(find.previous) &&
+            (!NID_IS_TRIPLE(find.previous) || !is_valid_nid(find.previous)) )
+        {
+            respond_status(connection, RESPONSE_INVALID_NID, NULL, 0);
+            return 0;
+        }
+        if(find.count > MAX_FIND_COUNT)
+            find.count = MAX_FIND_COUNT;
+        nids = (nid_t*)malloc(find.count*sizeof(nid_t));
+        assert(nids != NULL || find.count == 0);
+        count = find_triples( model, &find.pattern, find.previous,
+                              find.count, nids );
+        respond(connection, nids, count*sizeof(nid_t));
+        free(nids);
+        return 0;
+
+    case REQUEST_EMPTY_MODEL:
+        if(size != sizeof(number))
+            return -1;
+        memcpy(&number, data, sizeof(number));
+        model = get_model(connection, number);
+        if(model == NULL)
+            return -1;
+        count = empty_model(model);
+        respond(connection, &count, sizeof(count));
+        return 0;
+
+    case REQUEST_ABSORB_MODEL:
+        if(size != sizeof(absorb))
+            return -1;
+        memcpy(&absorb, data, sizeof(absorb));
+        model = get_model(connection, absorb.destination);
+        source = get_model(connection, absorb.source);
+        if(model == NULL || source == NULL)
+            return -1;
+        absorb_model(model, source);
+        respond(connection, NULL, 0);
+        return 0;
+    }
+
+    return -1;
+}
+
+
+/*  Processes all requests that have been received completely.
+    Returns 0 on success, or -1 if an invalid request was received. */
+static int process_input(connection_t *connection)
+{
+    request_header_t header;
+    unsigned position;
+    int result;
+
+    result = 0;
+    position = 0;
+    while(connection->input.size - position >= sizeof(header))
+    {
+        memcpy(&header, connection->input.data + position, sizeof(header));
+        if(header.size > PROTOCOL_MAX_SIZE)
+        {
+            result = -1;
+            break;
+        }
+        if(connection->input.size - position - sizeof(header) < header.size)
+        {
+            /* Request not received completely yet. */
+            break;
+        }
+        position += sizeof(header);
+        result = process_request( connection, header.operation,
+                                  connection->input.data + position,
+                                  header.size );
+        if(result != 0)
+            break;
+        position += header.size;
+    }
+
+    /* Discard processed requests. */
+    memmove( connection->input.data, connection->input.data + position,
+             connection->input.size - position );
+    connection->input.size -= position;
+
+    return result;
+}
+
+
+/*  Sends as much pending response data as possible without blocking.
+    Returns 0 on success, or -1 if the connection failed. */
+static int send_output(connection_t *connection)
+{
+    ssize_t sent;
+
+    while(connection->output_sent < connection->output.size)
+    {
+        sent = write( connection->fd,
+                      connection->output.data + connection->output_sent,
+                      connection->output.size - connection->output_sent );
+        if(sent < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        connection->output_sent += sent;
+    }
+    connection->output.size = connection->output_sent = 0;
+
+    return 0;
+}
+
+
+/*  Receives request data available on a connection and processes it.
+    Returns 0 on success, or -1 if the connection was closed or failed. */
+static int receive_input(connection_t *connection)
+{
+    ssize_t received;
+
+    reserve_buffer(&connection->input, READ_SIZE);
+    received = read( connection->fd,
+                     connection->input.data + connection->input.size,
+                     connection->input.capacity - connection->input.size );
+    if(received == 0)
+        return -1;
+    if(received < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    connection->input.size += received;
+
+    if(process_input(connection) != 0)
+        return -1;
+
+    return send_output(connection);
+}
+
+
+/*  Closes a connection and the models it opened. */
+static void close_connection(connection_t *connection)
+{
+    unsigned number;
+
+    for(number = 0; number < connection->models_size; ++number)
+    {
+        if(connection->models[number] != NULL)
+            close_model(connection->models[number]);
+    }
+    free(connection->models);
+    free(connection->input.data);
+    free(connection->output.data);
+    close(connection->fd);
+    connection->fd = -1;
+}
+
+
+/*  Creates the listening socket. Returns its file descriptor, or -1 if the
+    socket could not be created. */
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if( bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 )
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *directory, *path;
+    connection_t *connections;
+    struct pollfd *fds;
+    unsigned connections_size, n, m;
+    int listen_fd, fd;
+
+    if(argc > 3)
+    {
+        fprintf(stderr, "usage: %s [directory [socket]]\n", argv[0]);
+        return 1;
+    }
+    directory = argc > 1 ? argv[1] : ".";
+    path = argc > 2 ? argv[2] : PROTOCOL_SOCKET_PATH;
+
+    if(chdir(directory) != 0)
+    {
+        perror(directory);
+        return 1;
+    }
+    listen_fd = listen_socket(path);
+    if(listen_fd < 0)
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+
+    tripledb_initialize();
+
+    connections = NULL;
+    connections_size = 0;
+    fds = (struct pollfd*)malloc(sizeof(struct pollfd));
+    assert(fds);
+    while(!interrupted)
+    {
+        /* Wait for new connections, requests, or room to send responses. */
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for(n = 0; n < connections_size; ++n)
+        {
+            fds[n + 1].fd = connections[n].fd;
+            fds[n + 1].events = 0;
+            if( connections[n].output.size - connections[n].output_sent <=
+                MAX_PENDING_OUTPUT )
+            {
+                fds[n + 1].events |= POLLIN;
+            }
+            if(connections[n].output_sent < connections[n].output.size)
+                fds[n + 1].events |= POLLOUT;
+        }
+        if(poll(fds, connections_size + 1, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* Serve existing connections. */
+        for(n = 0; n < connections_size; ++n)
+        {
+            if( (fds[n + 1].revents & (POLLERR | POLLNVAL)) ||
+                ( (fds[n + 1].revents & (POLLIN | POLLHUP)) &&
+                  receive_input(&connections[n]) != 0 ) ||
+                ( (fds[n + 1].revents & POLLOUT) &&
+                  send_output(&connections[n]) != 0 ) )
+            {
+                close_connection(&connections[n]);
+            }
+        }
+
+        /* Remove closed connections. */
+        for(n = m = 0; n < connections_size; ++n)
+        {
+            if(connections[n].fd >= 0)
+                connections[m++] = connections[n];
+        }
+        connections_size = m;
+
+        /* Accept new connections. */
+        if(fds[0].revents & POLLIN)
+        {
+            while(fd = accept(listen_fd, NULL, NULL), fd >= 0)
+            {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                connections = (connection_t*)realloc( connections,
+                    (connections_size + 1)*sizeof(connection_t) );
+                assert(connections);
+                memset(&connections[connections_size], 0, sizeof(connection_t));
+                connections[connections_size].fd = fd;
+                ++connections_size;
+            }
+            fds = (struct pollfd*)realloc( fds,
+                (connections_size + 1)*sizeof(struct pollfd) );
+            assert(fds);
+        }
+    }
+
+    /* Shut down. */
+    for(n = 0; n < connections_size; ++n)
+        close_connection(&connections[n]);
+    free(connections);
+    free(fds);
+    close(listen_fd);
+    unlink(path);
+
+    tripledb_finalize();
+
+    return 0;
+}
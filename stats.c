@@ -0,0 +1,277 @@
+/* Needed for clock_gettime() and the pthread functions. */
+#define _POSIX_C_SOURCE 199506L
+
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef TRIPLEDB_STATS
+
+/*  The statistics of a thread. */
+typedef struct stats_block
+{
+    tripledb_stats_t stats;     /* must be the first member */
+    struct stats_block *next;
+#ifdef THREADSAFE
+    pthread_mutex_t mutex;      /* protects 'stats' */
+#endif
+} stats_block_t;
+
+#ifdef THREADSAFE
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+/*  Protects the following. */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static stats_block_t *stats_blocks;     /* statistics of running threads */
+static tripledb_stats_t stats_retired;  /* statistics of finished threads */
+
+
+/*  Adds the statistics in 'source' to those in 'destination'. */
+static void add_stats( tripledb_stats_t *destination,
+                       const tripledb_stats_t *source )
+{
+    int n, m;
+
+    for(n = 0; n < STATS_OPERATIONS; ++n)
+    {
+        destination->calls[n] += source->calls[n];
+        for(m = 0; m < STATS_LATENCY_BUCKETS; ++m)
+            destination->latency[n][m] += source->latency[n][m];
+    }
+    for(n = 0; n < STATS_DATABASES; ++n)
+    {
+        destination->gets[n] += source->gets[n];
+        destination->puts[n] += source->puts[n];
+        destination->seqs[n] += source->seqs[n];
+        destination->dels[n] += source->dels[n];
+    }
+    for(n = 0; n < STATS_LOCKS; ++n)
+    {
+        destination->lock_waits[n] += source->lock_waits[n];
+        destination->lock_wait_time[n] += source->lock_wait_time[n];
+    }
+}
+
+
+#ifdef THREADSAFE
+/*  Moves the statistics of a finished thread to the retired statistics. */
+static void retire_stats(void *data)
+{
+    stats_block_t *block, **previous;
+
+    block = (stats_block_t*)data;
+    pthread_mutex_lock(&stats_mutex);
+    for(previous = &stats_blocks; *previous != block;
+        previous = &(*previous)->next);
+    *previous = block->next;
+    add_stats(&stats_retired, &block->stats);
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_mutex_destroy(&block->mutex);
+    free(block);
+}
+
+
+static void create_stats_key()
+{
+    int result;
+
+    result = pthread_key_create(&stats_key, retire_stats);
+    assert(result == 0);
+}
+#endif
+
+
+tripledb_stats_t *stats_acquire()
+{
+    stats_block_t *block;
+#ifdef THREADSAFE
+    int result;
+
+    pthread_once(&stats_once, create_stats_key);
+    block = (stats_block_t*)pthread_getspecific(stats_key);
+    if(block == NULL)
+    {
+        block = (stats_block_t*)calloc(1, sizeof(stats_block_t));
+        assert(block);
+        result = pthread_mutex_init(&block->mutex, NULL);
+        assert(result == 0);
+        result = pthread_setspecific(stats_key, block);
+        assert(result == 0);
+
+        pthread_mutex_lock(&stats_mutex);
+        block->next = stats_blocks;
+        stats_blocks = block;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    /* Only tripledb_stats() competes for this lock. */
+    pthread_mutex_lock(&block->mutex);
+#else
+    static stats_block_t single_block;
+
+    block = &single_block;
+    stats_blocks = block;
+#endif
+
+    return &block->stats;
+}
+
+
+void stats_release(tripledb_stats_t *stats)
+{
+#ifdef THREADSAFE
+    pthread_mutex_unlock(&((stats_block_t*)stats)->mutex);
+#endif
+}
+
+
+void stats_start(stats_timer_t *timer)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timer->seconds = now.tv_sec;
+    timer->nanoseconds = now.tv_nsec;
+}
+
+
+/*  Returns the number of nanoseconds elapsed since 'timer' was started, or
+    0xFFFFFFFF if that does not fit in 32 bits. */
+static unsigned long elapsed(const stats_timer_t *timer)
+{
+    struct timespec now;
+    double nanoseconds;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nanoseconds = (now.tv_sec - timer->seconds)*1e9 +
+                  (now.tv_nsec - timer->nanoseconds);
+
+    return nanoseconds < 4294967295.0 ?
+           (unsigned long)nanoseconds : 0xFFFFFFFFUL;
+}
+
+
+/*  Returns the latency histogram bucket for a latency of at most 2^32 - 1
+    nanoseconds (see STATS_LATENCY_BUCKETS). */
+static unsigned latency_bucket(unsigned long nanoseconds)
+{
+    unsigned exponent;
+
+    if(nanoseconds < 8)
+        return (unsigned)nanoseconds;
+    for(exponent = 3; (nanoseconds >> exponent) > 1; ++exponent);
+
+    return (exponent - 2)*8 + ((nanoseconds >> (exponent - 3)) & 7);
+}
+
+
+void stats_operation(unsigned operation, const stats_timer_t *timer)
+{
+    tripledb_stats_t *stats;
+    unsigned bucket;
+
+    assert(operation < STATS_OPERATIONS);
+    bucket = latency_bucket(elapsed(timer));
+    stats = stats_acquire();
+    ++stats->calls[operation];
+    ++stats->latency[operation][bucket];
+    stats_release(stats);
+}
+
+
+#ifdef THREADSAFE
+int stats_lock(pthread_mutex_t *mutex, unsigned lock)
+{
+    stats_timer_t timer;
+    tripledb_stats_t *stats;
+    double seconds;
+    int result;
+
+    assert(lock < STATS_LOCKS);
+    stats_start(&timer);
+    result = pthread_mutex_lock(mutex);
+    seconds = elapsed(&timer)/1e9;
+    stats = stats_acquire();
+    ++stats->lock_waits[lock];
+    stats->lock_wait_time[lock] += seconds;
+    stats_release(stats);
+
+    return result;
+}
+#endif
+
+#endif  /* def TRIPLEDB_STATS */
+
+
+void tripledb_stats(tripledb_stats_t *stats)
+{
+#ifdef TRIPLEDB_STATS
+    stats_block_t *block;
+#endif
+
+    memset(stats, 0, sizeof(*stats));
+#ifdef TRIPLEDB_STATS
+    stats->enabled = 1;
+
+    /* The statistics of every thread are read under its lock, so they are
+       consistent per thread, but other threads may update theirs between
+       these reads. */
+#ifdef THREADSAFE
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    add_stats(stats, &stats_retired);
+    for(block = stats_blocks; block != NULL; block = block->next)
+    {
+#ifdef THREADSAFE
+        pthread_mutex_lock(&block->mutex);
+        add_stats(stats, &block->stats);
+        pthread_mutex_unlock(&block->mutex);
+#else
+        add_stats(stats, &block->stats);
+#endif
+    }
+#ifdef THREADSAFE
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+#endif  /* def TRIPLEDB_STATS */
+}
+
+
+unsigned long stats_percentile( const tripledb_stats_t *stats,
+                                unsigned operation, double percentage )
+{
+    unsigned long count, target;
+    unsigned bucket, exponent;
+    double position;
+
+    assert(operation < STATS_OPERATIONS);
+    assert(percentage >= 0 && percentage <= 100);
+    if(stats->calls[operation] == 0)
+        return 0;
+
+    /* Find the bucket holding the call at the given percentage. */
+    position = percentage/100*stats->calls[operation];
+    target = (unsigned long)position;
+    if(target < position || target == 0)
+        ++target;
+    count = 0;
+    for(bucket = 0; bucket < STATS_LATENCY_BUCKETS - 1; ++bucket)
+    {
+        count += stats->latency[operation][bucket];
+        if(count >= target)
+            break;
+    }
+
+    /* Return the largest latency in the bucket. */
+    if(bucket < 8)
+        return bucket;
+    exponent = bucket/8 + 2;
+    return ((8 + bucket%8UL) << (exponent - 3)) +
+           ((1UL << (exponent - 3)) - 1);
+}
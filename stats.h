@@ -0,0 +1,61 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#include "tripledb.h"
+
+#ifdef THREADSAFE
+#include <pthread.h>
+#endif
+
+/*  Gathering of the statistics returned by tripledb_stats(). If TRIPLEDB_STATS
+    is not defined, the macros below expand to nothing. */
+
+/*  The start of a timed operation. */
+typedef struct stats_timer
+{
+    long seconds, nanoseconds;
+} stats_timer_t;
+
+#ifdef TRIPLEDB_STATS
+
+/*  Starts timing an operation. */
+#define STATS_START(timer) \
+    stats_start(&(timer))
+
+/*  Counts a call to one of the STATS_OP_ operations, which started when
+    'timer' was started. */
+#define STATS_OPERATION(operation, timer) \
+    stats_operation(operation, &(timer))
+
+void stats_start(stats_timer_t *timer);
+void stats_operation(unsigned operation, const stats_timer_t *timer);
+
+/*  Returns the statistics of the calling thread, which only it may modify,
+    locked so that tripledb_stats() does not read them meanwhile. They must
+    be released with stats_release(). */
+tripledb_stats_t *stats_acquire();
+void stats_release(tripledb_stats_t *stats);
+
+#ifdef THREADSAFE
+/*  Acquires a lock that is held by another thread, counting the time spent
+    waiting for one of the STATS_LOCK_ locks. Returns the result of
+    pthread_mutex_lock(). */
+int stats_lock(pthread_mutex_t *mutex, unsigned lock);
+#endif
+
+#else  /* def TRIPLEDB_STATS */
+#define STATS_START(timer)                 ((void)&(timer))
+#define STATS_OPERATION(operation, timer)  ((void)&(timer))
+#endif  /* def TRIPLEDB_STATS */
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ndef STATS_H_INCLUDED */
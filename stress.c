@@ -0,0 +1,483 @@
+/*  Stress tests the triple database with concurrent threads, and measures
+    its throughput for increasing numbers of threads.
+
+    Usage: stress [threads [seconds [directory]]]
+
+    For 1, 2, 4, ... up to 'threads' threads (default: 8), runs a round of
+    'seconds' seconds (default: 2) in a new store in 'directory' (default:
+    stress_store, which must not exist yet). In every round, each thread
+    repeatedly picks a random operation: it identifies nodes and triples,
+    adds, removes and finds triples in a model shared by all threads and in
+    a model of its own, pages through snapshots, absorbs models, reads the
+    statistics, and opens and closes handles of the shared model and of
+    temporary models.
+
+    Every thread adds and removes only triples with its own subjects and
+    tracks which of them should be in each model. After each round, the
+    models are checked against this, and the program fails if they differ.
+    The throughput of each round is written to standard output as JSON.
+
+    Build with 'scons tsan=1' to run the threads under ThreadSanitizer, and
+    add 'stats=1' to include the statistics gathered by every thread. */
+
+/* Needed for clock_gettime() and the pthread functions. */
+#define _POSIX_C_SOURCE 199506L
+
+#include "tripledb.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef THREADSAFE
+#error "THREADSAFE not defined; there is nothing to stress!"
+#endif
+
+/*  The largest number of threads. */
+#define MAX_THREADS 64
+
+/*  The number of subjects of every thread, and of predicates and objects
+    shared by all threads. */
+#define SUBJECTS   16
+#define PREDICATES 4
+#define OBJECTS    16
+
+/*  The number of distinct triples of every thread. */
+#define TRIPLES (SUBJECTS*PREDICATES*OBJECTS)
+
+/*  The most triples read by a single find. */
+#define FIND_LIMIT 64
+
+/*  The names of the model shared by all threads, and of the temporary model
+    opened and closed by them. */
+#define SHARED_MODEL    "stress_shared"
+#define TEMPORARY_MODEL "stress_temporary"
+
+/*  A worker thread. */
+typedef struct worker
+{
+    pthread_t thread;
+    unsigned number, random_state;
+    double seconds;             /* duration of the round */
+    model_handle shared;        /* handle of the shared model */
+    model_handle own;           /* model used only by this thread */
+    nid_t subjects[SUBJECTS];
+    unsigned char in_shared[TRIPLES], in_own[TRIPLES];
+    unsigned long operations;
+    unsigned long created;      /* number of new nodes identified */
+} worker_t;
+
+static nid_t predicates[PREDICATES], objects[OBJECTS];
+
+static worker_t workers[MAX_THREADS];
+
+
+static double now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec/1e9;
+}
+
+
+/*  Returns the next number from a worker's pseudo-random sequence
+    (xorshift32). */
+static unsigned next_random(worker_t *worker)
+{
+    unsigned state = worker->random_state;
+
+    state ^= (state << 13) & 0xFFFFFFFFu;
+    state ^= state >> 17;
+    state ^= (state << 5) & 0xFFFFFFFFu;
+    return worker->random_state = state;
+}
+
+
+static nid_t identify_string(const char *data)
+{
+    return identify_node(data, strlen(data));
+}
+
+
+/*  Returns the node identifier of triple number 'number' of a worker. */
+static nid_t worker_triple(worker_t *worker, unsigned number)
+{
+    triple_t triple;
+
+    triple.nodes[0] = worker->subjects[number/(PREDICATES*OBJECTS)];
+    triple.nodes[1] = predicates[number/OBJECTS % PREDICATES];
+    triple.nodes[2] = objects[number % OBJECTS];
+    return identify_triple(&triple);
+}
+
+
+/*  Finds at most FIND_LIMIT triples matching 'pattern' in 'model'. Returns
+    the number found. */
+static unsigned find_some(model_handle model, triple_t *pattern)
+{
+    nid_t nid;
+    unsigned found;
+
+    NID_SET_NULL(nid);
+    for(found = 0; found < FIND_LIMIT; ++found)
+    {
+        nid = find_triple(model, pattern, nid);
+        if(NID_IS_NULL(nid))
+            break;
+    }
+    return found;
+}
+
+
+static void fail(const worker_t *worker, const char *message)
+{
+    fprintf(stderr, "stress: thread %u: %s\n", worker->number, message);
+    exit(1);
+}
+
+
+/*  Performs a single random operation for a worker. */
+static void run_operation(worker_t *worker)
+{
+    unsigned choice, number, found, n;
+    triple_t pattern;
+    nid_t nid, nids[FIND_LIMIT];
+    model_handle model, other;
+    snapshot_handle snapshot;
+    node_count_t *counts;
+    snapshot_partition_t partitions[2];
+    tripledb_stats_t stats;
+    char data[64];
+
+    choice = next_random(worker) % 100;
+    number = next_random(worker) % TRIPLES;
+    TRIPLE_SET_NULL(pattern);
+
+    if(choice < 25)
+    {
+        /* Find triples of all threads in the shared model. */
+        pattern.nodes[1] = predicates[number % PREDICATES];
+        if(number & 1)
+            pattern.nodes[2] = objects[number % OBJECTS];
+        find_some(worker->shared, &pattern);
+    }
+    else
+    if(choice < 35)
+    {
+        /* Find the triples of a subject in this thread's model, which must
+           all be known to be there. */
+        pattern.nodes[0] = worker->subjects[number % SUBJECTS];
+        NID_SET_NULL(nid);
+        while(nid = find_triple(worker->own, &pattern, nid), !NID_IS_NULL(nid))
+        {
+            pattern = resolve_triple(nid);
+            for(n = 0; n < TRIPLES; ++n)
+            {
+                if( NID_IS_EQUAL(pattern.nodes[1], predicates[n/OBJECTS %
+                                                              PREDICATES]) &&
+                    NID_IS_EQUAL(pattern.nodes[2], objects[n % OBJECTS]) &&
+                    NID_IS_EQUAL( pattern.nodes[0],
+                                  worker->subjects[n/(PREDICATES*OBJECTS)] ) )
+                {
+                    break;
+                }
+            }
+            if(n == TRIPLES || !worker->in_own[n])
+                fail(worker, "unexpected triple found in own model");
+            TRIPLE_SET_NULL(pattern);
+            pattern.nodes[0] = worker->subjects[number % SUBJECTS];
+        }
+    }
+    else
+    if(choice < 50)
+    {
+        /* Add to or remove from the shared model. */
+        nid = worker_triple(worker, number);
+        if(choice < 42)
+        {
+            if(add_triple(worker->shared, nid) != !worker->in_shared[number])
+                fail(worker, "unexpected result of add_triple()");
+            worker->in_shared[number] = 1;
+        }
+        else
+        {
+            if(remove_triple(worker->shared, nid) != worker->in_shared[number])
+                fail(worker, "unexpected result of remove_triple()");
+            worker->in_shared[number] = 0;
+        }
+    }
+    else
+    if(choice < 62)
+    {
+        /* Add to or remove from this thread's model. */
+        nid = worker_triple(worker, number);
+        if(choice < 57)
+        {
+            if(add_triple(worker->own, nid) != !worker->in_own[number])
+                fail(worker, "unexpected result of add_triple()");
+            worker->in_own[number] = 1;
+        }
+        else
+        {
+            if(remove_triple(worker->own, nid) != worker->in_own[number])
+                fail(worker, "unexpected result of remove_triple()");
+            worker->in_own[number] = 0;
+        }
+    }
+    else
+    if(choice < 72)
+    {
+        /* Page through a snapshot of the shared model, and group its
+           triples by subject in several threads or partition them. */
+        snapshot = open_snapshot(worker->shared);
+        pattern.nodes[1] = predicates[number % PREDICATES];
+        found = find_snapshot_triples( snapshot, &pattern, number % 32,
+                                       FIND_LIMIT, nids );
+        assert(found <= FIND_LIMIT);
+        if(choice < 64)
+        {
+            counts = group_snapshot_triples( snapshot, &pattern, 0,
+                                             FIND_LIMIT, 3, &n );
+            assert(n <= FIND_LIMIT);
+            free_data(counts);
+        }
+        else
+        {
+            found = 0;
+            for(n = partition_snapshot(snapshot, &pattern, partitions, 2);
+                n-- > 0; )
+            {
+                while( nid = next_partition_triple(snapshot, &partitions[n]),
+                       !NID_IS_NULL(nid) )
+                {
+                    ++found;
+                }
+            }
+            if(found != count_snapshot_triples(snapshot, &pattern))
+                fail(worker, "unexpected number of partitioned triples");
+        }
+        close_snapshot(snapshot);
+    }
+    else
+    if(choice < 80)
+    {
+        /* Open another handle of the shared model. */
+        model = open_model(SHARED_MODEL);
+        pattern.nodes[0] = worker->subjects[number % SUBJECTS];
+        find_some(model, &pattern);
+        close_model(model);
+    }
+    else
+    if(choice < 86)
+    {
+        /* Use the temporary model, which is created and removed whenever no
+           thread has it open. */
+        model = open_model(TEMPORARY_MODEL);
+        nid = worker_triple(worker, number);
+        if(add_triple(model, nid) != 1 || remove_triple(model, nid) != 1)
+            fail(worker, "unexpected result on the temporary model");
+        close_model(model);
+    }
+    else
+    if(choice < 87)
+    {
+        /* Read the statistics, which the other threads update meanwhile
+           when the library is built with TRIPLEDB_STATS. */
+        tripledb_stats(&stats);
+    }
+    else
+    if(choice < 94)
+    {
+        /* Identify new and existing nodes and triples. */
+        sprintf( data, "stress node %u.%lu", worker->number,
+                 worker->created++ );
+        pattern.nodes[0] = identify_string(data);
+        pattern.nodes[1] = predicates[number % PREDICATES];
+        pattern.nodes[2] = worker->subjects[number % SUBJECTS];
+        nid = identify_triple(&pattern);
+        pattern = resolve_triple(nid);
+        if(!NID_IS_EQUAL(pattern.nodes[2], worker->subjects[number % SUBJECTS]))
+            fail(worker, "unexpected result of resolve_triple()");
+    }
+    else
+    {
+        /* Absorb this thread's model into an anonymous model, and models
+           into themselves. */
+        model = open_model(NULL);
+        absorb_model(model, worker->own);
+        absorb_model(model, model);
+        other = open_model(SHARED_MODEL);
+        absorb_model(other, worker->shared);
+        close_model(other);
+        found = 0;
+        for(n = 0; n < TRIPLES; ++n)
+            found += worker->in_own[n];
+        if(empty_model(model) != found)
+            fail(worker, "unexpected result of absorb_model()");
+        close_model(model);
+    }
+
+    ++worker->operations;
+}
+
+
+static void *run_worker(void *argument)
+{
+    worker_t *worker;
+    double start;
+
+    worker = (worker_t*)argument;
+    start = now();
+    do {
+        run_operation(worker);
+    } while(now() - start < worker->seconds);
+
+    return NULL;
+}
+
+
+/*  Checks that the models contain exactly the triples their workers
+    expect. */
+static void check_models(unsigned threads)
+{
+    worker_t *worker;
+    triple_t pattern;
+    nid_t nid;
+    unsigned n, number;
+
+    for(n = 0; n < threads; ++n)
+    {
+        worker = &workers[n];
+        for(number = 0; number < TRIPLES; ++number)
+        {
+            nid = worker_triple(worker, number);
+            pattern = resolve_triple(nid);
+            NID_SET_NULL(nid);
+            if( NID_IS_NULL(find_triple(worker->shared, &pattern, nid)) !=
+                !worker->in_shared[number] )
+            {
+                fail(worker, "shared model does not match");
+            }
+            if( NID_IS_NULL(find_triple(worker->own, &pattern, nid)) !=
+                !worker->in_own[number] )
+            {
+                fail(worker, "own model does not match");
+            }
+        }
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned max_threads, threads, n, number, rounds;
+    unsigned long operations;
+    const char *directory;
+    model_handle shared;
+    worker_t *worker;
+    double seconds, start;
+    char name[64];
+    int result;
+
+    if(argc > 4)
+    {
+        fprintf(stderr, "usage: %s [threads [seconds [directory]]]\n", argv[0]);
+        return 1;
+    }
+    max_threads = argc > 1 ? (unsigned)atoi(argv[1]) : 8;
+    seconds = argc > 2 ? atof(argv[2]) : 2;
+    directory = argc > 3 ? argv[3] : "stress_store";
+    if(max_threads < 1 || max_threads > MAX_THREADS)
+    {
+        fprintf(stderr, "%s: threads must be 1 to %d\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    if(mkdir(directory, 0700) != 0 || chdir(directory) != 0)
+    {
+        perror(directory);
+        return 1;
+    }
+
+    tripledb_initialize();
+    for(n = 0; n < PREDICATES; ++n)
+    {
+        sprintf(name, "stress predicate %u", n);
+        predicates[n] = identify_string(name);
+    }
+    for(n = 0; n < OBJECTS; ++n)
+    {
+        sprintf(name, "stress object %u", n);
+        objects[n] = identify_string(name);
+    }
+    shared = open_model(SHARED_MODEL);
+
+    printf("{\n  \"seconds\": %g,\n  \"results\": [\n", seconds);
+    rounds = 0;
+    for(threads = 1; ; threads *= 2)
+    {
+        if(threads > max_threads)
+            threads = max_threads;
+
+        /* Start the threads; every round uses new subjects. */
+        for(n = 0; n < threads; ++n)
+        {
+            worker = &workers[n];
+            memset(worker, 0, sizeof(*worker));
+            worker->number = n;
+            worker->random_state = 2654435761u*(rounds*MAX_THREADS + n + 1);
+            worker->seconds = seconds;
+            worker->shared = shared;
+            sprintf(name, "stress_%u_%u", rounds, n);
+            worker->own = open_model(name);
+            for(number = 0; number < SUBJECTS; ++number)
+            {
+                sprintf(name, "stress subject %u.%u.%u", rounds, n, number);
+                worker->subjects[number] = identify_string(name);
+            }
+        }
+        start = now();
+        for(n = 0; n < threads; ++n)
+        {
+            result = pthread_create( &workers[n].thread, NULL, run_worker,
+                                     &workers[n] );
+            assert(result == 0);
+        }
+        operations = 0;
+        for(n = 0; n < threads; ++n)
+        {
+            result = pthread_join(workers[n].thread, NULL);
+            assert(result == 0);
+            operations += workers[n].operations;
+        }
+        start = now() - start;
+
+        check_models(threads);
+        for(n = 0; n < threads; ++n)
+            close_model(workers[n].own);
+
+        printf( "    { \"threads\": %u, \"operations\": %lu, "
+                "\"seconds\": %.6f, \"operations_per_second\": %.1f, "
+                "\"operations_per_second_per_thread\": %.1f }%s\n",
+                threads, operations, start, operations/start,
+                operations/start/threads,
+                threads < max_threads ? "," : "" );
+        fflush(stdout);
+        ++rounds;
+        if(threads == max_threads)
+            break;
+    }
+    printf("  ]\n}\n");
+
+    close_model(shared);
+    tripledb_finalize();
+
+    return 0;
+}
@@ -1,29 +1,114 @@
+/*  Tests the triple database library. Built with TEST_CLIENT defined, it
+    tests the client library (client.c) against the server (server.c)
+    instead; see the end of this file. */
+
+/* Needed for kill() and nanosleep(). */
+#define _POSIX_C_SOURCE 199506L
+
 #include "tripledb.h"
+#include "inference.h"
+#include "async.h"
+#ifdef TEST_CLIENT
+#include "client.h"
+#endif
 #include <assert.h>
+#include <db.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static char
     a[] = "Dit is een test.",
     b[] = "Korter.",
-    c[] = { '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0' };
+    c[] = { '\0', '\0', '\0', '\0', '\0', '\0', '\0', '\0' },
+    d[] = "http://example.org/vocabulary#Thing",
+    e[] = "http://example.org/vocabulary#OtherThing";
 
 static size_t
     la = sizeof(a) - 1,
     lb = sizeof(b) - 1,
-    lc = sizeof(c);
+    lc = sizeof(c),
+    ld = sizeof(d) - 1,
+    le = sizeof(e) - 1;
+
+/*  Removes a directory and the files in it. */
+static void remove_directory(const char *path)
+{
+    DIR *dir;
+    struct dirent *dirent;
+    char filename[1024];
+
+    dir = opendir(path);
+    assert(dir != NULL);
+    while((dirent = readdir(dir)) != NULL)
+    {
+        if( strcmp(dirent->d_name, ".") == 0 ||
+            strcmp(dirent->d_name, "..") == 0 )
+        {
+            continue;
+        }
+        assert(strlen(path) + strlen(dirent->d_name) + 2 <= sizeof(filename));
+        sprintf(filename, "%s/%s", path, dirent->d_name);
+        assert(unlink(filename) == 0);
+    }
+    closedir(dir);
+    assert(rmdir(path) == 0);
+}
+
+#ifndef TEST_CLIENT
+
+static unsigned async_callbacks;
+
+static void count_callback(async_handle request)
+{
+    assert(NID_IS_EQUAL(async_nid(request), *(nid_t*)async_context(request)));
+    ++async_callbacks;
+    async_free(request);
+}
 
 int main()
 {
-    nid_t nid_a, nid_b, nid_c, tid[6], nid;
+    nid_t nid_a, nid_b, nid_c, tid[6], nid, low, high, page[10];
     size_t size;
     void *buffer;
     const void *result;
-    model_handle model_a, model_b;
+    model_handle model_a, model_b, model_c;
     triple_t triple;
+    tripledb_options_t options;
+    int found_a, found_b;
+    change_t change;
+    unsigned sequence, n;
+    rule_pattern_t body[2];
+    rule_t rule;
+    path_handle path;
+    snapshot_handle snapshot;
+    cache_stats_t stats;
+    node_count_t *counts;
+    snapshot_partition_t partitions[4];
+    unsigned m, found;
+    tripledb_stats_t counters;
+    async_handle handles[7], handle;
+    const nid_t *nids;
+    char byte;
+    DB *db;
+    DBT key, value;
+    recno_t record;
+    nid_t *matches;
+    static const unsigned offsets[] =
+        { 590, 300, 0, 257, 512, 255, 256, 511, 599, 600, 1000 };
      
     buffer = malloc(4096);
-    tripledb_initialize();
+    options.flags = TRIPLEDB_FSEARCH_INDEX;
+    options.cache_size = 8*1024*1024;
+    tripledb_initialize_options(&options);
 
            
     /* Test identify_node() */
@@ -38,6 +123,19 @@ int main()
     assert(!NID_IS_EQUAL(nid_a, nid_b));
     assert(!NID_IS_EQUAL(nid_a, nid_c));
     assert(!NID_IS_EQUAL(nid_a, nid_b));
+
+    /* Short node data is stored inline. */
+    assert(!NID_IS_INLINE(nid_a));
+    assert(NID_IS_INLINE(nid_b));
+    assert(!NID_IS_INLINE(nid_c));
+    nid = identify_node(b, lb);
+    assert(NID_IS_EQUAL(nid, nid_b));
+    nid = identify_node(c, lc - 1);
+    assert(NID_IS_INLINE(nid)); assert(!NID_IS_EQUAL(nid, nid_b));
+    assert(!NID_IS_NULL(identify_node(c, 0)));
+    result = resolve_node(nid, NULL, &size);
+    assert(size == lc - 1); assert(memcmp(result, c, lc - 1) == 0);
+    free_data(result);
     
     /* Test resolve_node() */
     result = resolve_node(nid_a, NULL, &size);
@@ -64,10 +162,64 @@ int main()
     result = resolve_node(nid_a, buffer, &size);
     assert(result == NULL); assert(size == la);
     
+    /* Inline nodes are searchable once a triple uses them. */
+    NID_SET_NULL(nid);
+    assert(NID_IS_NULL(find_node_prefix("Kort", 4, nid)));
+    triple.nodes[0] = nid_a; triple.nodes[1] = nid_b; triple.nodes[2] = nid_b;
+    assert(!NID_IS_NULL(identify_triple(&triple)));
+
+    /* Test find_node_prefix() */
+    NID_SET_NULL(nid);
+    nid = find_node_prefix("Dit is ", 7, nid);
+    assert(NID_IS_EQUAL(nid, nid_a));
+    nid = find_node_prefix("Dit is ", 7, nid);
+    assert(NID_IS_NULL(nid));
+    NID_SET_NULL(nid);
+    nid = find_node_prefix("Kort", 4, nid);
+    assert(NID_IS_EQUAL(nid, nid_b));
+
+    /* Test find_node_substring() */
+    NID_SET_NULL(nid);
+    nid = find_node_substring("EEN TEST", 8, nid);
+    assert(NID_IS_EQUAL(nid, nid_a));
+    nid = find_node_substring("EEN TEST", 8, nid);
+    assert(NID_IS_NULL(nid));
+    found_a = found_b = 0;
+    NID_SET_NULL(nid);
+    while(nid = find_node_substring("T", 1, nid), !NID_IS_NULL(nid))
+    {
+        found_a |= NID_IS_EQUAL(nid, nid_a);
+        found_b |= NID_IS_EQUAL(nid, nid_b);
+    }
+    assert(found_a && found_b);
+    
     /* Adding nodes to different models. */
     model_a = open_model("a");
     model_b = open_model("b");
     assert(model_a != model_b);
+
+    /* Test get_cache_stats() */
+    get_cache_stats(&stats);
+    assert(stats.budget == 8*1024*1024); assert(stats.open_models == 2);
+    assert(stats.dictionaries + stats.models + stats.available == stats.budget);
+    assert(get_model_cache_size(model_a) > get_model_cache_size(model_b));
+    assert(get_model_cache_size(model_b) > 0);
+    assert( stats.models ==
+            get_model_cache_size(model_a) + get_model_cache_size(model_b) );
+
+    /* The history databases of a model take a share of the pool. */
+    model_c = open_model("cached history");
+    m = get_model_cache_size(model_c);
+    enable_history(model_c);
+    assert(get_model_cache_size(model_c) == m + 2*(m/8));
+    enable_history(model_c);
+    assert(get_model_cache_size(model_c) == m + 2*(m/8));
+    get_cache_stats(&stats);
+    assert(stats.dictionaries + stats.models + stats.available == stats.budget);
+    close_model(model_c);
+    get_cache_stats(&stats);
+    assert( stats.models ==
+            get_model_cache_size(model_a) + get_model_cache_size(model_b) );
     
     /* Add a few triples to model A. */
     triple.nodes[0] = nid_a; triple.nodes[1] = nid_b; triple.nodes[2] = nid_a;     /* A,B,A */
@@ -107,6 +259,60 @@ int main()
     assert(!NID_IS_EQUAL(tid[5], tid[2])); assert(!NID_IS_EQUAL(tid[5], tid[3]));
     assert(!NID_IS_EQUAL(tid[5], tid[4]));
     
+    /* Test find_distinct(). */
+    TRIPLE_SET_NULL(triple);
+    NID_SET_NULL(nid);
+    n = 0;
+    while(nid = find_distinct(model_b, &triple, 1, nid), !NID_IS_NULL(nid))
+        ++n;
+    assert(n == 3);
+    triple.nodes[0] = nid_a;
+    page[0] = find_distinct(model_b, &triple, 2, nid);
+    page[1] = find_distinct(model_b, &triple, 2, page[0]);
+    assert(NID_IS_EQUAL(page[0], nid_b) || NID_IS_EQUAL(page[0], nid_c));
+    assert(NID_IS_EQUAL(page[1], nid_b) || NID_IS_EQUAL(page[1], nid_c));
+    assert(!NID_IS_EQUAL(page[0], page[1]));
+    assert(NID_IS_NULL(find_distinct(model_b, &triple, 2, page[1])));
+    triple.nodes[1] = nid_c; triple.nodes[2] = nid_b;
+    NID_SET_NULL(triple.nodes[0]);
+    NID_SET_NULL(nid);
+    nid = find_distinct(model_b, &triple, 0, nid);
+    assert(NID_IS_EQUAL(nid, nid_a));
+    assert(NID_IS_NULL(find_distinct(model_b, &triple, 0, nid)));
+    
+    /* Test group_triples(). */
+    TRIPLE_SET_NULL(triple);
+    counts = group_triples(model_b, &triple, 1, 0, 1, &n);
+    assert(n == 3);
+    assert(counts[0].count == 2 && counts[1].count == 2 && counts[2].count == 2);
+    free_data(counts);
+    triple.nodes[0] = nid_c;
+    counts = group_triples(model_b, &triple, 2, 1, 4, &n);
+    assert(n == 1); assert(counts[0].count == 1);
+    assert(NID_IS_EQUAL(counts[0].node, nid_a) || NID_IS_EQUAL(counts[0].node, nid_b));
+    free_data(counts);
+    
+    /* Test partition_snapshot(). */
+    TRIPLE_SET_NULL(triple);
+    snapshot = open_snapshot(model_b);
+    assert(partition_snapshot(snapshot, &triple, partitions, 4) == 4);
+    found = 0;  /* bit mask of the triples found */
+    for(n = 0; n < 4; ++n)
+    {
+        while( nid = next_partition_triple(snapshot, &partitions[n]),
+               !NID_IS_NULL(nid) )
+        {
+            for(m = 0; !NID_IS_EQUAL(nid, tid[m]); ++m)
+                assert(m < 5);
+            assert(!(found & (1 << m)));
+            found |= 1 << m;
+        }
+    }
+    assert(found == 63);
+    triple.nodes[0] = nid_a; triple.nodes[1] = nid_b;
+    assert(partition_snapshot(snapshot, &triple, partitions, 4) == 1);
+    close_snapshot(snapshot);
+
     /* Test resolve_triple. */
     triple = resolve_triple(tid[0]);                                   /* A,B,C */
     assert(NID_IS_EQUAL(triple.nodes[0], nid_a) &&
@@ -168,8 +374,151 @@ int main()
     nid = find_triple(model_b, &triple, nid);
     assert(NID_IS_NULL(nid));
     
+    /* Test snapshots: later modifications are not visible. */
+    snapshot = open_snapshot(model_b);
+    triple.nodes[0] = nid_a; triple.nodes[1] = nid_a; triple.nodes[2] = nid_a; /* A,A,A */
+    low = identify_triple(&triple);
+    add_triple(model_b, low);
+    NID_SET_NULL(nid);
+    nid = find_triple(model_b, &triple, nid);
+    assert(NID_IS_EQUAL(nid, low));
+    NID_SET_NULL(nid);
+    nid = find_snapshot_triple(snapshot, &triple, nid);
+    assert(NID_IS_NULL(nid));
+    remove_triple(model_b, tid[4]);
+    NID_SET_NULL(triple.nodes[0]);
+    triple.nodes[1] = nid_a;
+    NID_SET_NULL(triple.nodes[2]);
+    NID_SET_NULL(nid);
+    nid = find_snapshot_triple(snapshot, &triple, nid);
+    assert(NID_IS_EQUAL(nid, tid[2]));
+    nid = find_snapshot_triple(snapshot, &triple, nid);
+    assert(NID_IS_EQUAL(nid, tid[4]));
+    nid = find_snapshot_triple(snapshot, &triple, nid);
+    assert(NID_IS_NULL(nid));
+
+    /* A triple removed and added again is in the snapshot once, and
+       groups count the triples in the snapshot. */
+    remove_triple(model_b, tid[2]);
+    add_triple(model_b, tid[2]);
+    assert(count_snapshot_triples(snapshot, &triple) == 2);
+    TRIPLE_SET_NULL(triple);
+    counts = group_snapshot_triples(snapshot, &triple, 0, 0, 1, &n);
+    assert(n == 3);
+    assert(counts[0].count == 2 && counts[1].count == 2 && counts[2].count == 2);
+    free_data(counts);
+    triple.nodes[1] = nid_a;
+
+    /* Test paging with find_snapshot_triples() and find_triples(). */
+    assert(count_snapshot_triples(snapshot, &triple) == 2);
+    assert(find_snapshot_triples(snapshot, &triple, 0, 1, page) == 1);
+    assert(NID_IS_EQUAL(page[0], tid[2]));
+    assert(find_snapshot_triples(snapshot, &triple, 1, 10, page) == 1);
+    assert(NID_IS_EQUAL(page[0], tid[4]));
+    assert(find_snapshot_triples(snapshot, &triple, 2, 10, page) == 0);
+    close_snapshot(snapshot);
+    NID_SET_NULL(nid);
+    assert(find_triples(model_b, &triple, nid, 10, page) == 2);
+    assert(find_triples(model_b, &triple, page[0], 10, page + 2) == 1);
+    assert(NID_IS_EQUAL(page[2], page[1]));
+    assert(find_triples(model_b, &triple, page[1], 10, page) == 0);
+    
     /* Remove all triples from model B */
     empty_model(model_b);
+
+    /* Batches returned by find_triples() follow find_triple(). */
+    triple.nodes[0] = nid_a;
+    triple.nodes[1] = nid_b;
+    for(n = 0; n < 600; ++n)
+    {
+        triple.nodes[2] = identify_node(&n, sizeof(n));
+        assert(add_triple(model_b, identify_triple(&triple)) == 1);
+    }
+    NID_SET_NULL(triple.nodes[2]);
+    NID_SET_NULL(nid);
+    for(n = 0; nid = find_triple(model_b, &triple, nid), !NID_IS_NULL(nid); ++n)
+    {
+        if(n % 10 == 0)
+        {
+            if(n > 0)
+                high = page[9];
+            else
+                NID_SET_NULL(high);
+            assert(find_triples(model_b, &triple, high, 10, page) == 10);
+        }
+        assert(NID_IS_EQUAL(page[n % 10], nid));
+    }
+    assert(n == 600);
+    assert(find_triples(model_b, &triple, page[9], 10, page) == 0);
+    assert(find_triples(model_b, &triple, page[4], 10, page) == 5);
+
+    /* Groups are counted over ranges of nodes by several threads. */
+    counts = group_triples(model_b, &triple, 2, 0, 4, &n);
+    assert(n == 600);
+    for(m = 0; m < n; ++m)
+        assert(counts[m].count == 1);
+    free_data(counts);
+
+    /* Pages of a snapshot are found from its rank checkpoints, in any
+       order, also after matches were removed from the model. */
+    snapshot = open_snapshot(model_b);
+    for(n = 0; n < 600; n += 6)
+    {
+        triple.nodes[2] = identify_node(&n, sizeof(n));
+        assert(remove_triple(model_b, identify_triple(&triple)) == 1);
+    }
+    NID_SET_NULL(triple.nodes[2]);
+    matches = (nid_t*)malloc(600*sizeof(nid_t));
+    NID_SET_NULL(nid);
+    for(n = 0; nid = find_snapshot_triple(snapshot, &triple, nid),
+               !NID_IS_NULL(nid); ++n)
+    {
+        assert(n < 600);
+        matches[n] = nid;
+    }
+    assert(n == 600);
+    for(n = 0; n < sizeof(offsets)/sizeof(offsets[0]); ++n)
+    {
+        found = find_snapshot_triples(snapshot, &triple, offsets[n], 10, page);
+        assert(found == (offsets[n] + 10 <= 600 ? 10 :
+                         offsets[n] < 600 ? 600 - offsets[n] : 0));
+        for(m = 0; m < found; ++m)
+            assert(NID_IS_EQUAL(page[m], matches[offsets[n] + m]));
+    }
+    assert(count_snapshot_triples(snapshot, &triple) == 600);
+
+    /* Partitions of a snapshot hold consecutive matches, in order. */
+    assert(partition_snapshot(snapshot, &triple, partitions, 4) == 4);
+    found = 0;
+    for(n = 0; n < 4; ++n)
+    {
+        assert(partitions[n].remaining == 150);
+        while( nid = next_partition_triple(snapshot, &partitions[n]),
+               !NID_IS_NULL(nid) )
+        {
+            assert(NID_IS_EQUAL(nid, matches[found]));
+            ++found;
+        }
+        assert(found == 150*(n + 1));
+    }
+    counts = group_snapshot_triples(snapshot, &triple, 2, 2, 3, &n);
+    assert(n == 2); assert(counts[0].count == 1 && counts[1].count == 1);
+    free_data(counts);
+    triple.nodes[2] = triple.nodes[0];
+    NID_SET_NULL(triple.nodes[0]);
+    counts = group_snapshot_triples(snapshot, &triple, 0, 0, 3, &n);
+    assert(n == 0);
+    free_data(counts);
+    triple.nodes[0] = triple.nodes[2];
+    NID_SET_NULL(triple.nodes[2]);
+    counts = group_snapshot_triples(snapshot, &triple, 2, 0, 3, &n);
+    assert(n == 600);
+    for(m = 0; m < n; ++m)
+        assert(counts[m].count == 1);
+    free_data(counts);
+    close_snapshot(snapshot);
+    free(matches);
+    assert(empty_model(model_b) == 500);
     
     /* Remove all triples from model A */
     NID_SET_NULL(triple.nodes[0]);
@@ -217,12 +566,624 @@ int main()
     empty_model(model_a);
     empty_model(model_b);
 
+    /* Test typed literal nodes. */
+    assert(resolve_integer(identify_integer(-12345)) == -12345);
+    assert(resolve_integer(identify_integer(0)) == 0);
+    assert(resolve_double(identify_double(-2.5)) == -2.5);
+    assert(resolve_double(identify_double(1e100)) == 1e100);
+    assert(resolve_datetime(identify_datetime(1234567890)) == 1234567890);
+    assert(NID_TYPE(identify_integer(7)) == NID_TYPE_INTEGER);
+    assert(NID_TYPE(identify_double(7)) == NID_TYPE_DOUBLE);
+    assert(!NID_IS_EQUAL(identify_integer(7), identify_double(7)));
+    assert(NID_TYPE(nid_a) == 0);
+
+    /* Test find_triple_range. */
+    triple.nodes[0] = nid_a; triple.nodes[1] = nid_b;
+    triple.nodes[2] = identify_integer(35);                        /* A,B,35 */
+    tid[0] = identify_triple(&triple); add_triple(model_a, tid[0]);
+    triple.nodes[2] = identify_integer(-40);                      /* A,B,-40 */
+    tid[1] = identify_triple(&triple); add_triple(model_a, tid[1]);
+    triple.nodes[0] = nid_c;
+    triple.nodes[2] = identify_integer(30);                        /* C,B,30 */
+    tid[2] = identify_triple(&triple); add_triple(model_a, tid[2]);
+    triple.nodes[1] = nid_c;
+    triple.nodes[2] = identify_integer(31);                        /* C,C,31 */
+    tid[3] = identify_triple(&triple); add_triple(model_a, tid[3]);
+
+    low = identify_integer(30);
+    high = identify_integer(40);
+    NID_SET_NULL(nid);
+    nid = find_triple_range(model_a, nid_b, low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[2]));
+    nid = find_triple_range(model_a, nid_b, low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    nid = find_triple_range(model_a, nid_b, low, high, nid);
+    assert(NID_IS_NULL(nid));
+
+    NID_SET_NULL(nid);
+    low = identify_integer(-100);
+    NID_SET_NULL(triple.nodes[1]);
+    nid = find_triple_range(model_a, triple.nodes[1], low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[1]));
+    nid = find_triple_range(model_a, triple.nodes[1], low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[2]));
+    nid = find_triple_range(model_a, triple.nodes[1], low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[3]));
+    nid = find_triple_range(model_a, triple.nodes[1], low, high, nid);
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    nid = find_triple_range(model_a, triple.nodes[1], low, high, nid);
+    assert(NID_IS_NULL(nid));
+
+    remove_triple(model_a, tid[2]);
+    NID_SET_NULL(nid);
+    nid = find_triple_range(model_a, nid_b, identify_integer(30), high, nid);
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    empty_model(model_a);
+
+    /* Test change log. */
+    enable_change_log(model_b);
+    sequence = 0;
+    while(next_change(model_b, sequence, &change))
+        sequence = change.sequence;
+    add_triple(model_b, tid[0]);
+    add_triple(model_b, tid[0]);
+    remove_triple(model_b, tid[0]);
+    add_triple(model_b, tid[1]);
+    assert(empty_model(model_b) == 1);
+    assert(next_change(model_b, sequence, &change));
+    assert(change.operation == CHANGE_ADD && NID_IS_EQUAL(change.nid, tid[0]));
+    assert(change.sequence > sequence);
+    sequence = change.sequence;
+    assert(next_change(model_b, sequence, &change));
+    assert(change.operation == CHANGE_REMOVE && NID_IS_EQUAL(change.nid, tid[0]));
+    sequence = change.sequence;
+    assert(next_change(model_b, sequence, &change));
+    assert(change.operation == CHANGE_ADD && NID_IS_EQUAL(change.nid, tid[1]));
+    sequence = change.sequence;
+    assert(next_change(model_b, sequence, &change));
+    assert(change.operation == CHANGE_REMOVE && NID_IS_EQUAL(change.nid, tid[1]));
+    sequence = change.sequence;
+    assert(!next_change(model_b, sequence, &change));
+
+    /* Test infer_triples() with a transitive property. */
+    triple.nodes[1] = identify_node("partOf", 6);
+    for(n = 1; n < 5; ++n)
+    {
+        triple.nodes[0] = identify_integer(n);
+        triple.nodes[2] = identify_integer(n + 1);
+        add_triple(model_a, identify_triple(&triple));
+    }
+    body[0].terms[0].variable = 1;
+    body[0].terms[1].variable = 0; body[0].terms[1].node = triple.nodes[1];
+    body[0].terms[2].variable = 2;
+    body[1].terms[0].variable = 2;
+    body[1].terms[1].variable = 0; body[1].terms[1].node = triple.nodes[1];
+    body[1].terms[2].variable = 3;
+    rule.head.terms[0].variable = 1;
+    rule.head.terms[1].variable = 0; rule.head.terms[1].node = triple.nodes[1];
+    rule.head.terms[2].variable = 3;
+    rule.body = body;
+    rule.body_size = 2;
+    assert(infer_triples(model_b, model_a, &rule, 1) == 6);
+    assert(infer_triples(model_b, model_a, &rule, 1) == 0);
+    triple.nodes[0] = identify_integer(1);
+    triple.nodes[2] = identify_integer(5);
+    NID_SET_NULL(nid);
+    assert(!NID_IS_NULL(find_triple(model_b, &triple, nid)));
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+
+    /* Test path traversal. */
+    path = open_path(model_a, identify_integer(1), triple.nodes[1], 0, 0);
+    for(n = 2; n <= 5; ++n)
+    {
+        nid = next_path_node(path);
+        assert(NID_IS_EQUAL(nid, identify_integer(n)));
+    }
+    assert(NID_IS_NULL(next_path_node(path)));
+    close_path(path);
+    path = open_path( model_a, identify_integer(5), triple.nodes[1],
+                      PATH_ZERO_OR_MORE | PATH_INVERSE, 2 );
+    for(n = 5; n >= 3; --n)
+    {
+        nid = next_path_node(path);
+        assert(NID_IS_EQUAL(nid, identify_integer(n)));
+    }
+    assert(NID_IS_NULL(next_path_node(path)));
+    close_path(path);
+    triple.nodes[0] = nid_a; triple.nodes[2] = nid_c;             /* A,p,C */
+    add_triple(model_a, identify_triple(&triple));
+    triple.nodes[0] = nid_c; triple.nodes[2] = nid_a;             /* C,p,A */
+    add_triple(model_a, identify_triple(&triple));
+    path = open_path(model_a, nid_a, triple.nodes[1], 0, 0);
+    nid = next_path_node(path);
+    assert(NID_IS_EQUAL(nid, nid_c));
+    nid = next_path_node(path);
+    assert(NID_IS_EQUAL(nid, nid_a));
+    assert(NID_IS_NULL(next_path_node(path)));
+    close_path(path);
+    empty_model(model_a);
+    empty_model(model_b);
+
+    /* find_triple() continues past triple indices whose successor does not
+       sort after them in the index (every 256th one). */
+    triple.nodes[0] = nid_a; triple.nodes[1] = nid_b;
+    for(n = 0; n < 600; ++n)
+    {
+        triple.nodes[2] = identify_integer(n);
+        add_triple(model_a, identify_triple(&triple));
+    }
+    NID_SET_NULL(triple.nodes[2]);
+    found = 0;
+    NID_SET_NULL(nid);
+    while(nid = find_triple(model_a, &triple, nid), !NID_IS_NULL(nid))
+    {
+        assert(found < 600);
+        ++found;
+    }
+    assert(found == 600);
+    assert(empty_model(model_a) == 600);
+
+    /* Test tripledb_backup(). */
+    mkdir("backup", 0700);
+    assert(tripledb_backup("backup", 0) == 0);
+    assert(access("backup/triples.db", F_OK) == 0);
+    assert(tripledb_backup("nonexistent/directory", 0) == -1);
+    remove_directory("backup");
+
+    /* Test tripledb_stats(). */
+    tripledb_stats(&counters);
+    if(counters.enabled)
+    {
+        assert(counters.calls[STATS_OP_IDENTIFY_NODE] > 0);
+        assert(counters.calls[STATS_OP_ABSORB_MODEL] > 0);
+        assert(counters.gets[STATS_DB_NODES_INDEX] > 0);
+        assert(counters.puts[STATS_DB_MODEL_TRIPLES] > 0);
+        assert(counters.dels[STATS_DB_MODEL_TRIPLES] > 0);
+        assert( stats_percentile(&counters, STATS_OP_ADD_TRIPLE, 50) <=
+                stats_percentile(&counters, STATS_OP_ADD_TRIPLE, 100) );
+    }
+    else
+        assert(counters.calls[STATS_OP_IDENTIFY_NODE] == 0);
+    memset(&counters, 0, sizeof(counters));
+    counters.calls[STATS_OP_FIND_TRIPLE] = 4;
+    counters.latency[STATS_OP_FIND_TRIPLE][3] = 2;   /* 3ns */
+    counters.latency[STATS_OP_FIND_TRIPLE][16] = 2;  /* 16-17ns */
+    assert(stats_percentile(&counters, STATS_OP_FIND_TRIPLE, 50) == 3);
+    assert(stats_percentile(&counters, STATS_OP_FIND_TRIPLE, 51) == 17);
+    assert(stats_percentile(&counters, STATS_OP_ADD_TRIPLE, 99) == 0);
+
     close_model(model_a);
     close_model(model_b);
-    free(buffer);
+    get_cache_stats(&stats);
+    assert(stats.open_models == 0); assert(stats.models == 0);
+
+    model_a = open_model("read only");
+    add_triple(model_a, tid[0]);
+    close_model(model_a);
 
     tripledb_finalize();
+
+    /* Test read-only mode. */
+    options.flags = TRIPLEDB_FREAD_ONLY;
+    options.cache_size = 0;
+    tripledb_initialize_options(&options);
+    nid = identify_node(a, la);
+    assert(NID_IS_EQUAL(nid, nid_a));
+    assert(NID_IS_NULL(identify_node("not in the store", 16)));
+    nid = identify_integer(123456789);
+    assert(NID_IS_NULL(nid));
+    nid = identify_node("zq", 2);
+    assert(NID_IS_INLINE(nid));
+    triple.nodes[0] = nid; triple.nodes[1] = nid; triple.nodes[2] = nid;
+    assert(NID_IS_NULL(identify_triple(&triple)));
+    NID_SET_NULL(nid);
+    model_a = open_model("read only");
+    TRIPLE_SET_NULL(triple);
+    nid = find_triple(model_a, &triple, nid);
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+    close_model(model_a);
+    model_a = open_model("nonexistent");
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+    close_model(model_a);
+
+    tripledb_finalize();
+
+    /* Test compact triple index keys. */
+    options.flags = TRIPLEDB_FCOMPACT_INDEX;
+    tripledb_initialize_options(&options);
+    model_a = open_model("compact");
+    m = 0;
+    for(n = 0; n < 6; ++n)
+        m += add_triple(model_a, tid[n]);
+    for(n = 0; n < 6; ++n)
+    {
+        triple = resolve_triple(tid[n]);
+        NID_SET_NULL(triple.nodes[1]); NID_SET_NULL(triple.nodes[2]);
+        found = 0;
+        NID_SET_NULL(nid);
+        for(nid = find_triple(model_a, &triple, nid); !NID_IS_NULL(nid);
+            nid = find_triple(model_a, &triple, nid))
+        {
+            found += NID_IS_EQUAL(nid, tid[n]);
+        }
+        assert(found == 1);
+    }
+    close_model(model_a);
+    tripledb_finalize();
+
+    /* The model keeps its format without TRIPLEDB_FCOMPACT_INDEX. */
+    tripledb_initialize();
+    model_a = open_model("compact");
+    TRIPLE_SET_NULL(triple);
+    found = 0;
+    NID_SET_NULL(nid);
+    for(nid = find_triple(model_a, &triple, nid); !NID_IS_NULL(nid);
+        nid = find_triple(model_a, &triple, nid))
+    {
+        ++found;
+    }
+    assert(found == m);
+    assert(empty_model(model_a) == m);
+    close_model(model_a);
+
+    /* Test enable_triple_filter(). */
+    model_a = open_model("filtered");
+    add_triple(model_a, tid[0]);
+    add_triple(model_a, tid[1]);
+    enable_triple_filter(model_a);
+    add_triple(model_a, tid[2]);
+    triple = resolve_triple(tid[2]);
+    NID_SET_NULL(nid);
+    nid = find_triple(model_a, &triple, nid);
+    assert(NID_IS_EQUAL(nid, tid[2]));
+    triple = resolve_triple(tid[3]);
+    NID_SET_NULL(nid);
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+    assert(remove_triple(model_a, tid[3]) == 0);
+    assert(remove_triple(model_a, tid[0]) == 1);
+    close_model(model_a);
+    model_a = open_model("filtered");
+    triple = resolve_triple(tid[1]);
+    NID_SET_NULL(nid);
+    nid = find_triple(model_a, &triple, nid);
+    assert(NID_IS_EQUAL(nid, tid[1]));
+    triple = resolve_triple(tid[0]);
+    NID_SET_NULL(nid);
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+    assert(empty_model(model_a) == 2);
+    close_model(model_a);
+
+    /* The filter of an empty model is kept, so it remains enabled. */
+    assert(access("model_filtered_filter.bin", F_OK) == 0);
+    model_a = open_model("filtered");
+    assert(add_triple(model_a, tid[3]) == 1);
+    triple = resolve_triple(tid[3]);
+    NID_SET_NULL(nid);
+    assert(NID_IS_EQUAL(find_triple(model_a, &triple, nid), tid[3]));
+    assert(remove_triple(model_a, tid[3]) == 1);
+    close_model(model_a);
+
+    /* Test remove_triples() and deferred removal. */
+    model_a = open_model("removals");
+    for(n = 0; n < 6; ++n)
+        add_triple(model_a, tid[n]);
+    assert(remove_triples(model_a, tid, 3) == 3);
+    assert(remove_triples(model_a, tid, 3) == 0);
+    enable_deferred_removal(model_a);
+    assert(remove_triple(model_a, tid[3]) == 1);
+    assert(remove_triple(model_a, tid[3]) == 0);
+    TRIPLE_SET_NULL(triple);
+    NID_SET_NULL(nid);
+    found = 0;
+    for( nid = find_triple(model_a, &triple, nid); !NID_IS_NULL(nid);
+         nid = find_triple(model_a, &triple, nid) )
+    {
+        assert(!NID_IS_EQUAL(nid, tid[3]));
+        ++found;
+    }
+    assert(found == 2);
+    assert(add_triple(model_a, tid[3]) == 1);
+    assert(remove_triples(model_a, tid + 3, 3) == 3);
+    NID_SET_NULL(nid);
+    assert(NID_IS_NULL(find_triple(model_a, &triple, nid)));
+    compact_model(model_a);
+    assert(empty_model(model_a) == 0);
+    close_model(model_a);
+
+    /* Test the history of a model. */
+    model_a = open_model("history");
+    add_triple(model_a, tid[0]);
+    enable_history(model_a);
+    sequence = current_version(model_a);
+    add_triple(model_a, tid[1]);
+    remove_triple(model_a, tid[0]);
+    assert(current_version(model_a) == sequence + 2);
+    TRIPLE_SET_NULL(triple);
+    NID_SET_NULL(nid);
+    nid = find_triple_as_of(model_a, &triple, nid, sequence);
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    nid = find_triple_as_of(model_a, &triple, nid, sequence);
+    assert(NID_IS_NULL(nid));
+    nid = find_triple_as_of(model_a, &triple, nid, sequence + 2);
+    assert(NID_IS_EQUAL(nid, tid[1]));
+    prune_history(model_a, sequence + 2);
+    NID_SET_NULL(nid);
+    nid = find_triple_as_of(model_a, &triple, nid, sequence + 1);
+    assert(NID_IS_EQUAL(nid, tid[1]));
+    nid = find_triple_as_of(model_a, &triple, nid, sequence + 1);
+    assert(NID_IS_NULL(nid));
+    assert(empty_model(model_a) == 1);
+    close_model(model_a);
+
+    /* The history remains enabled while it is empty. */
+    model_a = open_model("new_history");
+    enable_history(model_a);
+    close_model(model_a);
+    assert(access("model_new_history_versions.db", F_OK) == 0);
+    model_a = open_model("new_history");
+    add_triple(model_a, tid[0]);
+    NID_SET_NULL(nid);
+    nid = find_triple_as_of(model_a, &triple, nid, current_version(model_a));
+    assert(NID_IS_EQUAL(nid, tid[0]));
+    mkdir("backup", 0700);
+    assert(tripledb_backup("backup", 0) == 0);
+    assert(access("backup/model_new_history_versions.db", F_OK) == 0);
+    remove_directory("backup");
+    assert(empty_model(model_a) == 1);
+    close_model(model_a);
+    tripledb_stats(&counters);
+    assert( !counters.enabled ||
+            counters.puts[STATS_DB_MODEL_HISTORY] > 0 );
+
+    /* Test the asynchronous requests. */
+    async_initialize(2);
+    model_a = open_model("async");
+    for(n = 0; n < 6; ++n)
+        handles[n] = async_add_triple(model_a, tid[n], NULL, NULL);
+    NID_SET_NULL(triple.nodes[0]);
+    NID_SET_NULL(triple.nodes[1]);
+    NID_SET_NULL(triple.nodes[2]);
+    NID_SET_NULL(nid);
+    handles[6] = async_find_triples(model_a, &triple, nid, 10, NULL, NULL);
+    async_identify_node(a, la, count_callback, &nid_a);
+    async_wait(handles[6]);
+    nids = async_nids(handles[6], &m);
+    assert(m == 6 && !NID_IS_NULL(nids[5]));
+    for(n = 0; n < 7; ++n)
+    {
+        handle = async_completed();
+        assert(handle == handles[n]);
+        if(n < 6)
+            assert(async_count(handle) == 1);
+    }
+    assert(async_completed() == NULL);
+    for(n = 0; n < 7; ++n)
+        async_free(handles[n]);
+
+    /* Freeing a request in the completion queue drains its descriptor. */
+    handles[0] = async_add_triple(model_a, tid[0], NULL, NULL);
+    async_wait(handles[0]);
+    async_free(handles[0]);
+    assert(async_completed() == NULL);
+    assert(read(async_fd(), &byte, 1) == -1);
+    async_finalize();
+    assert(async_callbacks == 1);
+    assert(empty_model(model_a) == 6);
+    close_model(model_a);
+
+    tripledb_finalize();
+
+    /* Test IRI prefix compression in a new store. */
+    mkdir("prefixed", 0700);
+    assert(chdir("prefixed") == 0);
+    options.flags = TRIPLEDB_FPREFIX_NODES;
+    tripledb_initialize_options(&options);
+    nid_a = identify_node(d, ld);
+    nid_b = identify_node(e, le);
+    nid_c = identify_integer(47);
+    assert(access("prefixes.db", F_OK) == 0);
+    assert(access("inline_nodes", F_OK) == 0);
+    tripledb_finalize();
+    options.flags = 0;
+    tripledb_initialize_options(&options);
+    assert(NID_IS_EQUAL(identify_node(e, le), nid_b));
+    assert(NID_IS_EQUAL(identify_node(d, ld), nid_a));
+    size = 4096;
+    result = resolve_node(nid_a, buffer, &size);
+    assert(size == ld && memcmp(result, d, ld) == 0);
+    size = 4096;
+    result = resolve_node(nid_b, buffer, &size);
+    assert(size == le && memcmp(result, e, le) == 0);
+    assert(resolve_integer(nid_c) == 47);
+
+    /* Node data that is not an IRI is stored without a prefix. */
+    nid = identify_node("see /usr/share/doc/tripledb/", 28);
+    size = 4096;
+    result = resolve_node(nid, buffer, &size);
+    assert( size == 28 &&
+            memcmp(result, "see /usr/share/doc/tripledb/", 28) == 0 );
+
+    /* Inline nodes of existing triples are added to a new search index. */
+    triple.nodes[0] = nid_a;
+    triple.nodes[1] = triple.nodes[2] = identify_node(b, lb);
+    identify_triple(&triple);
+    tripledb_finalize();
+    options.flags = TRIPLEDB_FSEARCH_INDEX;
+    tripledb_initialize_options(&options);
+    NID_SET_NULL(nid);
+    nid = find_node_prefix("Kort", 4, nid);
+    assert(NID_IS_EQUAL(nid, triple.nodes[1]));
+    nid = find_node_substring("RTE", 3, nid);
+    assert(NID_IS_NULL(nid));
+
+    /* Typed literal values in the node dictionary are not indexed. */
+    NID_SET_NULL(nid);
+    found = 0;
+    while(nid = find_node_prefix("", 0, nid), !NID_IS_NULL(nid))
+    {
+        assert(nid.flags == 0 || NID_IS_INLINE(nid));
+        assert(nid.index != nid_c.index || NID_IS_INLINE(nid));
+        ++found;
+    }
+    assert(found == 4);
+    tripledb_finalize();
+    assert(chdir("..") == 0);
+    remove_directory("prefixed");
+
+    /* A store created before inline nodes keeps the dictionary identifiers
+       of short node data. */
+    mkdir("legacy", 0700);
+    assert(chdir("legacy") == 0);
+    db = dbopen("nodes.db", O_CREAT | O_RDWR, 0600, DB_RECNO, NULL);
+    assert(db);
+    record = 1;
+    key.data = &record; key.size = sizeof(record);
+    value.data = b; value.size = lb;
+    assert(db->put(db, &key, &value, 0) == 0);
+    assert(db->close(db) == 0);
+    db = dbopen("nodes_index.db", O_CREAT | O_RDWR, 0600, DB_HASH, NULL);
+    assert(db);
+    assert(db->put(db, &value, &key, 0) == 0);
+    assert(db->close(db) == 0);
+    tripledb_initialize();
+    nid = identify_node(b, lb);
+    assert(!NID_IS_INLINE(nid) && nid.index == 1);
+    assert(NID_IS_INLINE(identify_node("zq", 2)));
+    size = 4096;
+    result = resolve_node(nid, buffer, &size);
+    assert(size == lb && memcmp(result, b, lb) == 0);
+    tripledb_finalize();
+    assert(access("inline_nodes", F_OK) != 0);
+    assert(chdir("..") == 0);
+    remove_directory("legacy");
+    free(buffer);
     
     return 0;
 }
 
+#else  /* ndef TEST_CLIENT */
+
+/*  Tests the client library against a server that is started on a new store
+    in a child process. This is a separate program, as the client library
+    implements the functions of the triple database library. */
+int main()
+{
+    nid_t nid_a, nid_b, nids[40], order[40], nid;
+    size_t size;
+    const void *result;
+    model_handle model_a, model_b;
+    triple_t triple, pattern;
+    struct timespec delay;
+    pid_t server;
+    unsigned n, found;
+    int status;
+
+    mkdir("served", 0700);
+    server = fork();
+    assert(server >= 0);
+    if(server == 0)
+    {
+        execl("./tripledbd", "tripledbd", "served", "test.sock", (char*)NULL);
+        _exit(127);
+    }
+    for(n = 0; tripledb_connect("served/test.sock") != 0; ++n)
+    {
+        /* The server is not listening yet. */
+        assert(n < 100);
+        delay.tv_sec = 0;
+        delay.tv_nsec = 100000000;
+        nanosleep(&delay, NULL);
+    }
+    model_a = open_model("client");
+    model_b = open_model(NULL);
+
+    nid_a = identify_node(a, la);
+    nid_b = identify_node(b, lb);
+    assert(NID_IS_INLINE(nid_b));
+    assert(NID_IS_EQUAL(identify_node(a, la), nid_a));
+    result = resolve_node(nid_a, NULL, &size);
+    assert(size == la && memcmp(result, a, la) == 0);
+    free_data(result);
+    nid = identify_node(c, lc);
+    result = resolve_node(nid, NULL, &size);
+    assert(size == lc && memcmp(result, c, lc) == 0);
+    free_data(result);
+    nid = identify_node(d, ld);
+    assert(!NID_IS_EQUAL(identify_node(e, le), nid));
+
+    triple.nodes[0] = nid_a;
+    triple.nodes[1] = nid_b;
+    for(n = 0; n < 40; ++n)
+    {
+        triple.nodes[2] = identify_node(&n, sizeof(n));
+        nids[n] = identify_triple(&triple);
+        assert(NID_IS_TRIPLE(nids[n]));
+    }
+    pattern = resolve_triple(nids[39]);
+    assert(TRIPLE_IS_EQUAL(pattern, triple));
+    assert(add_triples(model_a, nids, 40) == 40);
+    assert(add_triple(model_a, nids[0]) == 0);
+
+    /* Matches are fetched in batches of increasing size. */
+    pattern.nodes[0] = nid_a;
+    NID_SET_NULL(pattern.nodes[1]);
+    NID_SET_NULL(pattern.nodes[2]);
+    NID_SET_NULL(nid);
+    for(found = 0; nid = find_triple(model_a, &pattern, nid),
+                   !NID_IS_NULL(nid); ++found)
+    {
+        assert(found < 40);
+        order[found] = nid;
+    }
+    assert(found == 40);
+
+    /* A modification discards the fetched batch, so a triple removed from
+       it is not returned. */
+    for(found = 0; nid = find_triple(model_a, &pattern, nid),
+                   !NID_IS_NULL(nid); ++found)
+    {
+        assert(NID_IS_EQUAL(nid, order[found < 10 ? found : found + 1]));
+        if(found == 5)
+            assert(remove_triple(model_a, order[10]) == 1);
+    }
+    assert(found == 39);
+
+    /* The server rejects node identifiers that do not exist. */
+    nid.index = 1000000;
+    nid.flags = NID_FTRIPLE;
+    assert(add_triple(model_a, nid) == 0);
+    assert(remove_triple(model_a, nid) == 0);
+    triple = resolve_triple(nid);
+    assert(NID_IS_NULL(triple.nodes[0]));
+    assert(NID_IS_NULL(find_triple(model_a, &pattern, nid)));
+    nid.flags = 0;
+    assert(resolve_node(nid, NULL, &size) == NULL && size == 0);
+    triple.nodes[0] = nid_a;
+    triple.nodes[1] = nid_b;
+    triple.nodes[2] = nid;
+    assert(NID_IS_NULL(identify_triple(&triple)));
+    nid.index = 0;
+    nid.flags = NID_FTRIPLE;
+    assert(add_triple(model_a, nid) == 0);
+
+    /* The connection is still usable. */
+    absorb_model(model_b, model_a);
+    assert(empty_model(model_b) == 39);
+    assert(remove_triples(model_a, nids, 40) == 39);
+    NID_SET_NULL(nid);
+    assert(NID_IS_NULL(find_triple(model_a, &pattern, nid)));
+    close_model(model_b);
+    close_model(model_a);
+    tripledb_finalize();
+
+    assert(kill(server, SIGTERM) == 0);
+    assert(waitpid(server, &status, 0) == server);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    remove_directory("served");
+
+    return 0;
+}
+
+#endif  /* ndef TEST_CLIENT */
+
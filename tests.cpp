@@ -0,0 +1,87 @@
+/*  Tests the C++ interface to the triple database (tripledb.hpp). */
+
+#include "tripledb.hpp"
+
+#include <cassert>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+int main()
+{
+    std::filesystem::create_directory("cpp_store");
+    std::filesystem::current_path("cpp_store");
+    {
+        tripledb::store store;
+        tripledb::model model("example");
+        nid_t subject = tripledb::identify("http://example.org/subject");
+        nid_t knows = tripledb::identify("http://example.org/knows");
+        std::vector<nid_t> objects, triples;
+
+        assert(tripledb::resolve(knows).view() == "http://example.org/knows");
+
+        /* More triples than fit in a batch of a range. */
+        for(unsigned n = 0; n < 600; ++n)
+        {
+            std::string object = "object " + std::to_string(n);
+
+            objects.push_back(tripledb::identify(object));
+            triples.push_back(tripledb::identify(subject, knows, objects[n]));
+            assert(model.add(triples[n]));
+        }
+        assert(!model.add(triples[0]));
+        assert(model.contains(subject, knows, objects[599]));
+        assert(!model.contains(subject, knows, subject));
+
+        unsigned found = 0;
+        for(nid_t triple : model.find<tripledb::predicate>(knows))
+        {
+            assert(NID_IS_TRIPLE(triple));
+            ++found;
+        }
+        assert(found == 600);
+        found = 0;
+        for(nid_t triple :
+            model.find<tripledb::all>(subject, knows, objects[7]))
+        {
+            assert(NID_IS_EQUAL(triple, triples[7]));
+            ++found;
+        }
+        assert(found == 1);
+
+        /* A snapshot is not affected by later changes to the model. */
+        {
+            tripledb::snapshot snapshot(model);
+
+            assert(model.remove(triples.data(), 300) == 300);
+            assert(snapshot.count<tripledb::subject>(subject) == 600);
+            found = 0;
+            for(nid_t triple :
+                snapshot.find<tripledb::subject | tripledb::predicate>(
+                    subject, knows))
+            {
+                assert(NID_IS_TRIPLE(triple));
+                ++found;
+            }
+            assert(found == 600);
+            assert(!snapshot.find<tripledb::all>(
+                       subject, knows, objects[0]).empty());
+        }
+
+        /* Triples removed during the iteration of a model may still be
+           returned, but every remaining triple is returned once. */
+        found = 0;
+        for(nid_t triple : model.find<tripledb::subject>(subject))
+        {
+            assert(NID_IS_TRIPLE(triple));
+            model.remove(triple);
+            ++found;
+        }
+        assert(found == 300);
+        assert(model.find<tripledb::subject>(subject).empty());
+    }
+    std::filesystem::current_path("..");
+    std::filesystem::remove_all("cpp_store");
+
+    return 0;
+}
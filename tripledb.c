@@ -1,14 +1,19 @@
 #include "tripledb.h"
 #include "hash.h"
 #include "hashtable.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <db.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
 
 #ifdef THREADSAFE
 #include <pthread.h>
@@ -19,8 +24,17 @@
 #define MUTEX_DESTROY(mutex) \
     { int result = pthread_mutex_destroy(&mutex); assert(result == 0); }
     
+#ifdef TRIPLEDB_STATS
+/*  Locks that are not free are timed; see lock_statistic(). */
+#define MUTEX_LOCK(mutex) \
+    { int result = pthread_mutex_trylock(&mutex); \
+      if(result == EBUSY) \
+          result = stats_lock(&mutex, lock_statistic(&mutex)); \
+      assert(result == 0); }
+#else
 #define MUTEX_LOCK(mutex) \
     { int result = pthread_mutex_lock(&mutex); assert(result == 0); }
+#endif
     
 #define MUTEX_UNLOCK(mutex) \
     { int result = pthread_mutex_unlock(&mutex); assert(result == 0); }
@@ -36,27 +50,109 @@
 #include "urlencoding.h"
 
 static DB *nodes, *nodes_index, *triples, *triples_index;
-static recno_t last_node, last_triple; 
+static DB *nodes_prefix_index, *nodes_trigram_index; /* NULL if not in use */
+static recno_t last_node, last_triple; /* 0 in read-only mode */
+static int read_only;  /* opened with TRIPLEDB_FREAD_ONLY */
+static int compact_index;  /* opened with TRIPLEDB_FCOMPACT_INDEX */
+static int short_nodes_stored;  /* the store was created before inline nodes,
+                                   so the node dictionary may hold short node
+                                   data */
+
+/*  File whose presence marks a store created with inline nodes, in which the
+    node dictionary holds no node data of NID_INLINE_MAX bytes or less. */
+#define INLINE_NODES_MARKER "inline_nodes"
+
+/*  The IRI prefix table (see TRIPLEDB_FPREFIX_NODES), which is only appended
+    to. Prefix n is stored as record n of 'prefixes' and as entry n - 1 of
+    'prefix_table'; 'prefix_ids' maps prefix data to (unsigned)n. Additions
+    are made with both nodes_index_mutex and nodes_mutex held, so either
+    protects reads. */
+typedef struct prefix
+{
+    char *data;
+    size_t size;
+} prefix_t;
+
+static DB *prefixes;  /* NULL if not in use */
+static prefix_t *prefix_table;
+static unsigned prefix_count, prefix_capacity;
+static ht_t prefix_ids;
 static ht_t open_models; /* (char*)model_name => (model_t*)model */
 
+/*  Page cache memory, in bytes (protected by models_mutex). */
+static unsigned long cache_budget, cache_dictionaries, cache_available;
+static unsigned open_model_count;
+
+/*  Smallest page cache assigned to a model; below this, the model uses the
+    default page cache instead. */
+#define MIN_MODEL_CACHE_SIZE (256*1024UL)
+
+/*  Largest page cache a single database can use. */
+#define MAX_CACHE_SIZE ((unsigned long)(unsigned)-1)
+
 #ifdef THREADSAFE
 /*  NB. when acquiring multiple locks:
         - nodes_index_mutex must be acquired before nodes_mutex
         - triples_index_mutex must be acquired before triples_mutex
+        - search_index_mutex must not be held while acquiring any other lock
+        - the locks of several models are acquired in the order of the
+          addresses of their triple indices
     This way deadlocks can be avoided.
 */
 static pthread_mutex_t nodes_mutex, nodes_index_mutex,
                        triples_mutex, triples_index_mutex,
-                       models_mutex;
+                       models_mutex, search_index_mutex;
+
+#ifdef TRIPLEDB_STATS
+/*  Returns the STATS_LOCK_ constant under which waits for a lock are
+    measured. */
+static unsigned lock_statistic(pthread_mutex_t *mutex)
+{
+    if(mutex == &nodes_mutex)
+        return STATS_LOCK_NODES;
+    if(mutex == &nodes_index_mutex)
+        return STATS_LOCK_NODES_INDEX;
+    if(mutex == &triples_mutex)
+        return STATS_LOCK_TRIPLES;
+    if(mutex == &triples_index_mutex)
+        return STATS_LOCK_TRIPLES_INDEX;
+    if(mutex == &models_mutex)
+        return STATS_LOCK_MODELS;
+    if(mutex == &search_index_mutex)
+        return STATS_LOCK_SEARCH_INDEX;
+    return STATS_LOCK_MODEL;
+}
+#endif
 #endif
 
 typedef struct model
 {
-    DB *triples_index;
-    char *name, *filename;
+    DB *triples_index, *values_index;
+    DB *changes;              /* NULL if the change log is not enabled */
+    DB *history_index, *versions;   /* NULL if the history is not enabled */
+    int compact;                /* triple index uses compact keys */
+    recno_t last_change;
+    char *name, *filename, *values_filename, *changes_filename;
+    char *filter_filename, *history_filename, *versions_filename;
+    struct triple_filter *filter;   /* NULL if the filter is not enabled */
+    ht_t *tombstones;   /* (unsigned)index => "", or NULL if removal is not
+                           deferred */
+    unsigned tombstone_count;
     unsigned references;
+    unsigned long cache_size;   /* page cache memory taken from the pool */
+    int read_only;              /* named model opened in read-only mode */
+    struct snapshot *snapshots; /* open snapshots, newest first */
+    struct undo_record *undo;   /* changes made while snapshots are open */
+    unsigned undo_first;        /* sequence number of the change 'undo[0]' */
+    unsigned undo_size, undo_capacity;
+    ht_t *undo_last;    /* (unsigned)index => (unsigned)sequence number of the
+                           last change of a triple in 'undo', or NULL if no
+                           snapshots are open */
 #ifdef THREADSAFE
     pthread_mutex_t triples_index_mutex;
+    pthread_t compactor;        /* background compaction thread */
+    int compactor_started;      /* compactor has been started and not joined */
+    int compacting;             /* compactor is running */
 #endif
 } model_t;
 
@@ -65,503 +161,4630 @@ typedef struct triple_entry {
     unsigned index;    
 } triple_entry_t;
 
-
-void tripledb_initialize()
+/*  A change of a model, made while snapshots of it are open. Changes are
+    numbered in sequence, starting at 1. */
+typedef struct undo_record
 {
-    int result;
-    DBT key;
-    
-    assert(sizeof(unsigned) == sizeof(recno_t));
-    assert(sizeof(unsigned) == sizeof(size_t));
-    assert(sizeof(nid_t) == 2*sizeof(unsigned));
-    assert(sizeof(triple_t) == 3*sizeof(nid_t));
-    assert(sizeof(triple_entry_t) == sizeof(triple_t) + sizeof(unsigned));
+    triple_entry_t entry;   /* the complete triple and its index */
+    unsigned previous;      /* sequence number of the previous change of the
+                               triple, or 0 */
+    int added;              /* the triple was added rather than removed */
+} undo_record_t;
 
-    ht_create(&open_models, hash_fnv1);
+/*  Rank checkpoints of the triples matching a pattern in a snapshot, which
+    map a position in the matches to a triple to continue after. As the
+    contents of a snapshot do not change, checkpoints are kept until the
+    snapshot is closed. */
+typedef struct snapshot_rank
+{
+    triple_t pattern;
+    nid_t *marks;           /* 'marks[n]' is match (n + 1)*SCAN_BATCH - 1 */
+    unsigned size, capacity;
+    int complete;           /* all matches were visited */
+    unsigned count;         /* number of matches, if 'complete' */
+    struct snapshot_rank *next;
+} snapshot_rank_t;
 
-    /* Open nodes database. */
-    nodes = dbopen("nodes.db", O_CREAT | O_EXLOCK | O_RDWR, 0700, DB_RECNO, NULL);
-    assert(nodes);
-    nodes_index = dbopen("nodes_index.db", O_CREAT | O_EXLOCK | O_RDWR, 0700, DB_HASH, NULL);
-    assert(nodes_index);
-    
-    /* Look up last node index. */
-    result = nodes->seq(nodes, &key, NULL, R_LAST);
-    assert(result == 0 || result == 1);
-    assert(result != 0 || key.size == sizeof(last_node));
-    last_node = ( result == 0 ? *(recno_t*)key.data : 0);
-    
-    /* Open triples database. */
-    triples = dbopen("triples.db", O_CREAT | O_EXLOCK | O_RDWR, 0700, DB_RECNO, NULL);
-    assert(triples);
-    triples_index = dbopen("triples_index.db", O_CREAT | O_EXLOCK | O_RDWR, 0700, DB_HASH, NULL);
-    assert(triples_index);
-    
-    /* Look up last triple index. */
-    result = triples->seq(triples, &key, NULL, R_LAST);
-    assert(result == 0 || result == 1);
-    assert(result != 0 || key.size == sizeof(last_node));
-    last_triple = ( result == 0 ? *(recno_t*)key.data : 0 );
-    
-    /* Initialize synchronization primitives. */
-    MUTEX_INIT(nodes_mutex);
-    MUTEX_INIT(nodes_index_mutex);
-    MUTEX_INIT(triples_mutex);
-    MUTEX_INIT(triples_index_mutex);
-}
+/*  A snapshot of a model. Snapshots search the model's index itself, and
+    undo the changes made since they were opened: a triple changed since
+    then is hidden, and a triple of which the first change since then was a
+    removal is restored from the model's undo log. */
+typedef struct snapshot
+{
+    model_t *model;
+    unsigned start;                 /* sequence number of the first change
+                                       made after the snapshot was opened */
+    struct snapshot *newer, *older; /* other open snapshots of the model */
+    triple_t pattern;               /* pattern of the restored triples */
+    triple_entry_t *restored;       /* restored triples matching 'pattern',
+                                       in key order */
+    unsigned restored_size, restored_capacity;
+    unsigned restored_end;          /* sequence number of the first change
+                                       not searched for restored triples, or
+                                       0 if none were searched */
+    snapshot_rank_t *ranks;         /* rank checkpoints, by pattern */
+} snapshot_t;
 
+typedef struct change_record {
+    unsigned operation;
+    nid_t nid;
+} change_record_t;
 
-void tripledb_finalize()
+typedef struct path
 {
-    int result;
-    
-    result = nodes->close(nodes);
-    assert(result == 0);
-    
-    result = nodes_index->close(nodes_index);
-    assert(result == 0);
-    
-    ht_destroy(&open_models);
-
-    /* Finalize synchronization primitives. */
-    MUTEX_DESTROY(nodes_mutex);
-    MUTEX_DESTROY(nodes_index_mutex);
-    MUTEX_DESTROY(triples_mutex);
-    MUTEX_DESTROY(triples_index_mutex);
-}
+    model_t *model;
+    nid_t predicate;
+    unsigned flags, max_depth, depth;
+    nid_t *level;                   /* nodes at the current depth */
+    unsigned level_size, position;  /* next node of 'level' to return */
+    unsigned char *visited;         /* bitmap of visited dictionary nodes */
+    unsigned visited_size;          /* size of 'visited' in bytes */
+    ht_t *visited_other;            /* other visited nodes (or NULL) */
+} path_t;
 
 
-nid_t identify_node(const void *data, size_t size)
+/*  Packs node data of at most NID_INLINE_MAX bytes into a node identifier.
+    Unused bytes are left zero, so equal data yields equal identifiers. */
+static nid_t pack_inline_node(const void *data, size_t size)
 {
-    DBT node_id, node_data;
-    int result;
+    const unsigned char *bytes;
+    unsigned n;
     nid_t nid;
-    
-    NID_SET_NULL(nid);
 
-    node_data.data = (void*)data;
-    node_data.size =  size;
-    MUTEX_LOCK(nodes_index_mutex);
-    result = nodes_index->get(nodes_index, &node_data, &node_id, 0);
-    assert(result == 0 || result == 1);
-    
-    if(result == 0)
+    assert(size <= NID_INLINE_MAX);
+    bytes = (const unsigned char *)data;
+    nid.index = 0;
+    nid.flags = NID_FINLINE | ((unsigned)size << 2);
+    for(n = 0; n < size; ++n)
     {
-        /* Existing node found. */
-        assert(node_id.size == sizeof(size_t));
-        nid.index = *(unsigned*)node_id.data;
+        if(n < 4)
+            nid.index |= (unsigned)bytes[n] << (8*n);
+        else
+            nid.flags |= (unsigned)bytes[n] << (8*(n - 3));
     }
-    else
-    {
-        /* Create a new node. */
-        
-        MUTEX_LOCK(nodes_mutex);
-        
-        nid.index = ++last_node;
-        
-        node_id.data = &nid.index;
-        node_id.size = sizeof(nid.index);
-                
-        result = nodes->put(nodes, &node_id, &node_data, 0);
-        assert(result == 0);
-
-        result = nodes_index->put(nodes_index, &node_data, &node_id, 0);
-        assert(result == 0);
 
-        MUTEX_UNLOCK(nodes_mutex);
-    }
-    MUTEX_UNLOCK(nodes_index_mutex);
-    
     return nid;
 }
 
 
-nid_t identify_triple(triple_t *triple)
+/*  Unpacks the node data of an inline node identifier into 'data', which must
+    be at least NID_INLINE_MAX bytes large. Returns the node data size. */
+static size_t unpack_inline_node(nid_t nid, unsigned char *data)
 {
-    nid_t nid;
-    DBT key, value;
-    int result;
-    
-    nid.flags = NID_FTRIPLE;
-
-    key.data = triple;
-    key.size = sizeof(*triple);
-    MUTEX_LOCK(triples_index_mutex);
-    result = triples_index->get(triples_index, &key, &value, 0);
-    assert(result == 0 || result == 1);
+    size_t size;
+    unsigned n;
 
-    if(result == 0)
+    assert(NID_IS_INLINE(nid));
+    size = (nid.flags >> 2) & 7;
+    for(n = 0; n < size; ++n)
     {
-        assert(key.size == sizeof(triple_t));
-        assert(value.size == sizeof(unsigned));
-        
-        /* Existing triple identifier found. */
-        nid.index = *(unsigned *)value.data;
+        if(n < 4)
+            data[n] = (unsigned char)(nid.index >> (8*n));
+        else
+            data[n] = (unsigned char)(nid.flags >> (8*(n - 3)));
     }
-    else
-    {
-        /* Create a new triple identifier. */
 
-        MUTEX_LOCK(triples_mutex);
-        nid.index = ++last_triple;
+    return size;
+}
 
-        value.data = &nid.index;
-        value.size = sizeof(nid.index);
 
-        /* Add the triple to the triple database. */
-        result = triples->put(triples, &value, &key, 0);
-        assert(result == 0);
-        
-        /* Add the triple to the triple database index. */
-        result = triples_index->put(triples_index, &key, &value, 0);
-        assert(result == 0);
+/*  Size of the encoded value of a typed literal node: a type byte followed by
+    eight bytes that compare (with memcmp) in the same order as the values. */
+#define TYPED_VALUE_SIZE 9
 
-        MUTEX_UNLOCK(triples_mutex);
-    }
-    MUTEX_UNLOCK(triples_index_mutex);
-  
-    return nid;
+/*  Determines if dictionary node data is the encoded value of a typed
+    literal node. Node data identified with identify_node() is taken for a
+    typed value only if it has the same size and starts with a type byte. */
+static int is_typed_value(const void *data, size_t size)
+{
+    unsigned type;
+
+    if(size != TYPED_VALUE_SIZE)
+        return 0;
+    type = *(const unsigned char*)data;
+
+    return type == NID_TYPE_INTEGER || type == NID_TYPE_DOUBLE ||
+           type == NID_TYPE_DATETIME;
 }
 
+/*  Size of a key in a model's value index: the predicate node identifier,
+    the encoded object value and the big-endian triple index. */
+#define VALUE_KEY_SIZE (sizeof(nid_t) + TYPED_VALUE_SIZE + sizeof(unsigned))
 
-const void *resolve_node(nid_t nid, void *data, size_t *size)
+
+/*  Encodes an integer as a sign-flipped big-endian 64-bit value. */
+static void encode_integer(unsigned char *value, unsigned type, long integer)
 {
-    DBT node_id, node_data;
-    int result;
-        
-    assert(!NID_IS_TRIPLE(nid));
-    node_id.data = &nid.index;
-    node_id.size = sizeof(nid.index);
-    MUTEX_LOCK(nodes_mutex);
-    result = nodes->get(nodes, &node_id, &node_data, 0);
-    assert(result == 0);
-    
-    if(data == NULL)
-    {
-        /* Fill new buffer with node data. */
-        void *buffer;
-         
-        buffer = malloc(node_data.size);
-        assert(buffer != NULL);
-        memcpy(buffer, node_data.data, node_data.size);
-        *size = node_data.size;
-        MUTEX_UNLOCK(nodes_mutex);
-        
-        return buffer;
-    }
-    else
+    unsigned long bits;
+    unsigned n;
+
+    value[0] = (unsigned char)type;
+    bits = (unsigned long)integer;
+    for(n = 0; n < 8; ++n)
     {
-        if(node_data.size <= *size)
+        if(n < sizeof(long))
         {
-            /* Fill external buffer with node data. */
-            memcpy(data, node_data.data, node_data.size);
-            *size = node_data.size;
-            MUTEX_UNLOCK(nodes_mutex);
-            
-            return data;
+            value[8 - n] = (unsigned char)bits;
+            bits >>= 8;
         }
         else
         {
-            /* External buffer too small; only set data size. */
-            *size = node_data.size;
-            MUTEX_UNLOCK(nodes_mutex);
-
-            return NULL;
+            value[8 - n] = (unsigned char)(integer < 0 ? 0xFF : 0);
         }
     }
+    value[1] ^= 0x80;
 }
 
 
-triple_t resolve_triple(nid_t nid)
+static long decode_integer(const unsigned char *value)
 {
-    triple_t triple;
-    int result;
-    DBT key, value;
-
-    assert(NID_IS_TRIPLE(nid));
-    key.data = &nid.index;
-    key.size = sizeof(nid.index);
-    MUTEX_LOCK(triples_mutex);
-    result = triples->get(triples, &key, &value, 0);
-    assert(result == 0);
-    assert(value.size == sizeof(triple_t));
-    triple = *(triple_t *)value.data;
-    MUTEX_UNLOCK(triples_mutex);
-    
-    return triple;
-}
+    unsigned long bits;
+    unsigned n;
 
+    bits = 0;
+    for(n = 1; n <= 8; ++n)
+    {
+        bits = (bits << 8) | (n == 1 ? value[n] ^ 0x80 : value[n]);
+    }
 
-void free_data(const void *data)
-{
-    free((void*)data);
+    return (long)bits;
 }
 
 
-model_handle open_model(const char *name)
+/*  Encodes an IEEE 754 double as a big-endian 64-bit value, with the sign bit
+    flipped for positive values and all bits flipped for negative values. */
+static void encode_double(unsigned char *value, double real)
 {
-    model_t *model;
-    
-    MUTEX_LOCK(models_mutex);
+    unsigned char bytes[8];
+    unsigned one, n;
 
-    model = NULL;
-    if( name != NULL)
+    assert(sizeof(double) == sizeof(bytes));
+    if(real == 0)
     {
-        void *p;
-        
-        p = ht_get( &open_models, name, strlen(name), NULL );
-        if(p != NULL)
-        {
-            /* Open model found. */
-
-            model = *(model_t**)p;
-            ++(model->references);
-        }
+        /* Normalize negative zero. */
+        real = 0;
     }
+    memcpy(bytes, &real, sizeof(bytes));
 
-    if(model == NULL)
+    one = 1;
+    value[0] = NID_TYPE_DOUBLE;
+    for(n = 0; n < 8; ++n)
     {
-        /* Create a newly opened model. */
-        model = (model_t*)malloc(sizeof(model_t));
-        assert(model);
-        model->references = 1;
-        
-        /* Construct filename for this model. */
-        if(name == NULL)
-        {
-            model->name = NULL;
-            model->filename = NULL;
-        }
-        else
-        {
-            model->name = strdup(name);
-            model->filename = (char*)malloc(urlencoded_length(name) + 32);
-            assert(model->filename);
-            strcpy(model->filename, "model_");
-            urlencode(model->filename + strlen("model_"), name);
-            strcat(model->filename, "_triples_index.db");
-        }
-    
-        /* Open model database. */
-        model->triples_index = dbopen(
-            model->filename, O_CREAT | O_EXLOCK | O_RDWR, 0600,
-            DB_BTREE, NULL );
-        assert(model->triples_index);
-    
-        /* Initialize synchronization primitives. */
-        MUTEX_INIT(model->triples_index_mutex);
-        
-        if(model->name != NULL)
-        {
-            /* Register in table of open models. */
-            ht_put( &open_models, model->name, strlen(model->name),
-                    &model, sizeof(model) );
-        }
+        value[1 + n] = *(unsigned char *)&one ? bytes[7 - n] : bytes[n];
     }
 
-    MUTEX_UNLOCK(models_mutex);
-    
-    return model;
+    if(value[1] & 0x80)
+    {
+        for(n = 1; n <= 8; ++n)
+            value[n] ^= 0xFF;
+    }
+    else
+    {
+        value[1] ^= 0x80;
+    }
 }
 
 
-void close_model(model_handle model)
+static double decode_double(const unsigned char *value)
 {
-    MUTEX_LOCK(models_mutex);
-    if(--model->references != 0)
+    unsigned char bytes[8];
+    unsigned one, n;
+    double real;
+
+    one = 1;
+    for(n = 0; n < 8; ++n)
     {
-        /* Do not close the model yet; only flush results. */
-        model->triples_index->sync(model->triples_index, 0);
+        bytes[*(unsigned char *)&one ? 7 - n : n] =
+            (value[1] & 0x80) ? value[1 + n] : value[1 + n] ^ 0xFF;
     }
-    else
-    {
-        int result;
+    bytes[*(unsigned char *)&one ? 7 : 0] ^= (value[1] & 0x80);
+    memcpy(&real, bytes, sizeof(real));
 
-        /* Close model database. */    
-        result = model->triples_index->close(model->triples_index);
-        assert(result == 0);
-    
-        /* Finalize synchronization primitives. */
-        MUTEX_DESTROY(model->triples_index_mutex);
-        
-        /* Remove file, if the model is empty. */
-        if( model->filename != NULL &&
-            model->triples_index->seq( model->triples_index,
-                                       NULL, NULL, R_FIRST ) == 1 )
-        {
-            unlink(model->filename);
-        }
+    return real;
+}
 
-        if(model->name != NULL)
-        {
-            /* Unregister in table of open models. */
-            ht_erase(&open_models, model->name, strlen(model->name));
-        }
 
-        /* Free memory. */
+/*  Builds a key for a model's value index. */
+static void make_value_key( unsigned char *key, nid_t predicate,
+                            const unsigned char *value, unsigned index )
+{
+    unsigned char *p;
+
+    memcpy(key, &predicate, sizeof(nid_t));
+    memcpy(key + sizeof(nid_t), value, TYPED_VALUE_SIZE);
+    p = key + sizeof(nid_t) + TYPED_VALUE_SIZE;
+    p[0] = (unsigned char)(index >> 24);
+    p[1] = (unsigned char)(index >> 16);
+    p[2] = (unsigned char)(index >> 8);
+    p[3] = (unsigned char)index;
+}
+
+
+/*  Suffixes of the filenames of a model's triple index, with fixed-size or
+    compact keys. */
+#define TRIPLES_INDEX_SUFFIX "_triples_index.db"
+#define COMPACT_INDEX_SUFFIX "_compact_index.db"
+
+/*  Constructs the filename of a named model's database with the given
+    suffix. The returned string must be freed by the caller. */
+static char *model_filename(const char *name, const char *suffix)
+{
+    char *filename;
+
+    filename = (char*)malloc( strlen("model_") + urlencoded_length(name) +
+                              strlen(suffix) + 1 );
+    assert(filename);
+    strcpy(filename, "model_");
+    urlencode(filename + strlen("model_"), name);
+    strcat(filename, suffix);
+
+    return filename;
+}
+
+
+/*  Size of the keys in the trigram index, excluding the node identifier. */
+#define TRIGRAM_SIZE 3
+
+
+/*  Converts an ASCII letter to lower case. */
+static unsigned char fold_case(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+
+/*  Determines if 'data' contains 'substring' (which must be in lower case),
+    ignoring the case of ASCII letters in 'data'. */
+static int contains_folded( const unsigned char *data, size_t size,
+                            const unsigned char *substring, size_t length )
+{
+    size_t start, n;
+
+    for(start = 0; start + length <= size; ++start)
+    {
+        for(n = 0; n < length; ++n)
+        {
+            if(fold_case(data[start + n]) != substring[n])
+                break;
+        }
+        if(n == length)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*  Adds node data to the search index, unless it is there already. Since the
+    prefix index entry is looked up first, this may be called repeatedly for
+    the same node at the cost of a single lookup. */
+static void index_node_search(nid_t nid, const void *data, size_t size)
+{
+    unsigned char local_buffer[64], *key_data;
+    size_t n, m;
+    DBT key, value;
+    int result;
+
+    key_data = size + sizeof(nid_t) <= sizeof(local_buffer) ?
+               local_buffer : (unsigned char*)malloc(size + sizeof(nid_t));
+    assert(key_data);
+    memcpy(key_data, data, size);
+    memcpy(key_data + size, &nid, sizeof(nid_t));
+    key.data = key_data;
+    key.size = size + sizeof(nid_t);
+
+    MUTEX_LOCK(search_index_mutex);
+
+    /* Look up (data, nid) in the prefix index; the trigram entries of a node
+       are added along with it, under the same lock. */
+    result = nodes_prefix_index->get(nodes_prefix_index, &key, &value, 0);
+    assert(result == 0 || result == 1);
+    if(result == 0)
+    {
+        MUTEX_UNLOCK(search_index_mutex);
+        if(key_data != local_buffer)
+            free(key_data);
+        return;
+    }
+
+    /* Add (data, nid) to the prefix index. */
+    value.data = NULL;
+    value.size = 0;
+    result = nodes_prefix_index->put(nodes_prefix_index, &key, &value, 0);
+    assert(result == 0);
+
+    /* Add (trigram, nid) to the trigram index for each case-folded trigram. */
+    for(n = 0; n + TRIGRAM_SIZE <= size; ++n)
+    {
+        for(m = 0; m < TRIGRAM_SIZE; ++m)
+            key_data[m] = fold_case(((const unsigned char*)data)[n + m]);
+        memcpy(key_data + TRIGRAM_SIZE, &nid, sizeof(nid_t));
+        key.size = TRIGRAM_SIZE + sizeof(nid_t);
+        result = nodes_trigram_index->put(
+            nodes_trigram_index, &key, &value, R_NOOVERWRITE );
+        assert(result == 0 || result == 1);
+    }
+
+    MUTEX_UNLOCK(search_index_mutex);
+    
+    if(key_data != local_buffer)
+        free(key_data);
+}
+
+
+/*  Shortest namespace that is replaced with a prefix number. */
+#define MIN_PREFIX_SIZE 8
+
+/*  Largest prefix number, which is stored in at most two bytes. */
+#define MAX_PREFIXES 0x7FFF
+
+
+/*  Returns the size of the namespace of node data: everything up to and
+    including its last '/' or '#', or 0 if that is shorter than
+    MIN_PREFIX_SIZE bytes. Only node data that starts with an IRI scheme
+    (lowercase letters followed by ':') has a namespace, so that literals
+    containing slashes, such as dates and paths, do not fill the prefix
+    table. */
+static size_t namespace_size(const void *data, size_t size)
+{
+    const unsigned char *bytes;
+    size_t n;
+
+    bytes = (const unsigned char *)data;
+    for(n = 0; n < size && bytes[n] >= 'a' && bytes[n] <= 'z'; ++n);
+    if(n == 0 || n == size || bytes[n] != ':')
+        return 0;
+
+    for(n = size; n > MIN_PREFIX_SIZE; --n)
+    {
+        if(bytes[n - 1] == '/' || bytes[n - 1] == '#')
+            return n;
+    }
+
+    return 0;
+}
+
+
+/*  Returns the number of a namespace in the prefix table, or 0 if it is not
+    in it. The caller must hold nodes_index_mutex or nodes_mutex. */
+static unsigned find_prefix(const void *data, size_t size)
+{
+    const unsigned *prefix;
+
+    prefix = (const unsigned *)ht_get(&prefix_ids, data, size, NULL);
+    return prefix != NULL ? *prefix : 0;
+}
+
+
+/*  Adds a namespace to the prefix table in memory and, if 'store' is set,
+    to the prefix database. Returns its number. The caller must hold
+    nodes_index_mutex and nodes_mutex. */
+static unsigned add_prefix(const void *data, size_t size, int store)
+{
+    prefix_t *prefix;
+    DBT key, value;
+    recno_t recno;
+    int result;
+
+    assert(prefix_count < MAX_PREFIXES);
+    if(prefix_count == prefix_capacity)
+    {
+        prefix_capacity = prefix_capacity > 0 ? 2*prefix_capacity : 64;
+        prefix_table = (prefix_t*)realloc( prefix_table,
+                                           prefix_capacity*sizeof(prefix_t) );
+        assert(prefix_table);
+    }
+    prefix = &prefix_table[prefix_count];
+    prefix->data = (char*)malloc(size);
+    assert(prefix->data);
+    memcpy(prefix->data, data, size);
+    prefix->size = size;
+    recno = ++prefix_count;
+    ht_put(&prefix_ids, data, size, &recno, sizeof(recno));
+
+    if(store)
+    {
+        key.data = &recno;
+        key.size = sizeof(recno);
+        value.data = (void*)data;
+        value.size = size;
+        result = prefixes->put(prefixes, &key, &value, 0);
+        assert(result == 0);
+    }
+
+    return recno;
+}
+
+
+/*  Encodes node data as it is stored in a node dictionary with a prefix
+    table: the prefix number (0 for none) in one byte, or in two bytes with
+    the high bit set if it exceeds 0x7F, followed by the data after the
+    prefix. 'buffer' must be at least 'size' + 2 bytes large. Returns the
+    size of the encoded data. */
+static size_t encode_prefixed( const void *data, size_t size,
+                               unsigned prefix, unsigned char *buffer )
+{
+    size_t header, skipped;
+
+    assert(prefix <= MAX_PREFIXES);
+    if(prefix < 0x80)
+    {
+        buffer[0] = (unsigned char)prefix;
+        header = 1;
+    }
+    else
+    {
+        buffer[0] = (unsigned char)(0x80 | (prefix >> 8));
+        buffer[1] = (unsigned char)prefix;
+        header = 2;
+    }
+    skipped = prefix > 0 ? prefix_table[prefix - 1].size : 0;
+    assert(skipped <= size);
+    memcpy(buffer + header, (const char*)data + skipped, size - skipped);
+
+    return header + size - skipped;
+}
+
+
+/*  Splits a record of the node dictionary into the prefix and the rest of
+    the node data, which 'record' is updated to refer to. The prefix is
+    empty if the node dictionary has no prefix table. The caller must hold
+    nodes_index_mutex or nodes_mutex. */
+static void decode_prefixed( DBT *record, const void **prefix,
+                             size_t *prefix_size )
+{
+    const unsigned char *bytes;
+    unsigned number;
+    size_t header;
+
+    *prefix = "";
+    *prefix_size = 0;
+    if(prefixes == NULL)
+        return;
+
+    bytes = (const unsigned char *)record->data;
+    assert(record->size >= 1);
+    if(bytes[0] < 0x80)
+    {
+        number = bytes[0];
+        header = 1;
+    }
+    else
+    {
+        assert(record->size >= 2);
+        number = ((bytes[0] & 0x7F) << 8) | bytes[1];
+        header = 2;
+    }
+    if(number > 0)
+    {
+        assert(number <= prefix_count);
+        *prefix = prefix_table[number - 1].data;
+        *prefix_size = prefix_table[number - 1].size;
+    }
+    record->data = (char*)record->data + header;
+    record->size -= header;
+}
+
+
+#ifdef TRIPLEDB_STATS
+/*  A database handle that counts the accesses to another database handle,
+    which it forwards them to. */
+typedef struct counted_db
+{
+    DB db;              /* must be the first member */
+    DB *counted;
+    unsigned database;  /* one of the STATS_DB_ constants */
+} counted_db_t;
+
+
+static int counted_close(DB *db)
+{
+    DB *counted;
+
+    counted = ((counted_db_t*)db)->counted;
+    free(db);
+
+    return counted->close(counted);
+}
+
+
+static int counted_del(const DB *db, const DBT *key, unsigned int flags)
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+    tripledb_stats_t *stats;
+
+    stats = stats_acquire();
+    ++stats->dels[counted->database];
+    stats_release(stats);
+
+    return counted->counted->del(counted->counted, key, flags);
+}
+
+
+static int counted_get( const DB *db, const DBT *key, DBT *data,
+                        unsigned int flags )
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+    tripledb_stats_t *stats;
+
+    stats = stats_acquire();
+    ++stats->gets[counted->database];
+    stats_release(stats);
+
+    return counted->counted->get(counted->counted, key, data, flags);
+}
+
+
+static int counted_put( const DB *db, DBT *key, const DBT *data,
+                        unsigned int flags )
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+    tripledb_stats_t *stats;
+
+    stats = stats_acquire();
+    ++stats->puts[counted->database];
+    stats_release(stats);
+
+    return counted->counted->put(counted->counted, key, data, flags);
+}
+
+
+static int counted_seq( const DB *db, DBT *key, DBT *data,
+                        unsigned int flags )
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+    tripledb_stats_t *stats;
+
+    stats = stats_acquire();
+    ++stats->seqs[counted->database];
+    stats_release(stats);
+
+    return counted->counted->seq(counted->counted, key, data, flags);
+}
+
+
+static int counted_sync(const DB *db, unsigned int flags)
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+
+    return counted->counted->sync(counted->counted, flags);
+}
+
+
+static int counted_fd(const DB *db)
+{
+    const counted_db_t *counted = (const counted_db_t*)db;
+
+    return counted->counted->fd(counted->counted);
+}
+
+
+/*  Returns a handle that counts the accesses to 'db' as accesses to the given
+    STATS_DB_ database. Closing it closes 'db'. */
+static DB *count_accesses(DB *db, unsigned database)
+{
+    counted_db_t *counted;
+
+    counted = (counted_db_t*)malloc(sizeof(counted_db_t));
+    assert(counted);
+    counted->db = *db;
+    counted->db.close = counted_close;
+    counted->db.del = counted_del;
+    counted->db.get = counted_get;
+    counted->db.put = counted_put;
+    counted->db.seq = counted_seq;
+    counted->db.sync = counted_sync;
+    counted->db.fd = counted_fd;
+    counted->counted = db;
+    counted->database = database;
+
+    return &counted->db;
+}
+#endif
+
+
+/*  Opens a database like dbopen(), using a page cache of 'cache_size' bytes,
+    or the default page cache if 'cache_size' is 0. Accesses to the database
+    are counted as accesses to the given STATS_DB_ database. */
+static DB *open_database( const char *filename, int flags, int mode,
+                          DBTYPE type, unsigned long cache_size,
+                          unsigned database )
+{
+    BTREEINFO btree_info;
+    HASHINFO hash_info;
+    RECNOINFO recno_info;
+    void *info;
+    DB *db;
+
+    assert(cache_size <= MAX_CACHE_SIZE);
+
+    info = NULL;
+    if(cache_size > 0)
+    {
+        switch(type)
+        {
+        case DB_BTREE:
+            memset(&btree_info, 0, sizeof(btree_info));
+            btree_info.cachesize = (unsigned)cache_size;
+            info = &btree_info;
+            break;
+
+        case DB_HASH:
+            memset(&hash_info, 0, sizeof(hash_info));
+            hash_info.cachesize = (unsigned)cache_size;
+            info = &hash_info;
+            break;
+
+        case DB_RECNO:
+            memset(&recno_info, 0, sizeof(recno_info));
+            recno_info.cachesize = (unsigned)cache_size;
+            info = &recno_info;
+            break;
+        }
+    }
+
+    db = dbopen(filename, flags, mode, type, info);
+#ifdef TRIPLEDB_STATS
+    if(db != NULL)
+        db = count_accesses(db, database);
+#endif
+
+    return db;
+}
+
+
+/*  Returns the open flags for the store's databases. */
+static int store_flags()
+{
+    return read_only ? O_RDONLY | O_SHLOCK : O_CREAT | O_EXLOCK | O_RDWR;
+}
+
+
+/*  Creates an empty file, unless it exists already. Returns 0 on success,
+    or -1 if the file could not be created. */
+static int create_empty_file(const char *filename)
+{
+    int fd;
+
+    fd = open(filename, O_CREAT | O_WRONLY, 0600);
+    if(fd < 0)
+        return -1;
+    close(fd);
+
+    return 0;
+}
+
+
+/*  Returns the record number of the last record in a RECNO database, or 0 if
+    it is empty. */
+static recno_t last_record(DB *db)
+{
+    DBT key;
+    int result;
+
+    result = db->seq(db, &key, NULL, R_LAST);
+    assert(result == 0 || result == 1);
+    assert(result != 0 || key.size == sizeof(recno_t));
+
+    return result == 0 ? *(recno_t*)key.data : 0;
+}
+
+
+/*  Opens the prefix table and loads it into memory. */
+static void open_prefixes()
+{
+    DBT key, value;
+    int result;
+
+    prefixes = open_database( "prefixes.db", store_flags(), 0700,
+                              DB_RECNO, 0, STATS_DB_NODES );
+    assert(prefixes);
+    ht_create(&prefix_ids, hash_fnv1);
+    prefix_table = NULL;
+    prefix_count = prefix_capacity = 0;
+
+    result = prefixes->seq(prefixes, &key, &value, R_FIRST);
+    while(result == 0)
+    {
+        assert(*(recno_t*)key.data == prefix_count + 1);
+        add_prefix(value.data, value.size, 0);
+        result = prefixes->seq(prefixes, &key, &value, R_NEXT);
+    }
+    assert(result == 1);
+}
+
+
+/*  Closes the prefix table, if in use. */
+static void close_prefixes()
+{
+    unsigned n;
+    int result;
+
+    if(prefixes == NULL)
+        return;
+
+    result = prefixes->close(prefixes);
+    assert(result == 0);
+    for(n = 0; n < prefix_count; ++n)
+        free(prefix_table[n].data);
+    free(prefix_table);
+    ht_destroy(&prefix_ids);
+    prefixes = NULL;
+}
+
+
+/*  Opens the search index databases, using a page cache of 'cache_size' bytes
+    for each. If they are created, all nodes in the node dictionary are added
+    to them. */
+static void open_search_index(unsigned long cache_size)
+{
+    DBT key, value;
+    int result, created;
+    nid_t nid;
+    const void *prefix;
+    size_t prefix_size, inline_size;
+    unsigned char inline_data[NID_INLINE_MAX];
+    triple_t triple;
+    unsigned n;
+    char *data;
+
+    created = access("nodes_prefix_index.db", F_OK) != 0;
+    assert(!created || !read_only);
+
+    nodes_prefix_index = open_database( "nodes_prefix_index.db",
+        store_flags(), 0700, DB_BTREE, cache_size, STATS_DB_SEARCH_INDEX );
+    assert(nodes_prefix_index);
+    nodes_trigram_index = open_database( "nodes_trigram_index.db",
+        store_flags(), 0700, DB_BTREE, cache_size, STATS_DB_SEARCH_INDEX );
+    assert(nodes_trigram_index);
+
+    if(created)
+    {
+        /* Index existing nodes. */
+        nid.flags = 0;
+        result = nodes->seq(nodes, &key, &value, R_FIRST);
+        while(result == 0)
+        {
+            nid.index = *(recno_t*)key.data;
+            decode_prefixed(&value, &prefix, &prefix_size);
+            if(prefix_size == 0 && is_typed_value(value.data, value.size))
+            {
+                /* Encoded typed literal values are not searched. */
+            }
+            else
+            if(prefix_size == 0)
+            {
+                index_node_search(nid, value.data, value.size);
+            }
+            else
+            {
+                data = (char*)malloc(prefix_size + value.size);
+                assert(data);
+                memcpy(data, prefix, prefix_size);
+                memcpy(data + prefix_size, value.data, value.size);
+                index_node_search(nid, data, prefix_size + value.size);
+                free(data);
+            }
+            result = nodes->seq(nodes, &key, &value, R_NEXT);
+        }
+        assert(result == 1);
+
+        /* Index the inline nodes of existing triples, which are not in the
+           node dictionary. */
+        result = triples->seq(triples, &key, &value, R_FIRST);
+        while(result == 0)
+        {
+            assert(value.size == sizeof(triple_t));
+            memcpy(&triple, value.data, sizeof(triple_t));
+            for(n = 0; n < 3; ++n)
+            {
+                if(NID_IS_INLINE(triple.nodes[n]))
+                {
+                    inline_size = unpack_inline_node( triple.nodes[n],
+                                                      inline_data );
+                    index_node_search( triple.nodes[n], inline_data,
+                                       inline_size );
+                }
+            }
+            result = triples->seq(triples, &key, &value, R_NEXT);
+        }
+        assert(result == 1);
+    }
+}
+
+
+void tripledb_initialize()
+{
+    tripledb_initialize_options(NULL);
+}
+
+
+void tripledb_initialize_options(const tripledb_options_t *options)
+{
+    int search_index, prefix_nodes, result;
+    unsigned long cache_size;
+    
+    assert(sizeof(unsigned) == sizeof(recno_t));
+    assert(sizeof(unsigned) == sizeof(size_t));
+    assert(sizeof(nid_t) == 2*sizeof(unsigned));
+    assert(sizeof(triple_t) == 3*sizeof(nid_t));
+    assert(sizeof(triple_entry_t) == sizeof(triple_t) + sizeof(unsigned));
+
+    ht_create(&open_models, hash_fnv1);
+
+    read_only = options != NULL && (options->flags & TRIPLEDB_FREAD_ONLY);
+    compact_index =
+        options != NULL && (options->flags & TRIPLEDB_FCOMPACT_INDEX);
+
+    /* Use the search index if requested or previously created. It can not be
+       created in read-only mode. */
+    search_index =
+        ( options != NULL && (options->flags & TRIPLEDB_FSEARCH_INDEX) &&
+          !read_only ) ||
+        access("nodes_prefix_index.db", F_OK) == 0;
+
+    /* Compress IRI prefixes if a prefix table was previously created, or if
+       requested for a new node dictionary. */
+    prefix_nodes =
+        access("prefixes.db", F_OK) == 0 ||
+        ( options != NULL && (options->flags & TRIPLEDB_FPREFIX_NODES) &&
+          !read_only && access("nodes.db", F_OK) != 0 );
+
+    /* Divide half of the cache budget among the dictionary databases; the
+       rest is assigned to models as they are opened. */
+    cache_budget = (options != NULL ? options->cache_size : 0);
+    cache_size = cache_budget/2/(search_index ? 6 : 4);
+    if(cache_size > MAX_CACHE_SIZE)
+        cache_size = MAX_CACHE_SIZE;
+    cache_dictionaries = cache_size*(search_index ? 6 : 4);
+    cache_available = cache_budget - cache_dictionaries;
+    open_model_count = 0;
+
+    /* A node dictionary without the inline nodes marker was created before
+       inline nodes, and may hold short node data. */
+    short_nodes_stored = access("nodes.db", F_OK) == 0 &&
+                         access(INLINE_NODES_MARKER, F_OK) != 0;
+
+    /* Open nodes database. */
+    nodes = open_database( "nodes.db", store_flags(), 0700,
+                           DB_RECNO, cache_size, STATS_DB_NODES );
+    assert(nodes);
+    nodes_index = open_database( "nodes_index.db", store_flags(), 0700,
+                                 DB_HASH, cache_size, STATS_DB_NODES_INDEX );
+    assert(nodes_index);
+    if(!short_nodes_stored && !read_only)
+    {
+        result = create_empty_file(INLINE_NODES_MARKER);
+        assert(result == 0);
+    }
+    prefixes = NULL;
+    if(prefix_nodes)
+    {
+        open_prefixes();
+    }
+    
+    /* Open triples database. */
+    triples = open_database( "triples.db", store_flags(), 0700,
+                             DB_RECNO, cache_size, STATS_DB_TRIPLES );
+    assert(triples);
+    triples_index = open_database( "triples_index.db", store_flags(), 0700,
+                                   DB_HASH, cache_size,
+                                   STATS_DB_TRIPLES_INDEX );
+    assert(triples_index);
+    
+    /* Look up last node and triple indices, which are only needed to add new
+       records to the dictionaries. */
+    last_node = read_only ? 0 : last_record(nodes);
+    last_triple = read_only ? 0 : last_record(triples);
+    
+    /* Initialize synchronization primitives. */
+    MUTEX_INIT(nodes_mutex);
+    MUTEX_INIT(nodes_index_mutex);
+    MUTEX_INIT(triples_mutex);
+    MUTEX_INIT(triples_index_mutex);
+    MUTEX_INIT(models_mutex);
+    MUTEX_INIT(search_index_mutex);
+
+    /* Open search index, if in use. */
+    nodes_prefix_index = nodes_trigram_index = NULL;
+    if(search_index)
+    {
+        open_search_index(cache_size);
+    }
+}
+
+
+void tripledb_finalize()
+{
+    int result;
+    
+    result = nodes->close(nodes);
+    assert(result == 0);
+    
+    result = nodes_index->close(nodes_index);
+    assert(result == 0);
+
+    close_prefixes();
+
+    result = triples->close(triples);
+    assert(result == 0);
+    
+    result = triples_index->close(triples_index);
+    assert(result == 0);
+
+    if(nodes_prefix_index != NULL)
+    {
+        result = nodes_prefix_index->close(nodes_prefix_index);
+        assert(result == 0);
+
+        result = nodes_trigram_index->close(nodes_trigram_index);
+        assert(result == 0);
+    }
+    
+    ht_destroy(&open_models);
+
+    /* Finalize synchronization primitives. */
+    MUTEX_DESTROY(nodes_mutex);
+    MUTEX_DESTROY(nodes_index_mutex);
+    MUTEX_DESTROY(triples_mutex);
+    MUTEX_DESTROY(triples_index_mutex);
+    MUTEX_DESTROY(models_mutex);
+    MUTEX_DESTROY(search_index_mutex);
+}
+
+
+/*  Returns the node dictionary index for the given node data, adding the
+    data to the dictionary if it was not present yet and 'create' is set, or
+    returning 0 otherwise. If 'created' is not NULL, '*created' is set to
+    indicate whether the data was added. Unless 'use_prefix' is set, the data
+    is never stored with a prefix number. */
+static unsigned identify_stored_node( const void *data, size_t size,
+                                      int use_prefix, int create,
+                                      int *created )
+{
+    DBT node_id, node_data;
+    int result;
+    unsigned index, prefix;
+    unsigned char local_buffer[256], *buffer;
+    size_t prefix_size;
+
+    buffer = NULL;
+    prefix = 0;
+    prefix_size = 0;
+    if(prefixes != NULL)
+    {
+        buffer = size + 2 <= sizeof(local_buffer) ?
+                 local_buffer : (unsigned char*)malloc(size + 2);
+        assert(buffer);
+        if(use_prefix)
+            prefix_size = namespace_size(data, size);
+    }
+
+    MUTEX_LOCK(nodes_index_mutex);
+    if(prefixes != NULL)
+    {
+        if(prefix_size > 0)
+            prefix = find_prefix(data, prefix_size);
+        node_data.data = buffer;
+        node_data.size = encode_prefixed(data, size, prefix, buffer);
+    }
+    else
+    {
+        node_data.data = (void*)data;
+        node_data.size = size;
+    }
+    result = nodes_index->get(nodes_index, &node_data, &node_id, 0);
+    assert(result == 0 || result == 1);
+    
+    if(result == 0)
+    {
+        /* Existing node found. */
+        assert(node_id.size == sizeof(size_t));
+        index = *(unsigned*)node_id.data;
+        if(created != NULL)
+            *created = 0;
+    }
+    else
+    if(read_only || !create)
+    {
+        /* Node does not exist and can not be created. */
+        index = 0;
+        if(created != NULL)
+            *created = 0;
+    }
+    else
+    {
+        /* Create a new node. */
+        
+        MUTEX_LOCK(nodes_mutex);
+
+        /* Learn the namespace of the node, if it is new. */
+        if(prefix == 0 && prefix_size > 0 && prefix_count < MAX_PREFIXES)
+        {
+            prefix = add_prefix(data, prefix_size, 1);
+            node_data.size = encode_prefixed(data, size, prefix, buffer);
+        }
+        
+        index = ++last_node;
+        
+        node_id.data = &index;
+        node_id.size = sizeof(index);
+                
+        result = nodes->put(nodes, &node_id, &node_data, 0);
+        assert(result == 0);
+
+        result = nodes_index->put(nodes_index, &node_data, &node_id, 0);
+        assert(result == 0);
+
+        MUTEX_UNLOCK(nodes_mutex);
+        if(created != NULL)
+            *created = 1;
+    }
+    MUTEX_UNLOCK(nodes_index_mutex);
+
+    if(buffer != local_buffer)
+        free(buffer);
+    
+    return index;
+}
+
+
+nid_t identify_node(const void *data, size_t size)
+{
+    nid_t nid;
+    int created;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    nid.flags = 0;
+    created = 0;
+    if(size > NID_INLINE_MAX)
+    {
+        nid.index = identify_stored_node(data, size, 1, 1, &created);
+    }
+    else
+    {
+        /* A store created before inline nodes keeps the dictionary
+           identifiers of the short node data it already holds. Otherwise,
+           short node data is stored in the identifier itself; it is added
+           to the search index along with the first triple that uses it. */
+        nid.index = short_nodes_stored ?
+                    identify_stored_node(data, size, 1, 0, NULL) : 0;
+        if(nid.index == 0)
+            nid = pack_inline_node(data, size);
+    }
+
+    if(created && nodes_prefix_index != NULL)
+        index_node_search(nid, data, size);
+    
+    STATS_OPERATION(STATS_OP_IDENTIFY_NODE, timer);
+    return nid;
+}
+
+
+nid_t identify_triple(triple_t *triple)
+{
+    nid_t nid;
+    DBT key, value;
+    int result, created;
+    unsigned char inline_data[NID_INLINE_MAX];
+    size_t size;
+    unsigned n;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    nid.flags = NID_FTRIPLE;
+    created = 0;
+
+    key.data = triple;
+    key.size = sizeof(*triple);
+    MUTEX_LOCK(triples_index_mutex);
+    result = triples_index->get(triples_index, &key, &value, 0);
+    assert(result == 0 || result == 1);
+
+    if(result == 0)
+    {
+        assert(key.size == sizeof(triple_t));
+        assert(value.size == sizeof(unsigned));
+        
+        /* Existing triple identifier found. */
+        nid.index = *(unsigned *)value.data;
+    }
+    else
+    if(read_only)
+    {
+        /* Triple does not exist and can not be created. */
+        NID_SET_NULL(nid);
+    }
+    else
+    {
+        /* Create a new triple identifier. */
+
+        MUTEX_LOCK(triples_mutex);
+        nid.index = ++last_triple;
+
+        value.data = &nid.index;
+        value.size = sizeof(nid.index);
+
+        /* Add the triple to the triple database. */
+        result = triples->put(triples, &value, &key, 0);
+        assert(result == 0);
+        
+        /* Add the triple to the triple database index. */
+        result = triples_index->put(triples_index, &key, &value, 0);
+        assert(result == 0);
+
+        MUTEX_UNLOCK(triples_mutex);
+        created = 1;
+    }
+    MUTEX_UNLOCK(triples_index_mutex);
+
+    /* Inline nodes are not in the node dictionary; they are added to the
+       search index along with the first triple that uses them. */
+    if(created && nodes_prefix_index != NULL)
+    {
+        for(n = 0; n < 3; ++n)
+        {
+            if(NID_IS_INLINE(triple->nodes[n]))
+            {
+                size = unpack_inline_node(triple->nodes[n], inline_data);
+                index_node_search(triple->nodes[n], inline_data, size);
+            }
+        }
+    }
+  
+    STATS_OPERATION(STATS_OP_IDENTIFY_TRIPLE, timer);
+    return nid;
+}
+
+
+const void *resolve_node(nid_t nid, void *data, size_t *size)
+{
+    DBT node_id, node_data;
+    unsigned char inline_data[NID_INLINE_MAX];
+    const void *result_data, *prefix;
+    size_t prefix_size;
+    int result;
+    stats_timer_t timer;
+        
+    STATS_START(timer);
+    assert(!NID_IS_TRIPLE(nid));
+    if(NID_IS_INLINE(nid))
+    {
+        /* Node data is stored in the identifier; no lookup required. */
+        node_data.data = inline_data;
+        node_data.size = unpack_inline_node(nid, inline_data);
+        prefix = "";
+        prefix_size = 0;
+    }
+    else
+    {
+        node_id.data = &nid.index;
+        node_id.size = sizeof(nid.index);
+        MUTEX_LOCK(nodes_mutex);
+        result = nodes->get(nodes, &node_id, &node_data, 0);
+        assert(result == 0);
+        decode_prefixed(&node_data, &prefix, &prefix_size);
+    }
+    
+    if(data == NULL)
+    {
+        /* Fill new buffer with node data. */
+        char *buffer;
+         
+        buffer = (char*)malloc(prefix_size + node_data.size);
+        assert(buffer != NULL || prefix_size + node_data.size == 0);
+        memcpy(buffer, prefix, prefix_size);
+        memcpy(buffer + prefix_size, node_data.data, node_data.size);
+        *size = prefix_size + node_data.size;
+        result_data = buffer;
+    }
+    else
+    {
+        if(prefix_size + node_data.size <= *size)
+        {
+            /* Fill external buffer with node data. */
+            memcpy(data, prefix, prefix_size);
+            memcpy((char*)data + prefix_size, node_data.data, node_data.size);
+            *size = prefix_size + node_data.size;
+            result_data = data;
+        }
+        else
+        {
+            /* External buffer too small; only set data size. */
+            *size = prefix_size + node_data.size;
+            result_data = NULL;
+        }
+    }
+
+    if(!NID_IS_INLINE(nid))
+        MUTEX_UNLOCK(nodes_mutex);
+
+    STATS_OPERATION(STATS_OP_RESOLVE_NODE, timer);
+    return result_data;
+}
+
+
+/*  Returns the typed literal node identifier for an encoded value. */
+static nid_t identify_typed(const unsigned char *value)
+{
+    nid_t nid;
+
+    nid.index = identify_stored_node(value, TYPED_VALUE_SIZE, 0, 1, NULL);
+    nid.flags = NID_FTYPED | ((unsigned)value[0] << 6);
+    if(nid.index == 0)
+        NID_SET_NULL(nid);
+
+    return nid;
+}
+
+
+/*  Retrieves the encoded value of a typed literal node. */
+static void resolve_typed(nid_t nid, unsigned char *value)
+{
+    size_t size;
+    const void *result;
+
+    assert(NID_TYPE(nid) != 0);
+    size = TYPED_VALUE_SIZE;
+    result = resolve_node(nid, value, &size);
+    assert(result == value && size == TYPED_VALUE_SIZE);
+    assert(value[0] == NID_TYPE(nid));
+}
+
+
+nid_t identify_integer(long value)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    encode_integer(encoded, NID_TYPE_INTEGER, value);
+    return identify_typed(encoded);
+}
+
+
+nid_t identify_double(double value)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    encode_double(encoded, value);
+    return identify_typed(encoded);
+}
+
+
+nid_t identify_datetime(time_t value)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    encode_integer(encoded, NID_TYPE_DATETIME, (long)value);
+    return identify_typed(encoded);
+}
+
+
+long resolve_integer(nid_t nid)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    assert(NID_TYPE(nid) == NID_TYPE_INTEGER);
+    resolve_typed(nid, encoded);
+    return decode_integer(encoded);
+}
+
+
+double resolve_double(nid_t nid)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    assert(NID_TYPE(nid) == NID_TYPE_DOUBLE);
+    resolve_typed(nid, encoded);
+    return decode_double(encoded);
+}
+
+
+time_t resolve_datetime(nid_t nid)
+{
+    unsigned char encoded[TYPED_VALUE_SIZE];
+
+    assert(NID_TYPE(nid) == NID_TYPE_DATETIME);
+    resolve_typed(nid, encoded);
+    return (time_t)decode_integer(encoded);
+}
+
+
+triple_t resolve_triple(nid_t nid)
+{
+    triple_t triple;
+    int result;
+    DBT key, value;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    assert(NID_IS_TRIPLE(nid));
+    key.data = &nid.index;
+    key.size = sizeof(nid.index);
+    MUTEX_LOCK(triples_mutex);
+    result = triples->get(triples, &key, &value, 0);
+    assert(result == 0);
+    assert(value.size == sizeof(triple_t));
+    triple = *(triple_t *)value.data;
+    MUTEX_UNLOCK(triples_mutex);
+    
+    STATS_OPERATION(STATS_OP_RESOLVE_TRIPLE, timer);
+    return triple;
+}
+
+
+int is_valid_nid(nid_t nid)
+{
+    unsigned char value[TYPED_VALUE_SIZE];
+    DBT key, data;
+    size_t size;
+    int result;
+
+    if(NID_IS_INLINE(nid))
+    {
+        /* Bits 0 and 5 through 7 are unused by inline node identifiers. */
+        return (nid.flags & 0xe1) == 0 &&
+               ((nid.flags >> 2) & 7) <= NID_INLINE_MAX;
+    }
+    if(nid.index == 0)
+        return 0;
+
+    key.data = &nid.index;
+    key.size = sizeof(nid.index);
+    if(NID_IS_TRIPLE(nid))
+    {
+        if(nid.flags != NID_FTRIPLE)
+            return 0;
+        MUTEX_LOCK(triples_mutex);
+        result = triples->get(triples, &key, &data, 0);
+        MUTEX_UNLOCK(triples_mutex);
+        return result == 0;
+    }
+
+    if( nid.flags != 0 &&
+        ((nid.flags & ~(unsigned)0xc0) != NID_FTYPED || NID_TYPE(nid) == 0) )
+    {
+        /* Only typed literal nodes have flags. */
+        return 0;
+    }
+    MUTEX_LOCK(nodes_mutex);
+    result = nodes->get(nodes, &key, &data, 0);
+    MUTEX_UNLOCK(nodes_mutex);
+    if(result != 0)
+        return 0;
+    if(NID_TYPE(nid) != 0)
+    {
+        /* The node must hold an encoded value of the same type. */
+        size = sizeof(value);
+        if( resolve_node(nid, value, &size) != value ||
+            size != TYPED_VALUE_SIZE || value[0] != NID_TYPE(nid) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+void free_data(const void *data)
+{
+    free((void*)data);
+}
+
+
+/*  Positions the cursor of a search index database on the first key after
+    the key of node 'previous' (consisting of a 'size'-byte key prefix
+    followed by the node identifier) or on the first key not less than
+    'prefix' if 'previous' is the null node. The caller must hold the
+    search_index_mutex. */
+static int seek_search_index( DB *db, const void *prefix, size_t size,
+                              nid_t previous, DBT *key )
+{
+    unsigned char *key_data;
+    DBT value;
+    int result;
+
+    key_data = (unsigned char*)malloc(size + sizeof(nid_t));
+    assert(key_data);
+    memcpy(key_data, prefix, size);
+    memcpy(key_data + size, &previous, sizeof(nid_t));
+    key->data = key_data;
+    key->size = NID_IS_NULL(previous) ? size : size + sizeof(nid_t);
+
+    result = db->seq(db, key, &value, R_CURSOR);
+    assert(result == 0 || result == 1);
+    if( result == 0 && !NID_IS_NULL(previous) &&
+        key->size == size + sizeof(nid_t) &&
+        memcmp(key->data, key_data, key->size) == 0 )
+    {
+        /* Skip the previous node itself. */
+        result = db->seq(db, key, &value, R_NEXT);
+        assert(result == 0 || result == 1);
+    }
+    free(key_data);
+
+    return result;
+}
+
+
+nid_t find_node_prefix(const void *prefix, size_t size, nid_t previous)
+{
+    const void *previous_data;
+    size_t previous_size;
+    DBT key, value;
+    int result;
+    nid_t nid;
+
+    assert(nodes_prefix_index != NULL);
+    
+    /* Resolve the previous node before acquiring the search index lock. */
+    previous_data = prefix;
+    previous_size = size;
+    if(!NID_IS_NULL(previous))
+        previous_data = resolve_node(previous, NULL, &previous_size);
+
+    NID_SET_NULL(nid);
+    MUTEX_LOCK(search_index_mutex);
+    result = seek_search_index( nodes_prefix_index, previous_data,
+                                previous_size, previous, &key );
+    while( result == 0 && key.size >= size &&
+           memcmp(key.data, prefix, size) == 0 )
+    {
+        if(key.size >= size + sizeof(nid_t))
+        {
+            /* Next node found. */
+            memcpy( &nid, (char*)key.data + key.size - sizeof(nid_t),
+                    sizeof(nid_t) );
+            break;
+        }
+
+        /* The node data is shorter than the prefix. */
+        result = nodes_prefix_index->seq(
+            nodes_prefix_index, &key, &value, R_NEXT );
+        assert(result == 0 || result == 1);
+    }
+    MUTEX_UNLOCK(search_index_mutex);
+
+    if(previous_data != prefix)
+        free_data(previous_data);
+
+    return nid;
+}
+
+
+nid_t find_node_substring(const void *substring, size_t size, nid_t previous)
+{
+    unsigned char *folded;
+    const void *data;
+    size_t n, data_size;
+    DBT key, value;
+    int result, found;
+    nid_t nid;
+
+    assert(nodes_prefix_index != NULL);
+
+    folded = (unsigned char*)malloc(size + 1);
+    assert(folded);
+    for(n = 0; n < size; ++n)
+        folded[n] = fold_case(((const unsigned char*)substring)[n]);
+
+    if(size < TRIGRAM_SIZE)
+    {
+        /* Too short to use the trigram index; scan the prefix index. */
+        data = "";
+        data_size = 0;
+        if(!NID_IS_NULL(previous))
+            data = resolve_node(previous, NULL, &data_size);
+
+        NID_SET_NULL(nid);
+        MUTEX_LOCK(search_index_mutex);
+        result = seek_search_index( nodes_prefix_index, data, data_size,
+                                    previous, &key );
+        while(result == 0)
+        {
+            assert(key.size >= sizeof(nid_t));
+            if(contains_folded( key.data, key.size - sizeof(nid_t),
+                                folded, size ))
+            {
+                memcpy( &nid, (char*)key.data + key.size - sizeof(nid_t),
+                        sizeof(nid_t) );
+                break;
+            }
+            result = nodes_prefix_index->seq(
+                nodes_prefix_index, &key, &value, R_NEXT );
+            assert(result == 0 || result == 1);
+        }
+        MUTEX_UNLOCK(search_index_mutex);
+
+        if(!NID_IS_NULL(previous))
+            free_data(data);
+        free(folded);
+
+        return nid;
+    }
+
+    /* Find candidates with the first trigram of the substring, then verify
+       them. The search index lock is released while verifying, since
+       resolving nodes requires other locks. */
+    nid = previous;
+    do {
+        MUTEX_LOCK(search_index_mutex);
+        result = seek_search_index( nodes_trigram_index, folded, TRIGRAM_SIZE,
+                                    nid, &key );
+        if( result == 0 && key.size == TRIGRAM_SIZE + sizeof(nid_t) &&
+            memcmp(key.data, folded, TRIGRAM_SIZE) == 0 )
+        {
+            memcpy(&nid, (char*)key.data + TRIGRAM_SIZE, sizeof(nid_t));
+        }
+        else
+        {
+            NID_SET_NULL(nid);
+        }
+        MUTEX_UNLOCK(search_index_mutex);
+
+        found = 1;
+        if(!NID_IS_NULL(nid))
+        {
+            data = resolve_node(nid, NULL, &data_size);
+            found = contains_folded(data, data_size, folded, size);
+            free_data(data);
+        }
+    } while(!found);
+    free(folded);
+
+    return nid;
+}
+
+
+/*  Opens one of the databases of a model. In read-only mode, a database that
+    does not exist is opened as an empty in-memory database instead. */
+static DB *open_model_database( const char *filename, DBTYPE type,
+                                unsigned long cache_size, unsigned database )
+{
+    if(filename != NULL && read_only && access(filename, F_OK) != 0)
+        filename = NULL;
+
+    return open_database( filename, filename != NULL ?
+                          store_flags() : O_CREAT | O_RDWR, 0600,
+                          type, cache_size, database );
+}
+
+
+/*  Takes page cache memory for the history databases of a model from the
+    pool: an eighth of the model's share for each, or less if the pool has
+    less left (or none, if that is too little to be of use). The memory is added to the model's share, which is returned
+    to the pool when the model is closed. Returns the page cache size of
+    each database. The caller must hold the models_mutex. */
+static unsigned long take_history_cache(model_t *model)
+{
+    unsigned long cache_size;
+
+    cache_size = model->cache_size/8;
+    if(2*cache_size > cache_available)
+        cache_size = cache_available/2;
+    if(cache_size < MIN_MODEL_CACHE_SIZE/8)
+        cache_size = 0;
+    cache_available -= 2*cache_size;
+    model->cache_size += 2*cache_size;
+
+    return cache_size;
+}
+
+
+/*  Opens the history databases of a model, using a page cache of
+    'cache_size' bytes for each. */
+static void open_history(model_t *model, unsigned long cache_size)
+{
+    model->history_index = open_model_database( model->history_filename,
+        DB_BTREE, cache_size, STATS_DB_MODEL_HISTORY );
+    assert(model->history_index);
+    model->versions = open_model_database( model->versions_filename,
+        DB_BTREE, cache_size, STATS_DB_MODEL_HISTORY );
+    assert(model->versions);
+}
+
+
+model_handle open_model(const char *name)
+{
+    model_t *model;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    MUTEX_LOCK(models_mutex);
+
+    model = NULL;
+    if( name != NULL)
+    {
+        void *p;
+        
+        p = ht_get( &open_models, name, strlen(name), NULL );
+        if(p != NULL)
+        {
+            /* Open model found. */
+
+            model = *(model_t**)p;
+            ++(model->references);
+        }
+    }
+
+    if(model == NULL)
+    {
+        /* Create a newly opened model. */
+        model = (model_t*)malloc(sizeof(model_t));
+        assert(model);
+        model->references = 1;
+        
+        /* Construct filename for this model. */
+        if(name == NULL)
+        {
+            model->name = NULL;
+            model->filename = NULL;
+            model->values_filename = NULL;
+            model->changes_filename = NULL;
+            model->filter_filename = NULL;
+            model->history_filename = NULL;
+            model->versions_filename = NULL;
+            model->compact = compact_index;
+        }
+        else
+        {
+            /* Use compact keys if the model was created with them, or if
+               a new model is created with TRIPLEDB_FCOMPACT_INDEX. */
+            model->name = strdup(name);
+            model->filename = model_filename(name, COMPACT_INDEX_SUFFIX);
+            model->compact = access(model->filename, F_OK) == 0;
+            if(!model->compact)
+            {
+                free(model->filename);
+                model->filename = model_filename(name, TRIPLES_INDEX_SUFFIX);
+                if(compact_index && access(model->filename, F_OK) != 0)
+                {
+                    free(model->filename);
+                    model->filename =
+                        model_filename(name, COMPACT_INDEX_SUFFIX);
+                    model->compact = 1;
+                }
+            }
+            model->values_filename = model_filename(name, "_values_index.db");
+            model->changes_filename = model_filename(name, "_changes.db");
+            model->filter_filename = model_filename(name, "_filter.bin");
+            model->history_filename =
+                model_filename(name, "_history_index.db");
+            model->versions_filename = model_filename(name, "_versions.db");
+        }
+    
+        /* Take half of the available page cache memory; three quarters of
+           it go to the triple index, which is used by every query. The
+           cache of a database is sized when it is opened, so the models
+           already open keep their share. */
+        model->cache_size = cache_available/2;
+        if(model->cache_size > MAX_CACHE_SIZE)
+            model->cache_size = MAX_CACHE_SIZE;
+        if(model->cache_size < MIN_MODEL_CACHE_SIZE)
+            model->cache_size = 0;
+        cache_available -= model->cache_size;
+        ++open_model_count;
+
+        /* Open model databases. */
+        model->read_only = read_only && name != NULL;
+        model->triples_index = open_model_database(
+            model->filename, DB_BTREE, model->cache_size/4*3,
+            STATS_DB_MODEL_TRIPLES );
+        assert(model->triples_index);
+        model->values_index = open_model_database(
+            model->values_filename, DB_BTREE, model->cache_size/4,
+            STATS_DB_MODEL_VALUES );
+        assert(model->values_index);
+    
+        model->snapshots = NULL;
+        model->undo = NULL;
+        model->undo_first = 1;
+        model->undo_size = model->undo_capacity = 0;
+        model->undo_last = NULL;
+
+        /* Initialize synchronization primitives. */
+        MUTEX_INIT(model->triples_index_mutex);
+
+        /* Open change log, if it was enabled before. */
+        model->changes = NULL;
+        if( model->changes_filename != NULL &&
+            access(model->changes_filename, F_OK) == 0 )
+        {
+            enable_change_log(model);
+        }
+
+        /* Open history, if it was enabled before, along with its change
+           log, which is removed when it is closed empty. */
+        model->history_index = model->versions = NULL;
+        if( model->versions_filename != NULL &&
+            access(model->versions_filename, F_OK) == 0 )
+        {
+            enable_change_log(model);
+            open_history(model, take_history_cache(model));
+        }
+
+        model->tombstones = NULL;
+        model->tombstone_count = 0;
+#ifdef THREADSAFE
+        model->compactor_started = model->compacting = 0;
+#endif
+
+        /* Load the triple filter, if it was enabled before. */
+        model->filter = NULL;
+        if( model->filter_filename != NULL &&
+            access(model->filter_filename, F_OK) == 0 )
+        {
+            enable_triple_filter(model);
+        }
+        
+        if(model->name != NULL)
+        {
+            /* Register in table of open models. */
+            ht_put( &open_models, model->name, strlen(model->name),
+                    &model, sizeof(model) );
+        }
+    }
+
+    MUTEX_UNLOCK(models_mutex);
+    
+    STATS_OPERATION(STATS_OP_OPEN_MODEL, timer);
+    return model;
+}
+
+
+/*  A Bloom filter over the triples in a model. Every triple sets
+    FILTER_HASHES bits; a triple of which any bit is clear is not in the
+    model. Bits can not be cleared when triples are removed, so the filter is
+    rebuilt when many triples have been removed, or when it holds more
+    triples than it was sized for. */
+typedef struct triple_filter
+{
+    unsigned char *bits;
+    unsigned size;      /* number of bits */
+    unsigned capacity;  /* number of triples the filter was sized for */
+    unsigned triples;   /* number of triples added since it was built */
+    unsigned removed;   /* number of triples removed since it was built */
+} triple_filter_t;
+
+/*  Number of bits per triple and bits set by every triple, which give a
+    false positive rate of about 1%. */
+#define FILTER_BITS_PER_TRIPLE 10
+#define FILTER_HASHES 7
+
+/*  Smallest number of triples a filter is sized for. */
+#define FILTER_MIN_CAPACITY 1024
+
+/*  Header of a saved filter, which is followed by the filter bits. A filter
+    whose model is open for writing is saved without bits, and 'clean' set
+    to 0, so that a filter that was not saved after the model was modified
+    (for example after a crash) is rebuilt. */
+typedef struct filter_header
+{
+    unsigned clean;
+    unsigned size, capacity, triples, removed;
+} filter_header_t;
+
+
+/*  Computes the hashes from which the bits a triple sets in a filter are
+    derived: bit n is ('first' + n*'step') modulo the filter size. */
+static void filter_hashes( const triple_t *triple,
+                           unsigned *first, unsigned *step )
+{
+    *first = hash_fnv1a(triple, sizeof(*triple));
+    *step = hash_fnv1(triple, sizeof(*triple)) | 1;
+}
+
+
+/*  Adds a triple to a filter. */
+static void add_filter_triple( triple_filter_t *filter,
+                               const triple_t *triple )
+{
+    unsigned first, step, n, bit;
+
+    filter_hashes(triple, &first, &step);
+    for(n = 0; n < FILTER_HASHES; ++n)
+    {
+        bit = (first + n*step) % filter->size;
+        filter->bits[bit/8] |= 1 << (bit%8);
+    }
+    ++filter->triples;
+}
+
+
+/*  Determines if a triple may have been added to a filter. */
+static int filter_may_contain( const triple_filter_t *filter,
+                               const triple_t *triple )
+{
+    unsigned first, step, n, bit;
+
+    filter_hashes(triple, &first, &step);
+    for(n = 0; n < FILTER_HASHES; ++n)
+    {
+        bit = (first + n*step) % filter->size;
+        if(!(filter->bits[bit/8] & (1 << (bit%8))))
+            return 0;
+    }
+
+    return 1;
+}
+
+
+/*  Saves the filter of a named model; if 'clean' is 0, only a header that
+    marks the filter as outdated is saved. */
+static void save_filter(model_t *model, int clean)
+{
+    filter_header_t header;
+    FILE *file;
+    size_t written;
+
+    header.clean = clean;
+    header.size = model->filter->size;
+    header.capacity = model->filter->capacity;
+    header.triples = model->filter->triples;
+    header.removed = model->filter->removed;
+
+    file = fopen(model->filter_filename, "wb");
+    assert(file);
+    written = fwrite(&header, sizeof(header), 1, file);
+    assert(written == 1);
+    if(clean)
+    {
+        written = fwrite(model->filter->bits, 1, (header.size + 7)/8, file);
+        assert(written == (header.size + 7)/8);
+    }
+    fclose(file);
+}
+
+
+/*  Closes a model database and removes its file, if 'filename' is not NULL
+    and the database is empty. */
+static void close_model_database(DB *db, const char *filename)
+{
+    DBT key, value;
+    int result, empty;
+
+    empty = db->seq(db, &key, &value, R_FIRST) == 1;
+
+    result = db->close(db);
+    assert(result == 0);
+
+    if(filename != NULL && empty && !read_only)
+    {
+        unlink(filename);
+    }
+}
+
+
+void close_model(model_handle model)
+{
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    MUTEX_LOCK(models_mutex);
+    if(--model->references != 0)
+    {
+        /* Do not close the model yet; only flush results. Other handles
+           may be in use, so the model must be locked. */
+        MUTEX_LOCK(model->triples_index_mutex);
+        model->triples_index->sync(model->triples_index, 0);
+        model->values_index->sync(model->values_index, 0);
+        if(model->changes != NULL)
+            model->changes->sync(model->changes, 0);
+        if(model->versions != NULL)
+        {
+            model->history_index->sync(model->history_index, 0);
+            model->versions->sync(model->versions, 0);
+        }
+        MUTEX_UNLOCK(model->triples_index_mutex);
+    }
+    else
+    {
+        /* Fold the tombstones of a model with deferred removal. */
+        if(model->tombstones != NULL)
+        {
+#ifdef THREADSAFE
+            if(model->compactor_started)
+            {
+                int result = pthread_join(model->compactor, NULL);
+                assert(result == 0);
+            }
+#endif
+            compact_model(model);
+            ht_destroy(model->tombstones);
+            free(model->tombstones);
+        }
+
+        /* Close model databases, removing files of an empty model. */    
+        close_model_database(model->triples_index, model->filename);
+        close_model_database(model->values_index, model->values_filename);
+        if(model->changes != NULL)
+            close_model_database(model->changes, model->changes_filename);
+        if(model->versions != NULL)
+        {
+            /* The history databases are kept even if they are empty, as
+               their files enable the history when the model is opened. */
+            close_model_database(model->history_index, NULL);
+            close_model_database(model->versions, NULL);
+        }
+
+        /* Save and free the triple filter. The filter of an empty model is
+           cleared first, so that it is saved as a clean, empty filter
+           instead of one that is still marked as outdated. */
+        if(model->filter != NULL)
+        {
+            if(model->filter_filename != NULL && !model->read_only)
+            {
+                if(model->filter->triples <= model->filter->removed)
+                {
+                    memset( model->filter->bits, 0,
+                            (model->filter->size + 7)/8 );
+                    model->filter->triples = model->filter->removed = 0;
+                }
+                save_filter(model, 1);
+            }
+            free(model->filter->bits);
+            free(model->filter);
+        }
+    
+        /* Snapshots hold references to the model. */
+        assert(model->snapshots == NULL && model->undo == NULL);
+
+        /* Return page cache memory to the pool. */
+        cache_available += model->cache_size;
+        --open_model_count;
+
+        /* Finalize synchronization primitives. */
+        MUTEX_DESTROY(model->triples_index_mutex);
+
+        if(model->name != NULL)
+        {
+            /* Unregister in table of open models. */
+            ht_erase(&open_models, model->name, strlen(model->name));
+        }
+
+        /* Free memory. */
         free(model->name);
         free(model->filename);
+        free(model->values_filename);
+        free(model->changes_filename);
+        free(model->filter_filename);
+        free(model->history_filename);
+        free(model->versions_filename);
         free(model);
     }
-    MUTEX_UNLOCK(models_mutex);
+    MUTEX_UNLOCK(models_mutex);
+    STATS_OPERATION(STATS_OP_CLOSE_MODEL, timer);
+}
+
+
+void get_cache_stats(cache_stats_t *stats)
+{
+    MUTEX_LOCK(models_mutex);
+    stats->budget       = cache_budget;
+    stats->dictionaries = cache_dictionaries;
+    stats->available    = cache_available;
+    stats->models       = cache_budget - cache_dictionaries - cache_available;
+    stats->open_models  = open_model_count;
+    MUTEX_UNLOCK(models_mutex);
+}
+
+
+unsigned long get_model_cache_size(model_handle model)
+{
+    return model->cache_size;
+}
+
+
+void enable_change_log(model_handle model)
+{
+    DBT key, value;
+    int result;
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->changes == NULL)
+    {
+        model->changes = open_model_database(
+            model->changes_filename, DB_RECNO, 0, STATS_DB_MODEL_CHANGES );
+        assert(model->changes);
+
+        /* Look up last sequence number. */
+        result = model->changes->seq(model->changes, &key, &value, R_LAST);
+        assert(result == 0 || result == 1);
+        assert(result != 0 || key.size == sizeof(recno_t));
+        model->last_change = ( result == 0 ? *(recno_t*)key.data : 0 );
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+}
+
+
+int next_change(model_handle model, unsigned sequence, change_t *change)
+{
+    DBT key, value;
+    recno_t recno;
+    int result;
+
+    result = 1;
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->changes != NULL && sequence < model->last_change)
+    {
+        recno = sequence + 1;
+        key.data = &recno;
+        key.size = sizeof(recno);
+        result = model->changes->get(model->changes, &key, &value, 0);
+        assert(result == 0);
+        assert(value.size == sizeof(change_record_t));
+        change->sequence  = recno;
+        change->operation = ((change_record_t*)value.data)->operation;
+        change->nid       = ((change_record_t*)value.data)->nid;
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    return result == 0;
+}
+
+
+/*  Determines if a triple index entry has an all-null pattern. A model's
+    triple index contains exactly one such entry for each triple. */
+static int is_primary_entry(const triple_entry_t *entry)
+{
+    return NID_IS_NULL(entry->triple.nodes[0]) &&
+           NID_IS_NULL(entry->triple.nodes[1]) &&
+           NID_IS_NULL(entry->triple.nodes[2]);
+}
+
+
+/*  Determines if none of the nodes of a triple (pattern) is null. */
+static int is_bound_triple(const triple_t *triple)
+{
+    return !NID_IS_NULL(triple->nodes[0]) &&
+           !NID_IS_NULL(triple->nodes[1]) &&
+           !NID_IS_NULL(triple->nodes[2]);
+}
+
+
+/*  Largest size of a compact triple index key. */
+#define COMPACT_KEY_SIZE (sizeof(triple_entry_t)/4*5)
+
+/*  Encodes a triple index entry as a compact key, and returns its size.
+
+    Every 32-bit word of the entry is read as a big-endian number, so that
+    the numbers compare like the bytes of the entry do. Each number is
+    written as groups of 7 bits, most significant first, stopping after the
+    last group that is not zero. A group takes one byte: the group shifted
+    left by one, with the lowest bit set if more groups follow. Compact keys
+    therefore compare in the same order as the entries they encode, and the
+    matches of a pattern remain a contiguous range of keys. */
+static size_t encode_compact_key(const triple_entry_t *entry,
+                                 unsigned char *key)
+{
+    const unsigned char *word;
+    unsigned char *p;
+    unsigned long number;
+    int shift;
+
+    p = key;
+    for( word = (const unsigned char*)entry;
+         word < (const unsigned char*)(entry + 1); word += 4 )
+    {
+        number = ((unsigned long)word[0] << 24) |
+                 ((unsigned long)word[1] << 16) |
+                 ((unsigned long)word[2] << 8) | (unsigned long)word[3];
+        for(shift = 25; shift > 0; shift -= 7)
+        {
+            *p = (unsigned char)(((number >> shift) & 0x7F) << 1);
+            number &= (1UL << shift) - 1;
+            if(number == 0)
+                break;
+            *p++ |= 1;
+        }
+        if(shift < 0)
+            *p = (unsigned char)(number << 4);
+        ++p;
+    }
+
+    return p - key;
+}
+
+
+/*  Decodes a compact key of 'size' bytes into a triple index entry. */
+static void decode_compact_key( const unsigned char *key, size_t size,
+                                triple_entry_t *entry )
+{
+    const unsigned char *end;
+    unsigned char *word;
+    unsigned long number;
+    int shift;
+
+    end = key + size;
+    for( word = (unsigned char*)entry;
+         word < (unsigned char*)(entry + 1); word += 4 )
+    {
+        number = 0;
+        for(shift = 25; ; shift -= 7)
+        {
+            assert(key < end);
+            if(shift > 0)
+                number |= (unsigned long)(*key >> 1) << shift;
+            else
+                number |= *key >> 4;
+            if(!(*key++ & 1))
+                break;
+        }
+        word[0] = (unsigned char)(number >> 24);
+        word[1] = (unsigned char)(number >> 16);
+        word[2] = (unsigned char)(number >> 8);
+        word[3] = (unsigned char)number;
+    }
+    assert(key == end);
+}
+
+
+/*  Sets 'key' to the key of a triple index entry in a model. 'buffer' holds
+    the key if the model uses compact keys; it must be COMPACT_KEY_SIZE bytes
+    large. */
+static void make_entry_key( const model_t *model, const triple_entry_t *entry,
+                            unsigned char *buffer, DBT *key )
+{
+    if(model->compact)
+    {
+        key->data = buffer;
+        key->size = encode_compact_key(entry, buffer);
+    }
+    else
+    {
+        key->data = (void*)entry;
+        key->size = sizeof(*entry);
+    }
+}
+
+
+/*  Returns the triple index entry with the given key in a model, which is
+    decoded into 'entry' if the model uses compact keys. */
+static const triple_entry_t *read_entry_key( const model_t *model,
+                                             const DBT *key,
+                                             triple_entry_t *entry )
+{
+    if(model->compact)
+    {
+        decode_compact_key((const unsigned char*)key->data, key->size, entry);
+        return entry;
+    }
+    assert(key->size == sizeof(triple_entry_t));
+
+    return (const triple_entry_t*)key->data;
+}
+
+
+/*  (Re)builds the triple filter of a model from its triple index, sized for
+    twice the number of triples in the model. The caller must hold the
+    model's triples_index_mutex. */
+static void build_filter(model_t *model)
+{
+    triple_filter_t *filter;
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    unsigned count, pass;
+    nid_t nid;
+    triple_t triple;
+    DBT key, value;
+    int result;
+
+    filter = model->filter;
+    if(filter == NULL)
+    {
+        filter = (triple_filter_t*)malloc(sizeof(triple_filter_t));
+        assert(filter);
+        filter->bits = NULL;
+        model->filter = filter;
+    }
+
+    /* Count the triples in the first pass, and add them in the second. The
+       primary entries, one for every triple, come first in the index. */
+    for(pass = 0; pass < 2; ++pass)
+    {
+        count = 0;
+        TRIPLE_SET_NULL(entry.triple);
+        entry.index = 0;
+        make_entry_key(model, &entry, key_data, &key);
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_CURSOR );
+        while(result == 0)
+        {
+            found = read_entry_key(model, &key, &found_entry);
+            if(!is_primary_entry(found))
+                break;
+            if(pass == 1)
+            {
+                nid.index = found->index;
+                nid.flags = NID_FTRIPLE;
+                triple = resolve_triple(nid);
+                add_filter_triple(filter, &triple);
+            }
+            ++count;
+            result = model->triples_index->seq( model->triples_index,
+                                                &key, &value, R_NEXT );
+        }
+        assert(result == 0 || result == 1);
+
+        if(pass == 0)
+        {
+            filter->capacity = 2*count;
+            if(filter->capacity < FILTER_MIN_CAPACITY)
+                filter->capacity = FILTER_MIN_CAPACITY;
+            filter->size = filter->capacity*FILTER_BITS_PER_TRIPLE;
+            free(filter->bits);
+            filter->bits = (unsigned char*)calloc((filter->size + 7)/8, 1);
+            assert(filter->bits);
+            filter->triples = filter->removed = 0;
+        }
+    }
+}
+
+
+void enable_triple_filter(model_handle model)
+{
+    filter_header_t header;
+    FILE *file;
+    int loaded;
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->filter == NULL)
+    {
+        /* Load the saved filter of a named model, if it is up to date. */
+        loaded = 0;
+        file = model->filter_filename != NULL ?
+               fopen(model->filter_filename, "rb") : NULL;
+        if(file != NULL)
+        {
+            if( fread(&header, sizeof(header), 1, file) == 1 &&
+                header.clean && header.size > 0 )
+            {
+                model->filter =
+                    (triple_filter_t*)malloc(sizeof(triple_filter_t));
+                assert(model->filter);
+                model->filter->size = header.size;
+                model->filter->capacity = header.capacity;
+                model->filter->triples = header.triples;
+                model->filter->removed = header.removed;
+                model->filter->bits =
+                    (unsigned char*)malloc((header.size + 7)/8);
+                assert(model->filter->bits);
+                loaded = fread( model->filter->bits, 1, (header.size + 7)/8,
+                                file ) == (header.size + 7)/8;
+            }
+            fclose(file);
+        }
+        if(!loaded)
+            build_filter(model);
+
+        /* The saved filter is outdated as soon as the model is modified; it
+           is saved again when the model is closed. */
+        if(model->filter_filename != NULL && !model->read_only)
+            save_filter(model, 0);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+}
+
+
+/*  A period in which a triple was in a model with history: from version
+    'added' up to (but not including) version 'removed', or up to now if
+    'removed' is 0. The versions database maps the index of every triple in
+    the history to its periods, in order; the history index holds the same
+    entries as the triple index for each of these triples. */
+typedef struct version_range
+{
+    unsigned added, removed;
+} version_range_t;
+
+
+/*  Adds or removes the index entries of a triple in a history index. */
+static void update_history_index( const model_t *model, DB *history_index,
+                                  unsigned index, int add )
+{
+    triple_t triple;
+    triple_entry_t entry;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    nid_t nid;
+    DBT key, value;
+    int permutation, n, result;
+
+    nid.index = index;
+    nid.flags = NID_FTRIPLE;
+    triple = resolve_triple(nid);
+    entry.index = index;
+    value.data = NULL;
+    value.size = 0;
+    for(permutation = 0; permutation < 8; ++permutation)
+    {
+        for(n = 0; n < 3; ++n)
+        {
+            if(permutation & (1 << n))
+                entry.triple.nodes[n] = triple.nodes[n];
+            else
+                NID_SET_NULL(entry.triple.nodes[n]);
+        }
+        make_entry_key(model, &entry, key_data, &key);
+        if(add)
+            result = history_index->put(
+                history_index, &key, &value, R_NOOVERWRITE );
+        else
+            result = history_index->del(history_index, &key, 0);
+        assert(result == 0 || result == 1);
+    }
+}
+
+
+/*  Records in the history of a model that a triple was added or removed at
+    the given version. The caller must hold the model's
+    triples_index_mutex. */
+static void record_version( model_t *model, unsigned operation,
+                            unsigned index, unsigned version )
+{
+    version_range_t *ranges;
+    unsigned count;
+    DBT key, value;
+    int result;
+
+    key.data = &index;
+    key.size = sizeof(index);
+    result = model->versions->get(model->versions, &key, &value, 0);
+    assert(result == 0 || result == 1);
+    count = result == 0 ? value.size/sizeof(version_range_t) : 0;
+    ranges = (version_range_t*)malloc((count + 1)*sizeof(version_range_t));
+    assert(ranges);
+    if(count > 0)
+        memcpy(ranges, value.data, count*sizeof(version_range_t));
+
+    if(operation == CHANGE_ADD)
+    {
+        assert(count == 0 || ranges[count - 1].removed != 0);
+        ranges[count].added = version;
+        ranges[count].removed = 0;
+        if(count++ == 0)
+            update_history_index(model, model->history_index, index, 1);
+    }
+    else
+    {
+        assert(count > 0 && ranges[count - 1].removed == 0);
+        ranges[count - 1].removed = version;
+    }
+
+    value.data = ranges;
+    value.size = count*sizeof(version_range_t);
+    result = model->versions->put(model->versions, &key, &value, 0);
+    assert(result == 0);
+    free(ranges);
+}
+
+
+/*  Appends a change to the undo log of a model, if snapshots of it are
+    open. The caller must hold the model's triples_index_mutex. */
+static void record_undo(model_t *model, unsigned operation, unsigned index)
+{
+    undo_record_t *record;
+    unsigned sequence, *last;
+    nid_t nid;
+
+    if(model->snapshots == NULL)
+        return;
+
+    if(model->undo_size == model->undo_capacity)
+    {
+        model->undo_capacity = 2*model->undo_capacity + 64;
+        model->undo = (undo_record_t*)realloc( model->undo,
+            model->undo_capacity*sizeof(undo_record_t) );
+        assert(model->undo);
+    }
+    sequence = model->undo_first + model->undo_size;
+    record = &model->undo[model->undo_size++];
+    nid.index = index;
+    nid.flags = NID_FTRIPLE;
+    record->entry.triple = resolve_triple(nid);
+    record->entry.index = index;
+    record->added = operation == CHANGE_ADD;
+    last = (unsigned*)ht_get(model->undo_last, &index, sizeof(index), NULL);
+    if(last != NULL)
+    {
+        record->previous = *last;
+        *last = sequence;
+    }
+    else
+    {
+        record->previous = 0;
+        ht_put( model->undo_last, &index, sizeof(index),
+                &sequence, sizeof(sequence) );
+    }
+}
+
+
+/*  Appends a change to the change log of a model, if it is enabled, and to
+    its undo log. The caller must hold the model's triples_index_mutex. */
+static void log_change(model_t *model, unsigned operation, unsigned index)
+{
+    change_record_t record;
+    DBT key, value;
+    int result;
+
+    record_undo(model, operation, index);
+    if(model->changes == NULL)
+        return;
+
+    record.operation = operation;
+    record.nid.index = index;
+    record.nid.flags = NID_FTRIPLE;
+
+    ++model->last_change;
+    key.data = &model->last_change;
+    key.size = sizeof(model->last_change);
+    value.data = &record;
+    value.size = sizeof(record);
+    result = model->changes->put(model->changes, &key, &value, 0);
+    assert(result == 0);
+
+    if(model->versions != NULL)
+        record_version(model, operation, index, model->last_change);
+}
+
+
+/*  Adds or removes the value index entries of a triple whose object is a
+    typed literal node with encoded value 'value'. The triple is indexed both
+    under its predicate and under the null predicate. The caller must hold the
+    model's triples_index_mutex. */
+static void update_value_index( model_t *model, const triple_t *triple,
+                                unsigned index, const unsigned char *value,
+                                int add )
+{
+    unsigned char key_data[VALUE_KEY_SIZE];
+    nid_t predicate;
+    DBT key, data;
+    int result, n;
+
+    key.data = key_data;
+    key.size = VALUE_KEY_SIZE;
+    data.data = NULL;
+    data.size = 0;
+    for(n = 0; n < 2; ++n)
+    {
+        if(n == 0)
+            NID_SET_NULL(predicate)
+        else
+            predicate = triple->nodes[1];
+
+        make_value_key(key_data, predicate, value, index);
+        if(add)
+            result = model->values_index->put(
+                model->values_index, &key, &data, R_NOOVERWRITE );
+        else
+            result = model->values_index->del(model->values_index, &key, 0);
+        assert(result == 0 || result == 1);
+    }
+}
+
+
+/*  Number of tombstones at which a background compaction is started. */
+#define TOMBSTONE_LIMIT 65536
+
+/*  Largest number of tombstones folded while holding a model's lock. */
+#define COMPACTION_BATCH 4096
+
+/*  An index entry to be deleted, and the position of its triple. */
+typedef struct removal
+{
+    triple_entry_t entry;
+    unsigned position;
+} removal_t;
+
+
+static int compare_removals(const void *a, const void *b)
+{
+    return memcmp( &((const removal_t*)a)->entry,
+                   &((const removal_t*)b)->entry, sizeof(triple_entry_t) );
+}
+
+
+/*  Resolves 'count' triples into 'triples', and returns the index entries
+    of all of them in key order. The returned array of 8*count removals must
+    be freed by the caller. */
+static removal_t *prepare_removals( const nid_t *nids, unsigned count,
+                                    triple_t *triples )
+{
+    removal_t *removals, *removal;
+    unsigned n, permutation, m;
+
+    removals = (removal_t*)malloc((count > 0 ? 8*count : 1)*sizeof(removal_t));
+    assert(removals);
+    removal = removals;
+    for(n = 0; n < count; ++n)
+    {
+        assert(NID_IS_TRIPLE(nids[n]));
+        triples[n] = resolve_triple(nids[n]);
+        for(permutation = 0; permutation < 8; ++permutation)
+        {
+            for(m = 0; m < 3; ++m)
+            {
+                if(permutation & (1 << m))
+                    removal->entry.triple.nodes[m] = triples[n].nodes[m];
+                else
+                    NID_SET_NULL(removal->entry.triple.nodes[m]);
+            }
+            removal->entry.index = nids[n].index;
+            removal->position = n;
+            ++removal;
+        }
+    }
+    qsort(removals, 8*count, sizeof(removal_t), compare_removals);
+
+    return removals;
+}
+
+
+/*  Deletes the index entries returned by prepare_removals() from a model.
+    Removals that were deferred have already been logged and counted as
+    modifications. Returns the number of triples removed. The caller must
+    hold the model's triples_index_mutex. */
+static unsigned apply_removals( model_t *model, const removal_t *removals,
+                                unsigned count, const triple_t *triples,
+                                int deferred )
+{
+    unsigned char typed_value[TYPED_VALUE_SIZE], key_data[COMPACT_KEY_SIZE];
+    const triple_t *triple;
+    unsigned n, removed;
+    DBT key;
+    int result;
+
+    removed = 0;
+    for(n = 0; n < 8*count; ++n)
+    {
+        make_entry_key(model, &removals[n].entry, key_data, &key);
+        result = model->triples_index->del(model->triples_index, &key, 0);
+        assert(result == 0 || result == 1);
+
+        /* Primary entries sort first; there is one for each triple. */
+        if(result != 0 || !is_primary_entry(&removals[n].entry))
+            continue;
+        ++removed;
+        triple = &triples[removals[n].position];
+        if(NID_TYPE(triple->nodes[2]) != 0)
+        {
+            resolve_typed(triple->nodes[2], typed_value);
+            update_value_index( model, triple, removals[n].entry.index,
+                                typed_value, 0 );
+        }
+        if(!deferred)
+            log_change(model, CHANGE_REMOVE, removals[n].entry.index);
+        if(model->filter != NULL)
+            ++model->filter->removed;
+    }
+
+    /* Rebuild the filter once half of its triples are gone. */
+    if( model->filter != NULL &&
+        model->filter->removed > model->filter->triples/2 )
+    {
+        build_filter(model);
+    }
+
+    return removed;
+}
+
+
+/*  Determines if a triple of a model has been removed, but its index
+    entries have not been deleted yet. The caller must hold the model's
+    triples_index_mutex. */
+static int is_tombstone(const model_t *model, unsigned index)
+{
+    return model->tombstones != NULL &&
+           ht_get(model->tombstones, &index, sizeof(index), NULL) != NULL;
+}
+
+
+/*  Deletes the index entries of at most 'limit' tombstones of a model (or of
+    all of them, if 'limit' is 0). Only find_triple() skips tombstones;
+    other operations that read the index fold all of them first. The caller
+    must hold the model's triples_index_mutex. */
+static void fold_tombstones(model_t *model, unsigned limit)
+{
+    ht_it_t it;
+    const void *index;
+    nid_t *nids;
+    triple_t *triples;
+    removal_t *removals;
+    unsigned count, n;
+
+    if(model->tombstone_count == 0)
+        return;
+    count = model->tombstone_count;
+    if(limit > 0 && limit < count)
+        count = limit;
+
+    nids = (nid_t*)malloc(count*sizeof(nid_t));
+    triples = (triple_t*)malloc(count*sizeof(triple_t));
+    assert(nids && triples);
+    it = ht_iterator(model->tombstones);
+    for(n = 0; n < count && ht_next(&it, &index, NULL, NULL) != NULL; ++n)
+    {
+        nids[n].index = *(const unsigned*)index;
+        nids[n].flags = NID_FTRIPLE;
+    }
+    assert(n == count);
+    for(n = 0; n < count; ++n)
+    {
+        ht_erase( model->tombstones, &nids[n].index,
+                  sizeof(nids[n].index) );
+    }
+    model->tombstone_count -= count;
+
+    removals = prepare_removals(nids, count, triples);
+    apply_removals(model, removals, count, triples, 1);
+    free(removals);
+    free(triples);
+    free(nids);
+}
+
+
+#ifdef THREADSAFE
+static void *run_compaction(void *argument)
+{
+    model_t *model;
+
+    model = (model_t*)argument;
+    compact_model(model);
+    MUTEX_LOCK(model->triples_index_mutex);
+    model->compacting = 0;
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    return NULL;
+}
+#endif
+
+
+/*  Records a tombstone for a triple of a model with deferred removal, if it
+    is in the model. Returns the number of triples removed; 0 or 1. The
+    caller must hold the model's triples_index_mutex. */
+static unsigned defer_removal(model_t *model, unsigned index)
+{
+    triple_entry_t entry;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    DBT key, value;
+    int result;
+
+    /* Look up the primary entry of the triple. */
+    TRIPLE_SET_NULL(entry.triple);
+    entry.index = index;
+    make_entry_key(model, &entry, key_data, &key);
+    result = model->triples_index->get(model->triples_index, &key, &value, 0);
+    assert(result == 0 || result == 1);
+    if(result != 0 || is_tombstone(model, index))
+        return 0;
+
+    ht_put(model->tombstones, &index, sizeof(index), "", 1);
+    ++model->tombstone_count;
+    log_change(model, CHANGE_REMOVE, index);
+
+    if(model->tombstone_count >= TOMBSTONE_LIMIT)
+    {
+#ifdef THREADSAFE
+        /* Start a compaction, after joining the previous one. */
+        if(!model->compacting)
+        {
+            if(model->compactor_started)
+            {
+                result = pthread_join(model->compactor, NULL);
+                assert(result == 0);
+            }
+            model->compacting = 1;
+            result = pthread_create( &model->compactor, NULL,
+                                     run_compaction, model );
+            assert(result == 0);
+            model->compactor_started = 1;
+        }
+#else
+        fold_tombstones(model, 0);
+#endif
+    }
+
+    return 1;
+}
+
+
+unsigned add_triple(model_handle model, nid_t nid)
+{
+    triple_t triple;
+    triple_entry_t entry;
+    unsigned char typed_value[TYPED_VALUE_SIZE], key_data[COMPACT_KEY_SIZE];
+    int result, permutation, typed;
+    DBT key, value;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    assert(NID_IS_TRIPLE(nid));
+    assert(!model->read_only);
+    triple = resolve_triple(nid);
+
+    typed = NID_TYPE(triple.nodes[2]) != 0;
+    if(typed)
+        resolve_typed(triple.nodes[2], typed_value);
+
+    entry.index = nid.index;
+
+    value.data = 0;
+    value.size = 0;
+
+    /* Add the (partial) triples to the model's triple index. */
+    MUTEX_LOCK(model->triples_index_mutex);
+    for(permutation = 0; permutation < 8; ++permutation)
+    {
+        if(permutation & 1)
+            entry.triple.nodes[0] = triple.nodes[0];
+        else
+            NID_SET_NULL(entry.triple.nodes[0]);
+
+        if(permutation & 2)
+            entry.triple.nodes[1] = triple.nodes[1];
+        else
+            NID_SET_NULL(entry.triple.nodes[1]);
+
+        if(permutation & 4)
+            entry.triple.nodes[2] = triple.nodes[2];
+        else
+            NID_SET_NULL(entry.triple.nodes[2]);
+        
+        make_entry_key(model, &entry, key_data, &key);
+        result = model->triples_index->put(
+            model->triples_index, &key, &value, R_NOOVERWRITE );
+        assert(result == 0 || result == 1);
+    }
+    if(result != 0 && is_tombstone(model, nid.index))
+    {
+        /* The triple was removed, but its entries were not deleted yet. */
+        ht_erase(model->tombstones, &nid.index, sizeof(nid.index));
+        --model->tombstone_count;
+        result = 0;
+    }
+    if(result == 0 && typed)
+        update_value_index(model, &triple, nid.index, typed_value, 1);
+    if(result == 0)
+        log_change(model, CHANGE_ADD, nid.index);
+    if(result == 0 && model->filter != NULL)
+    {
+        add_filter_triple(model->filter, &triple);
+        if(model->filter->triples > model->filter->capacity)
+            build_filter(model);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+    
+    STATS_OPERATION(STATS_OP_ADD_TRIPLE, timer);
+    return (result == 0) ? 1 : 0;
+}
+
+
+unsigned remove_triple(model_handle model, nid_t nid)
+{
+    triple_t triple;
+    triple_entry_t entry;
+    unsigned char typed_value[TYPED_VALUE_SIZE], key_data[COMPACT_KEY_SIZE];
+    int result, permutation, typed;
+    DBT key;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    assert(NID_IS_TRIPLE(nid));
+    assert(!model->read_only);
+    
+    triple = resolve_triple(nid);
+
+    typed = NID_TYPE(triple.nodes[2]) != 0;
+    if(typed)
+        resolve_typed(triple.nodes[2], typed_value);
+    
+    entry.index = nid.index;
+        
+    /* Remove the partial triples from the triple index. */
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->filter != NULL && !filter_may_contain(model->filter, &triple))
+    {
+        /* The triple is not in the model. */
+        MUTEX_UNLOCK(model->triples_index_mutex);
+        STATS_OPERATION(STATS_OP_REMOVE_TRIPLE, timer);
+        return 0;
+    }
+    if(model->tombstones != NULL)
+    {
+        /* Record a tombstone instead of deleting the entries. */
+        result = defer_removal(model, nid.index);
+        MUTEX_UNLOCK(model->triples_index_mutex);
+        STATS_OPERATION(STATS_OP_REMOVE_TRIPLE, timer);
+        return result;
+    }
+    for(permutation = 0; permutation < 8; ++permutation)
+    {
+        if(permutation & 1)
+            entry.triple.nodes[0] = triple.nodes[0];
+        else
+            NID_SET_NULL(entry.triple.nodes[0]);
+
+        if(permutation & 2)
+            entry.triple.nodes[1] = triple.nodes[1];
+        else
+            NID_SET_NULL(entry.triple.nodes[1]);
+
+        if(permutation & 4)
+            entry.triple.nodes[2] = triple.nodes[2];
+        else
+            NID_SET_NULL(entry.triple.nodes[2]);
+
+        make_entry_key(model, &entry, key_data, &key);
+        result = model->triples_index->del(
+            model->triples_index, &key, 0);
+        assert(result == 0 || result == 1);
+    }
+    if(result == 0 && typed)
+        update_value_index(model, &triple, nid.index, typed_value, 0);
+    if(result == 0)
+        log_change(model, CHANGE_REMOVE, nid.index);
+    if(result == 0 && model->filter != NULL)
+    {
+        /* Rebuild the filter once half of its triples are gone. */
+        if(++model->filter->removed > model->filter->triples/2)
+            build_filter(model);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+    
+    STATS_OPERATION(STATS_OP_REMOVE_TRIPLE, timer);
+    return (result == 0) ? 1 : 0;
+}
+
+
+unsigned remove_triples(model_handle model, const nid_t *nids, unsigned count)
+{
+    triple_t *triples;
+    removal_t *removals;
+    unsigned removed, n;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    assert(!model->read_only);
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->tombstones != NULL)
+    {
+        removed = 0;
+        for(n = 0; n < count; ++n)
+        {
+            assert(NID_IS_TRIPLE(nids[n]));
+            removed += defer_removal(model, nids[n].index);
+        }
+        MUTEX_UNLOCK(model->triples_index_mutex);
+        STATS_OPERATION(STATS_OP_REMOVE_TRIPLES, timer);
+        return removed;
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    /* Sort the entries before taking the model. */
+    triples = (triple_t*)malloc((count > 0 ? count : 1)*sizeof(triple_t));
+    assert(triples);
+    removals = prepare_removals(nids, count, triples);
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    removed = apply_removals(model, removals, count, triples, 0);
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    free(removals);
+    free(triples);
+    STATS_OPERATION(STATS_OP_REMOVE_TRIPLES, timer);
+    return removed;
+}
+
+
+void enable_deferred_removal(model_handle model)
+{
+    assert(!model->read_only);
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->tombstones == NULL)
+    {
+        model->tombstones = (ht_t*)malloc(sizeof(ht_t));
+        assert(model->tombstones);
+        ht_create(model->tombstones, hash_fnv1);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+}
+
+
+void compact_model(model_handle model)
+{
+    unsigned remaining;
+
+    do {
+        MUTEX_LOCK(model->triples_index_mutex);
+        fold_tombstones(model, COMPACTION_BATCH);
+        remaining = model->tombstone_count;
+        MUTEX_UNLOCK(model->triples_index_mutex);
+    } while(remaining > 0);
+}
+
+
+nid_t find_triple(model_handle model, triple_t *pattern, nid_t previous)
+{
+    nid_t nid;
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    int result;
+    DBT key, value;
+    stats_timer_t timer;
+    
+    STATS_START(timer);
+    assert(NID_IS_NULL(previous) || NID_IS_TRIPLE(previous));
+
+    entry.triple = *pattern;
+    entry.index  = previous.index;
+    
+    make_entry_key(model, &entry, key_data, &key);
+    
+    MUTEX_LOCK(model->triples_index_mutex);
+    if( model->filter != NULL && is_bound_triple(pattern) &&
+        !filter_may_contain(model->filter, pattern) )
+    {
+        /* The triple is not in the model. */
+        result = 1;
+    }
+    else
+    {
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_CURSOR );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+    }
+
+    if( result == 0 && !NID_IS_NULL(previous) &&
+        memcmp(found, &entry, sizeof(entry)) == 0 )
+    {
+        /* Skip the previous triple. Note that the key order of the triple
+           indices is a byte order, so seeking to the successor of the
+           previous index would not work. */
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_NEXT );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+    }
+
+    /* Skip removed triples whose entries were not deleted yet. */
+    while( result == 0 && model->tombstone_count > 0 &&
+           TRIPLE_IS_EQUAL(found->triple, *pattern) &&
+           is_tombstone(model, found->index) )
+    {
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_NEXT );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+    }
+
+    if(result == 0 && TRIPLE_IS_EQUAL(found->triple, *pattern))
+    {
+        /* Next triple found. */
+        nid.index = found->index;
+        nid.flags = NID_FTRIPLE;
+    }
+    else
+    {
+        /* No more triples found. */
+        NID_SET_NULL(nid);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_FIND_TRIPLE, timer);
+    return nid;
+}
+
+
+void enable_history(model_handle model)
+{
+    triple_entry_t entry;
+    const triple_entry_t *found;
+    version_range_t range;
+    DBT key, value, range_key, range_value;
+    int result, created;
+
+    enable_change_log(model);
+
+    /* The page cache of the history is taken from the pool, which requires
+       the models_mutex to be acquired first. It is released before the
+       triples in the model are recorded. */
+    MUTEX_LOCK(models_mutex);
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(model->versions != NULL)
+    {
+        MUTEX_UNLOCK(models_mutex);
+    }
+    else
+    {
+        created = model->versions_filename == NULL ||
+                  access(model->versions_filename, F_OK) != 0;
+        open_history(model, take_history_cache(model));
+        MUTEX_UNLOCK(models_mutex);
+
+        if(created)
+        {
+            /* Record the triples in the model, whose primary entries come
+               first, as added at the current version. */
+            range.added = model->last_change;
+            range.removed = 0;
+            range_key.size = sizeof(unsigned);
+            range_value.data = &range;
+            range_value.size = sizeof(range);
+            result = model->triples_index->seq( model->triples_index,
+                                                &key, &value, R_FIRST );
+            while(result == 0)
+            {
+                found = read_entry_key(model, &key, &entry);
+                if(!is_primary_entry(found))
+                    break;
+                range_key.data = (void*)&found->index;
+                result = model->versions->put( model->versions, &range_key,
+                                               &range_value, 0 );
+                assert(result == 0);
+                update_history_index( model, model->history_index,
+                                      found->index, 1 );
+                result = model->triples_index->seq( model->triples_index,
+                                                    &key, &value, R_NEXT );
+            }
+            assert(result == 0 || result == 1);
+        }
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+}
+
+
+unsigned current_version(model_handle model)
+{
+    unsigned version;
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    version = model->changes != NULL ? model->last_change : 0;
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    return version;
+}
+
+
+/*  Determines if a triple was in a model at a version, given the periods
+    recorded for it in the model's versions database. */
+static int is_in_version(const DBT *ranges, unsigned version)
+{
+    const version_range_t *range;
+    unsigned n;
+
+    range = (const version_range_t*)ranges->data;
+    for(n = 0; n < ranges->size/sizeof(version_range_t); ++n)
+    {
+        if( range[n].added <= version &&
+            (range[n].removed == 0 || version < range[n].removed) )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+nid_t find_triple_as_of( model_handle model, triple_t *pattern,
+                         nid_t previous, unsigned version )
+{
+    nid_t nid;
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    int result;
+    DBT key, value, range_key, ranges;
+
+    assert(NID_IS_NULL(previous) || NID_IS_TRIPLE(previous));
+    assert(model->versions != NULL);
+
+    entry.triple = *pattern;
+    entry.index  = previous.index;
+    make_entry_key(model, &entry, key_data, &key);
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    result = model->history_index->seq( model->history_index,
+                                        &key, &value, R_CURSOR );
+    assert(result == 0 || result == 1);
+    if(result == 0)
+        found = read_entry_key(model, &key, &found_entry);
+    if( result == 0 && !NID_IS_NULL(previous) &&
+        memcmp(found, &entry, sizeof(entry)) == 0 )
+    {
+        /* Skip the previous triple. */
+        result = model->history_index->seq( model->history_index,
+                                            &key, &value, R_NEXT );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+    }
+
+    /* Skip the triples that were not in the model at the given version. */
+    NID_SET_NULL(nid);
+    while(result == 0 && TRIPLE_IS_EQUAL(found->triple, *pattern))
+    {
+        range_key.data = (void*)&found->index;
+        range_key.size = sizeof(found->index);
+        result = model->versions->get( model->versions, &range_key,
+                                       &ranges, 0 );
+        assert(result == 0);
+        if(is_in_version(&ranges, version))
+        {
+            nid.index = found->index;
+            nid.flags = NID_FTRIPLE;
+            break;
+        }
+        result = model->history_index->seq( model->history_index,
+                                            &key, &value, R_NEXT );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    return nid;
+}
+
+
+void prune_history(model_handle model, unsigned version)
+{
+    const version_range_t *range;
+    version_range_t *kept;
+    unsigned *indices, size, capacity, n, m, count, kept_count;
+    DBT key, value;
+    int result;
+
+    assert(model->versions != NULL);
+    assert(!model->read_only);
+    MUTEX_LOCK(model->triples_index_mutex);
+
+    /* Find the triples with periods that ended at or before 'version'; the
+       database is not modified while it is being scanned. */
+    size = 0;
+    capacity = 64;
+    indices = (unsigned*)malloc(capacity*sizeof(unsigned));
+    assert(indices);
+    result = model->versions->seq(model->versions, &key, &value, R_FIRST);
+    while(result == 0)
+    {
+        range = (const version_range_t*)value.data;
+        if(range[0].removed != 0 && range[0].removed <= version)
+        {
+            if(size == capacity)
+            {
+                capacity *= 2;
+                indices = (unsigned*)realloc( indices,
+                                              capacity*sizeof(unsigned) );
+                assert(indices);
+            }
+            memcpy(&indices[size++], key.data, sizeof(unsigned));
+        }
+        result = model->versions->seq(model->versions, &key, &value, R_NEXT);
+    }
+    assert(result == 1);
+
+    /* Drop those periods, and triples without periods left. */
+    for(n = 0; n < size; ++n)
+    {
+        key.data = &indices[n];
+        key.size = sizeof(indices[n]);
+        result = model->versions->get(model->versions, &key, &value, 0);
+        assert(result == 0);
+        range = (const version_range_t*)value.data;
+        count = value.size/sizeof(version_range_t);
+        for(m = 0; m < count; ++m)
+        {
+            if(range[m].removed == 0 || range[m].removed > version)
+                break;
+        }
+        kept_count = count - m;
+        if(kept_count == 0)
+        {
+            result = model->versions->del(model->versions, &key, 0);
+            assert(result == 0);
+            update_history_index( model, model->history_index,
+                                  indices[n], 0 );
+        }
+        else
+        {
+            kept = (version_range_t*)malloc(
+                kept_count*sizeof(version_range_t) );
+            assert(kept);
+            memcpy(kept, range + m, kept_count*sizeof(version_range_t));
+            value.data = kept;
+            value.size = kept_count*sizeof(version_range_t);
+            result = model->versions->put(model->versions, &key, &value, 0);
+            assert(result == 0);
+            free(kept);
+        }
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+    free(indices);
+}
+
+
+nid_t find_distinct( model_handle model, triple_t *pattern, int position,
+                     nid_t previous )
+{
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    size_t prefix_size;
+    nid_t nid;
+    int result;
+    DBT key, value;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    assert(position >= 0 && position < 3);
+    assert(NID_IS_NULL(pattern->nodes[position]));
+    prefix_size = position*sizeof(nid_t);
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    fold_tombstones(model, 0);
+    for(;;)
+    {
+        /* Seek past all entries with the previous node at 'position' (or
+           the null node, initially) by filling the rest of the key with
+           0xFF bytes. */
+        entry.triple = *pattern;
+        entry.triple.nodes[position] = previous;
+        memset( (char*)&entry + prefix_size + sizeof(nid_t), 0xFF,
+                sizeof(entry) - prefix_size - sizeof(nid_t) );
+        make_entry_key(model, &entry, key_data, &key);
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_CURSOR );
+        assert(result == 0 || result == 1);
+        if(result == 0)
+            found = read_entry_key(model, &key, &found_entry);
+        if(result != 0 || memcmp(found, pattern, prefix_size) != 0)
+        {
+            /* No more nodes found. */
+            NID_SET_NULL(nid);
+            break;
+        }
+
+        /* Check for an entry of a triple matching the pattern with the node
+           found at 'position'. */
+        nid = found->triple.nodes[position];
+        entry.triple = *pattern;
+        entry.triple.nodes[position] = nid;
+        entry.index = 0;
+        make_entry_key(model, &entry, key_data, &key);
+        result = model->triples_index->seq( model->triples_index,
+                                            &key, &value, R_CURSOR );
+        assert(result == 0 || result == 1);
+        if( result == 0 &&
+            memcmp( read_entry_key(model, &key, &found_entry), &entry.triple,
+                    sizeof(triple_t) ) == 0 )
+        {
+            break;
+        }
+        previous = nid;
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_FIND_DISTINCT, timer);
+    return nid;
+}
+
+
+nid_t find_triple_range( model_handle model, nid_t predicate,
+                         nid_t low, nid_t high, nid_t previous )
+{
+    unsigned char low_value[TYPED_VALUE_SIZE], high_value[TYPED_VALUE_SIZE],
+                  key_data[VALUE_KEY_SIZE];
+    const unsigned char *found;
+    nid_t nid;
+    int result;
+    DBT key, value;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    assert(NID_TYPE(low) != 0 && NID_TYPE(low) == NID_TYPE(high));
+    resolve_typed(high, high_value);
+    if(NID_IS_NULL(previous))
+    {
+        resolve_typed(low, low_value);
+        make_value_key(key_data, predicate, low_value, 0);
+    }
+    else
+    {
+        /* Continue after the previous triple, which has the same value as or
+           a smaller value than any of the triples that follow it. */
+        triple_t triple;
+
+        assert(NID_IS_TRIPLE(previous));
+        triple = resolve_triple(previous);
+        resolve_typed(triple.nodes[2], low_value);
+        make_value_key(key_data, predicate, low_value, previous.index + 1);
+    }
+
+    key.data = key_data;
+    key.size = VALUE_KEY_SIZE;
+    
+    MUTEX_LOCK(model->triples_index_mutex);
+    fold_tombstones(model, 0);
+    result = model->values_index->seq( model->values_index,
+                                       &key, &value, R_CURSOR );
+    assert(result == 0 || result == 1);
+    assert(result != 0 || key.size == VALUE_KEY_SIZE);
+    
+    found = (const unsigned char *)key.data;
+    if( result == 0 &&
+        memcmp(found, &predicate, sizeof(nid_t)) == 0 &&
+        memcmp(found + sizeof(nid_t), high_value, TYPED_VALUE_SIZE) <= 0 )
+    {
+        /* Next triple found. */
+        found += sizeof(nid_t) + TYPED_VALUE_SIZE;
+        nid.index = ((unsigned)found[0] << 24) | ((unsigned)found[1] << 16) |
+                    ((unsigned)found[2] << 8) | (unsigned)found[3];
+        nid.flags = NID_FTRIPLE;
+    }
+    else
+    {
+        /* No more triples found. */
+        NID_SET_NULL(nid);
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_FIND_TRIPLE_RANGE, timer);
+    return nid;
+}
+
+
+/*  Number of triples visited while holding a model's lock when scanning
+    many triples. */
+#define SCAN_BATCH 256
+
+
+/*  Opens a snapshot of the current contents of a model. The snapshot takes
+    over a reference to the model held by the caller. The caller must hold
+    the model's triples_index_mutex. */
+static snapshot_t *take_snapshot(model_t *model)
+{
+    snapshot_t *snapshot;
+
+    snapshot = (snapshot_t*)malloc(sizeof(snapshot_t));
+    assert(snapshot);
+    snapshot->model = model;
+    snapshot->restored = NULL;
+    snapshot->restored_size = snapshot->restored_capacity = 0;
+    snapshot->restored_end = 0;
+    snapshot->ranks = NULL;
+
+    if(model->snapshots == NULL)
+    {
+        /* Start logging changes. */
+        model->undo_last = (ht_t*)malloc(sizeof(ht_t));
+        assert(model->undo_last);
+        ht_create(model->undo_last, hash_fnv1);
+    }
+    snapshot->start = model->undo_first + model->undo_size;
+    snapshot->newer = NULL;
+    snapshot->older = model->snapshots;
+    if(model->snapshots != NULL)
+        model->snapshots->newer = snapshot;
+    model->snapshots = snapshot;
+
+    return snapshot;
+}
+
+
+/*  Discards the changes in the undo log of a model that are older than all
+    open snapshots of it, or the whole log if no snapshots are open. The log
+    is only compacted once at least half of it can be discarded. The caller
+    must hold the model's triples_index_mutex. */
+static void trim_undo_log(model_t *model)
+{
+    snapshot_t *oldest;
+    unsigned count, sequence, n;
+
+    if(model->snapshots == NULL)
+    {
+        free(model->undo);
+        model->undo = NULL;
+        model->undo_first = 1;
+        model->undo_size = model->undo_capacity = 0;
+        ht_destroy(model->undo_last);
+        free(model->undo_last);
+        model->undo_last = NULL;
+        return;
+    }
+
+    for(oldest = model->snapshots; oldest->older != NULL; )
+        oldest = oldest->older;
+    count = oldest->start - model->undo_first;
+    if(count == 0 || 2*count < model->undo_size)
+        return;
+
+    model->undo_size -= count;
+    memmove( model->undo, model->undo + count,
+             model->undo_size*sizeof(undo_record_t) );
+    model->undo_first = oldest->start;
+
+    /* Changes older than all snapshots hide no triples from them. */
+    ht_destroy(model->undo_last);
+    ht_create(model->undo_last, hash_fnv1);
+    for(n = 0; n < model->undo_size; ++n)
+    {
+        sequence = model->undo_first + n;
+        ht_put( model->undo_last, &model->undo[n].entry.index,
+                sizeof(unsigned), &sequence, sizeof(sequence) );
+    }
+}
+
+
+snapshot_handle open_snapshot(model_handle model)
+{
+    snapshot_t *snapshot;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+
+    /* The snapshot holds a reference to the model, so that it remains
+       usable after the caller's handle is closed. */
+    MUTEX_LOCK(models_mutex);
+    ++model->references;
+    MUTEX_UNLOCK(models_mutex);
+
+    MUTEX_LOCK(model->triples_index_mutex);
+    snapshot = take_snapshot(model);
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_OPEN_SNAPSHOT, timer);
+    return snapshot;
+}
+
+
+void close_snapshot(snapshot_handle snapshot)
+{
+    model_t *model;
+    snapshot_rank_t *rank;
+
+    model = snapshot->model;
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(snapshot->newer != NULL)
+        snapshot->newer->older = snapshot->older;
+    else
+        model->snapshots = snapshot->older;
+    if(snapshot->older != NULL)
+        snapshot->older->newer = snapshot->newer;
+    trim_undo_log(model);
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    while(snapshot->ranks != NULL)
+    {
+        rank = snapshot->ranks;
+        snapshot->ranks = rank->next;
+        free(rank->marks);
+        free(rank);
+    }
+    free(snapshot->restored);
+    free(snapshot);
+    close_model(model);
+}
+
+
+/*  Determines if a triple matches a pattern, in which null nodes match any
+    node. */
+static int matches_pattern(const triple_t *triple, const triple_t *pattern)
+{
+    int n;
+
+    for(n = 0; n < 3; ++n)
+    {
+        if( !NID_IS_NULL(pattern->nodes[n]) &&
+            !NID_IS_EQUAL(triple->nodes[n], pattern->nodes[n]) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*  Determines if a triple of a snapshot's model was changed after the
+    snapshot was opened, so that its index entries do not show its state in
+    the snapshot. The caller must hold the model's triples_index_mutex. */
+static int is_changed_since(const snapshot_t *snapshot, unsigned index)
+{
+    const unsigned *last;
+
+    last = (const unsigned*)ht_get( snapshot->model->undo_last,
+                                    &index, sizeof(index), NULL );
+
+    return last != NULL && *last >= snapshot->start;
+}
+
+
+/*  Updates the triples restored in a snapshot for 'pattern': the triples
+    matching it that were in the model when the snapshot was opened, and
+    have been removed since. Only the changes logged since the last update
+    for the same pattern are searched. The caller must hold the model's
+    triples_index_mutex. */
+static void restore_triples(snapshot_t *snapshot, const triple_t *pattern)
+{
+    model_t *model;
+    const undo_record_t *record;
+    unsigned sequence, end, low, high, middle;
+
+    model = snapshot->model;
+    if( snapshot->restored_end == 0 ||
+        !TRIPLE_IS_EQUAL(snapshot->pattern, *pattern) )
+    {
+        snapshot->pattern = *pattern;
+        snapshot->restored_size = 0;
+        snapshot->restored_end = snapshot->start;
+    }
+
+    end = model->undo_first + model->undo_size;
+    for(sequence = snapshot->restored_end; sequence < end; ++sequence)
+    {
+        record = &model->undo[sequence - model->undo_first];
+        if( record->added || record->previous >= snapshot->start ||
+            !matches_pattern(&record->entry.triple, pattern) )
+        {
+            continue;
+        }
+
+        /* Insert the triple in key order; as all entries share the
+           pattern, this is the byte order of their indices. */
+        if(snapshot->restored_size == snapshot->restored_capacity)
+        {
+            snapshot->restored_capacity = 2*snapshot->restored_capacity + 16;
+            snapshot->restored = (triple_entry_t*)realloc( snapshot->restored,
+                snapshot->restored_capacity*sizeof(triple_entry_t) );
+            assert(snapshot->restored);
+        }
+        low = 0;
+        high = snapshot->restored_size;
+        while(low < high)
+        {
+            middle = low + (high - low)/2;
+            if( memcmp( &snapshot->restored[middle].index,
+                        &record->entry.index, sizeof(unsigned) ) < 0 )
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        memmove( snapshot->restored + low + 1, snapshot->restored + low,
+                 (snapshot->restored_size - low)*sizeof(triple_entry_t) );
+        snapshot->restored[low] = record->entry;
+        ++snapshot->restored_size;
+    }
+    snapshot->restored_end = end;
+}
+
+
+/*  Moves the cursor of a model's triple index as seq() does with 'flags',
+    and sets '*found' to the entry at the new position, which is decoded into
+    'buffer' if necessary. Returns the result of seq(). */
+static int seek_entry( const model_t *model, DBT *key, unsigned flags,
+                       triple_entry_t *buffer, const triple_entry_t **found )
+{
+    DBT value;
+    int result;
+
+    result = model->triples_index->seq( model->triples_index,
+                                        key, &value, flags );
+    assert(result == 0 || result == 1);
+    if(result == 0)
+        *found = read_entry_key(model, key, buffer);
+
+    return result;
+}
+
+
+/*  Visits at most 'limit' triples matching 'pattern' in a model, or in a
+    snapshot of it if 'snapshot' is not NULL, that follow '*previous' in the
+    order in which find_triple() returns them (or the first ones, if
+    '*previous' is null). The node identifiers of the triples visited are
+    stored in 'nids' unless it is NULL, and '*previous' is set to the last
+    one. Returns the number of triples visited. The caller must hold the
+    model's triples_index_mutex. */
+static unsigned scan_triples( model_t *model, snapshot_t *snapshot,
+                              const triple_t *pattern, nid_t *previous,
+                              unsigned limit, nid_t *nids )
+{
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    unsigned count, restored, restored_size, high, middle, index;
+    DBT key;
+    int result;
+
+    if(limit == 0)
+        return 0;
+
+    entry.triple = *pattern;
+    entry.index = previous->index;
+    make_entry_key(model, &entry, key_data, &key);
+    result = seek_entry(model, &key, R_CURSOR, &found_entry, &found);
+    if( result == 0 && !NID_IS_NULL(*previous) &&
+        memcmp(found, &entry, sizeof(entry)) == 0 )
+    {
+        /* Skip the previous triple. */
+        result = seek_entry(model, &key, R_NEXT, &found_entry, &found);
+    }
+
+    /* Find the first restored triple after the previous one. */
+    restored = restored_size = 0;
+    if(snapshot != NULL)
+    {
+        restore_triples(snapshot, pattern);
+        restored_size = high = snapshot->restored_size;
+        while(!NID_IS_NULL(*previous) && restored < high)
+        {
+            middle = restored + (high - restored)/2;
+            if( memcmp( &snapshot->restored[middle].index, &previous->index,
+                        sizeof(unsigned) ) <= 0 )
+                restored = middle + 1;
+            else
+                high = middle;
+        }
+    }
+
+    for(count = 0; count < limit; ++count)
+    {
+        /* Skip removed triples whose entries were not deleted yet, and
+           triples changed since the snapshot was opened. */
+        while( result == 0 && TRIPLE_IS_EQUAL(found->triple, *pattern) &&
+               ( is_tombstone(model, found->index) ||
+                 ( snapshot != NULL &&
+                   is_changed_since(snapshot, found->index) ) ) )
+        {
+            result = seek_entry(model, &key, R_NEXT, &found_entry, &found);
+        }
+        if(result == 0 && !TRIPLE_IS_EQUAL(found->triple, *pattern))
+            result = 1;
+
+        /* Merge the triples in the index with the restored ones, which are
+           never in the index. */
+        if( result == 0 &&
+            ( restored == restored_size ||
+              memcmp( &found->index, &snapshot->restored[restored].index,
+                      sizeof(unsigned) ) < 0 ) )
+        {
+            index = found->index;
+            result = seek_entry(model, &key, R_NEXT, &found_entry, &found);
+        }
+        else
+        if(restored < restored_size)
+        {
+            index = snapshot->restored[restored++].index;
+        }
+        else
+        {
+            break;
+        }
+
+        previous->index = index;
+        previous->flags = NID_FTRIPLE;
+        if(nids != NULL)
+            nids[count] = *previous;
+    }
+
+    return count;
 }
 
 
-unsigned add_triple(model_handle model, nid_t nid)
+/*  Returns the rank checkpoints of a snapshot for 'pattern', adding them
+    without any checkpoints if they do not exist yet. The caller must hold
+    the model's triples_index_mutex. */
+static snapshot_rank_t *rank_pattern( snapshot_t *snapshot,
+                                      const triple_t *pattern )
 {
-    triple_t triple;
-    triple_entry_t entry;
-    int result, permutation;
-    DBT key, value;
-    
-    assert(NID_IS_TRIPLE(nid));
-    triple = resolve_triple(nid);
+    snapshot_rank_t *rank;
 
-    entry.index = nid.index;
+    for(rank = snapshot->ranks; rank != NULL; rank = rank->next)
+    {
+        if(TRIPLE_IS_EQUAL(rank->pattern, *pattern))
+            return rank;
+    }
 
-    key.data = &entry;
-    key.size = sizeof(entry);
-    value.data = 0;
-    value.size = 0;
+    rank = (snapshot_rank_t*)malloc(sizeof(snapshot_rank_t));
+    assert(rank);
+    rank->pattern = *pattern;
+    rank->marks = NULL;
+    rank->size = rank->capacity = 0;
+    rank->complete = 0;
+    rank->count = 0;
+    rank->next = snapshot->ranks;
+    snapshot->ranks = rank;
 
-    /* Add the (partial) triples to the model's triple index. */
-    MUTEX_LOCK(model->triples_index_mutex);
-    for(permutation = 0; permutation < 8; ++permutation)
+    return rank;
+}
+
+
+/*  Visits at most 'limit' triples matching the pattern of 'rank' in a
+    snapshot, like scan_triples() does, after '*previous', which is the
+    match before position '*position'. Both are advanced past the triples
+    visited. Checkpoints are added for the batches of matches passed, and
+    the number of matches once the last one is passed. Returns the number
+    of triples visited. The caller must hold the model's
+    triples_index_mutex. */
+static unsigned scan_ranked( snapshot_t *snapshot, snapshot_rank_t *rank,
+                             nid_t *previous, unsigned *position,
+                             unsigned limit, nid_t *nids )
+{
+    unsigned count, step, visited;
+
+    for(count = 0; count < limit; count += visited)
     {
-        if(permutation & 1)
-            entry.triple.nodes[0] = triple.nodes[0];
-        else
-            NID_SET_NULL(entry.triple.nodes[0]);
+        /* Stop at the end of every batch to check for its checkpoint. */
+        step = SCAN_BATCH - *position % SCAN_BATCH;
+        if(step > limit - count)
+            step = limit - count;
+        visited = scan_triples( snapshot->model, snapshot, &rank->pattern,
+                                previous, step,
+                                nids != NULL ? nids + count : NULL );
+        *position += visited;
+        if(visited < step)
+        {
+            rank->complete = 1;
+            rank->count = *position;
+            return count + visited;
+        }
 
-        if(permutation & 2)
-            entry.triple.nodes[1] = triple.nodes[1];
-        else
-            NID_SET_NULL(entry.triple.nodes[1]);
+        if( *position % SCAN_BATCH == 0 &&
+            *position/SCAN_BATCH == rank->size + 1 )
+        {
+            if(rank->size == rank->capacity)
+            {
+                rank->capacity = 2*rank->capacity + 16;
+                rank->marks = (nid_t*)realloc( rank->marks,
+                                               rank->capacity*sizeof(nid_t) );
+                assert(rank->marks);
+            }
+            rank->marks[rank->size++] = *previous;
+        }
+    }
 
-        if(permutation & 4)
-            entry.triple.nodes[2] = triple.nodes[2];
+    return count;
+}
+
+
+/*  Finds the triple before match 'offset' of 'pattern' in a snapshot, by
+    seeking to the last checkpoint before it and skipping the matches in
+    between, which are fewer than SCAN_BATCH. Missing checkpoints are added
+    first, a batch of matches at a time, letting writers in between. Sets
+    '*previous' to the triple and '*position' to 'offset', or to the number
+    of matches if there are fewer. Returns the rank checkpoints of the
+    pattern. The caller must hold the model's triples_index_mutex. */
+static snapshot_rank_t *seek_rank( snapshot_t *snapshot,
+                                   const triple_t *pattern, unsigned offset,
+                                   nid_t *previous, unsigned *position )
+{
+    snapshot_rank_t *rank;
+    unsigned n;
+
+    rank = rank_pattern(snapshot, pattern);
+    for(;;)
+    {
+        n = offset/SCAN_BATCH < rank->size ? offset/SCAN_BATCH : rank->size;
+        *position = n*SCAN_BATCH;
+        if(n > 0)
+            *previous = rank->marks[n - 1];
         else
-            NID_SET_NULL(entry.triple.nodes[2]);
-        
-        result = model->triples_index->put(
-            model->triples_index, &key, &value, R_NOOVERWRITE );
-        assert(result == 0 || result == 1);
+            NID_SET_NULL(*previous);
+        if(offset - *position < SCAN_BATCH || rank->complete)
+            break;
+
+        /* The checkpoints do not go beyond this one batch; the rank is kept
+           while the lock is released. */
+        scan_ranked(snapshot, rank, previous, position, SCAN_BATCH, NULL);
+        MUTEX_UNLOCK(snapshot->model->triples_index_mutex);
+        MUTEX_LOCK(snapshot->model->triples_index_mutex);
     }
+    scan_ranked(snapshot, rank, previous, position, offset - *position, NULL);
+
+    return rank;
+}
+
+
+nid_t find_snapshot_triple( snapshot_handle snapshot, triple_t *pattern,
+                            nid_t previous )
+{
+    model_t *model;
+
+    assert(NID_IS_NULL(previous) || NID_IS_TRIPLE(previous));
+
+    model = snapshot->model;
+    MUTEX_LOCK(model->triples_index_mutex);
+    if(scan_triples(model, snapshot, pattern, &previous, 1, NULL) == 0)
+        NID_SET_NULL(previous);
     MUTEX_UNLOCK(model->triples_index_mutex);
-    
-    return (result == 0) ? 1 : 0;
+
+    return previous;
 }
 
 
-unsigned remove_triple(model_handle model, nid_t nid)
+unsigned count_snapshot_triples(snapshot_handle snapshot, triple_t *pattern)
 {
-    triple_t triple;
-    triple_entry_t entry;
-    int result, permutation;
+    nid_t previous;
+    unsigned count;
+
+    MUTEX_LOCK(snapshot->model->triples_index_mutex);
+    seek_rank(snapshot, pattern, (unsigned)-1, &previous, &count);
+    MUTEX_UNLOCK(snapshot->model->triples_index_mutex);
+
+    return count;
+}
+
+
+unsigned find_snapshot_triples( snapshot_handle snapshot, triple_t *pattern,
+                                unsigned offset, unsigned limit, nid_t *nids )
+{
+    snapshot_rank_t *rank;
+    nid_t previous;
+    unsigned position, count;
+
+    count = 0;
+    MUTEX_LOCK(snapshot->model->triples_index_mutex);
+    rank = seek_rank(snapshot, pattern, offset, &previous, &position);
+    if(position == offset)
+    {
+        count = scan_ranked( snapshot, rank, &previous, &position,
+                             limit, nids );
+    }
+    MUTEX_UNLOCK(snapshot->model->triples_index_mutex);
+
+    return count;
+}
+
+
+unsigned find_triples( model_handle model, triple_t *pattern,
+                       nid_t previous, unsigned limit, nid_t *nids )
+{
+    unsigned count;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    assert(NID_IS_NULL(previous) || NID_IS_TRIPLE(previous));
+    MUTEX_LOCK(model->triples_index_mutex);
+    if( model->filter != NULL && is_bound_triple(pattern) &&
+        !filter_may_contain(model->filter, pattern) )
+    {
+        /* The triple is not in the model. */
+        count = 0;
+    }
+    else
+        count = scan_triples(model, NULL, pattern, &previous, limit, nids);
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_FIND_TRIPLES, timer);
+    return count;
+}
+
+
+unsigned partition_snapshot( snapshot_handle snapshot, triple_t *pattern,
+                             snapshot_partition_t *partitions,
+                             unsigned count )
+{
+    nid_t previous;
+    unsigned size, start, position, n;
+
+    size = count_snapshot_triples(snapshot, pattern);
+    if(count > size)
+        count = size;
+
+    /* Every partition starts after the last triple of the previous one,
+       which is found from the rank checkpoints. The first 'size % count'
+       partitions get one triple more than the others. */
+    start = 0;
+    MUTEX_LOCK(snapshot->model->triples_index_mutex);
+    for(n = 0; n < count; ++n)
+    {
+        seek_rank(snapshot, pattern, start, &previous, &position);
+        assert(position == start);
+        partitions[n].pattern = *pattern;
+        partitions[n].previous = previous;
+        partitions[n].remaining = size/count + (n < size%count ? 1 : 0);
+        partitions[n].batch_size = partitions[n].batch_position = 0;
+        start += partitions[n].remaining;
+    }
+    MUTEX_UNLOCK(snapshot->model->triples_index_mutex);
+
+    return count;
+}
+
+
+nid_t next_partition_triple( snapshot_handle snapshot,
+                             snapshot_partition_t *partition )
+{
+    nid_t nid;
+    unsigned limit;
+
+    if(partition->batch_position == partition->batch_size)
+    {
+        /* Fetch the next batch with a single search of the index. */
+        partition->batch_size = partition->batch_position = 0;
+        if(partition->remaining > 0)
+        {
+            limit = partition->remaining < PARTITION_BATCH ?
+                    partition->remaining : PARTITION_BATCH;
+            MUTEX_LOCK(snapshot->model->triples_index_mutex);
+            partition->batch_size = scan_triples( snapshot->model, snapshot,
+                &partition->pattern, &partition->previous, limit,
+                partition->batch );
+            MUTEX_UNLOCK(snapshot->model->triples_index_mutex);
+            partition->remaining = partition->batch_size == limit ?
+                                   partition->remaining - limit : 0;
+        }
+        if(partition->batch_size == 0)
+        {
+            NID_SET_NULL(nid);
+            return nid;
+        }
+    }
+
+    return partition->batch[partition->batch_position++];
+}
+
+
+/*  Adds 'count' to the count of 'node' in an array of '*size' node counts,
+    in which 'groups' maps nodes to their positions. If 'groups' is NULL,
+    the count is appended to the array instead. */
+static void add_node_count( node_count_t **counts, unsigned *size,
+                            unsigned *capacity, ht_t *groups,
+                            nid_t node, unsigned count )
+{
+    unsigned *position;
+
+    position = groups != NULL ?
+               (unsigned*)ht_get(groups, &node, sizeof(node), NULL) : NULL;
+    if(position != NULL)
+    {
+        (*counts)[*position].count += count;
+        return;
+    }
+
+    if(*size == *capacity)
+    {
+        *capacity = 2*(*capacity) + 16;
+        *counts = (node_count_t*)realloc( *counts,
+                                          *capacity*sizeof(node_count_t) );
+        assert(*counts);
+    }
+    (*counts)[*size].node = node;
+    (*counts)[*size].count = count;
+    if(groups != NULL)
+        ht_put(groups, &node, sizeof(node), size, sizeof(*size));
+    ++*size;
+}
+
+
+static int compare_counts(const void *a, const void *b)
+{
+    unsigned count_a, count_b;
+
+    count_a = ((const node_count_t*)a)->count;
+    count_b = ((const node_count_t*)b)->count;
+
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+
+/*  Restores the min-heap order of 'heap' below element 'n'. */
+static void sift_counts(node_count_t *heap, unsigned size, unsigned n)
+{
+    node_count_t element;
+    unsigned child;
+
+    element = heap[n];
+    while((child = 2*n + 1) < size)
+    {
+        if(child + 1 < size && heap[child + 1].count < heap[child].count)
+            ++child;
+        if(element.count <= heap[child].count)
+            break;
+        heap[n] = heap[child];
+        n = child;
+    }
+    heap[n] = element;
+}
+
+
+/*  Moves the 'top' largest counts to the front of 'counts', in order of
+    decreasing count. */
+static void select_top_counts(node_count_t *counts, unsigned size, unsigned top)
+{
+    node_count_t element;
+    unsigned n;
+
+    if(top < size)
+    {
+        /* Keep the largest counts seen in a min-heap. */
+        for(n = top/2; n-- > 0; )
+            sift_counts(counts, top, n);
+        for(n = top; n < size; ++n)
+        {
+            if(top > 0 && counts[n].count > counts[0].count)
+            {
+                element = counts[0];
+                counts[0] = counts[n];
+                counts[n] = element;
+                sift_counts(counts, top, 0);
+            }
+        }
+    }
+    else
+    {
+        top = size;
+    }
+    qsort(counts, top, sizeof(node_count_t), compare_counts);
+}
+
+/*  Number of ranges of group nodes that group_snapshot_triples() divides
+    among its threads. A node is in the range of the first byte of its
+    identifier, which is the low byte of the index of dictionary nodes on
+    little-endian hosts. */
+#define GROUP_RANGES 256
+
+/*  A group-by over a snapshot, shared by the threads counting it. */
+typedef struct group_scan
+{
+    snapshot_t *snapshot;
+    const triple_t *pattern;
+    int position;
+    unsigned next_range;    /* first range not taken by a thread; protected
+                               by the model's triples_index_mutex */
+} group_scan_t;
+
+/*  The node counts of the ranges counted by one thread of a group-by. */
+typedef struct group_counts
+{
+    group_scan_t *scan;
+    node_count_t *counts;
+    unsigned size, capacity;
+#ifdef THREADSAFE
+    pthread_t thread;
+#endif
+} group_counts_t;
+
+
+/*  Counts the groups in the ranges of a group-by that no other thread has
+    taken yet, in 'argument' (a group_counts_t). The index is scanned a
+    group at a time, searching for the start of the next group rather than
+    visiting every entry. The model is locked while a batch of entries is
+    read; the counts found are added to the thread's counts after unlocking,
+    so that threads only contend for the index itself. */
+static void *count_group_ranges(void *argument)
+{
+    group_counts_t *thread;
+    group_scan_t *scan;
+    snapshot_t *snapshot;
+    model_t *model;
+    const triple_t *pattern;
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    const undo_record_t *record;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    node_count_t *batch;
+    ht_t groups;    /* (nid_t)node => (unsigned)position in 'thread->counts' */
+    nid_t last, node;
+    unsigned range, batch_size, batch_capacity, count, visited, logged, end;
+    unsigned n;
     DBT key;
-    
-    assert(NID_IS_TRIPLE(nid));
-    
-    triple = resolve_triple(nid);
-    
-    entry.index = nid.index;
-    
-    key.data = &entry;
-    key.size = sizeof(entry);
-        
-    /* Remove the partial triples from the triple index. */
+    int result, position;
+
+    thread = (group_counts_t*)argument;
+    scan = thread->scan;
+    snapshot = scan->snapshot;
+    model = snapshot->model;
+    pattern = scan->pattern;
+    position = scan->position;
+    ht_create(&groups, hash_fnv1);
+    batch = NULL;
+    batch_size = batch_capacity = 0;
+
     MUTEX_LOCK(model->triples_index_mutex);
-    for(permutation = 0; permutation < 8; ++permutation)
+    while(scan->next_range < GROUP_RANGES)
     {
-        if(permutation & 1)
-            entry.triple.nodes[0] = triple.nodes[0];
-        else
-            NID_SET_NULL(entry.triple.nodes[0]);
+        /* Visit the groups of the range in key order, starting after the
+           largest node of the previous range, or after the entries with a
+           null node at 'position'. */
+        range = scan->next_range++;
+        NID_SET_NULL(last);
+        if(range > 0)
+        {
+            memset(&last, 0xFF, sizeof(nid_t));
+            *(unsigned char*)&last = (unsigned char)(range - 1);
+        }
+        logged = snapshot->start;
+        visited = 0;
+        for(;;)
+        {
+            /* Count the matching triples removed since the snapshot was
+               opened in the groups of the range not visited yet; the index
+               no longer shows them. Triples of visited groups were counted
+               when they were visited. */
+            end = model->undo_first + model->undo_size;
+            for(; logged < end; ++logged)
+            {
+                record = &model->undo[logged - model->undo_first];
+                node = record->entry.triple.nodes[position];
+                if( !record->added && record->previous < snapshot->start &&
+                    matches_pattern(&record->entry.triple, pattern) &&
+                    *(unsigned char*)&node == range &&
+                    memcmp(&node, &last, sizeof(nid_t)) > 0 )
+                {
+                    add_node_count( &batch, &batch_size, &batch_capacity,
+                                    NULL, node, 1 );
+                }
+            }
 
-        if(permutation & 2)
-            entry.triple.nodes[1] = triple.nodes[1];
+            /* Find the next group, after all entries with the last node. */
+            entry.triple = *pattern;
+            entry.triple.nodes[position] = last;
+            for(n = position + 1; n < 3; ++n)
+                memset(&entry.triple.nodes[n], 0xFF, sizeof(nid_t));
+            memset(&entry.index, 0xFF, sizeof(entry.index));
+            make_entry_key(model, &entry, key_data, &key);
+            result = seek_entry(model, &key, R_CURSOR, &found_entry, &found);
+            if( result != 0 ||
+                memcmp(found, pattern, position*sizeof(nid_t)) != 0 ||
+                *(unsigned char*)&found->triple.nodes[position] != range )
+            {
+                break;
+            }
+            last = found->triple.nodes[position];
+
+            /* Count the entries of the triples matching the pattern with
+               this node, which are consecutive. */
+            entry.triple = *pattern;
+            entry.triple.nodes[position] = last;
+            entry.index = 0;
+            make_entry_key(model, &entry, key_data, &key);
+            result = seek_entry(model, &key, R_CURSOR, &found_entry, &found);
+            for(count = 0; result == 0 &&
+                           TRIPLE_IS_EQUAL(found->triple, entry.triple); )
+            {
+                if( !is_tombstone(model, found->index) &&
+                    !is_changed_since(snapshot, found->index) )
+                {
+                    ++count;
+                }
+                ++visited;
+                result = seek_entry( model, &key, R_NEXT,
+                                     &found_entry, &found );
+            }
+            if(count > 0)
+            {
+                add_node_count( &batch, &batch_size, &batch_capacity,
+                                NULL, last, count );
+            }
+
+            /* Let writers and other threads in now and then. */
+            if(visited >= SCAN_BATCH)
+            {
+                MUTEX_UNLOCK(model->triples_index_mutex);
+                for(n = 0; n < batch_size; ++n)
+                {
+                    add_node_count( &thread->counts, &thread->size,
+                                    &thread->capacity, &groups,
+                                    batch[n].node, batch[n].count );
+                }
+                batch_size = 0;
+                visited = 0;
+                MUTEX_LOCK(model->triples_index_mutex);
+            }
+        }
+    }
+    MUTEX_UNLOCK(model->triples_index_mutex);
+
+    for(n = 0; n < batch_size; ++n)
+    {
+        add_node_count( &thread->counts, &thread->size, &thread->capacity,
+                        &groups, batch[n].node, batch[n].count );
+    }
+    free(batch);
+    ht_destroy(&groups);
+
+    return NULL;
+}
+
+
+node_count_t *group_snapshot_triples( snapshot_handle snapshot,
+                                      triple_t *pattern, int position,
+                                      unsigned top, unsigned threads,
+                                      unsigned *size )
+{
+    group_scan_t scan;
+    group_counts_t *counted;
+    node_count_t *counts;
+    unsigned n;
+
+    assert(position >= 0 && position < 3);
+    assert(NID_IS_NULL(pattern->nodes[position]));
+
+#ifdef THREADSAFE
+    if(threads > GROUP_RANGES)
+        threads = GROUP_RANGES;
+    if(threads == 0)
+        threads = 1;
+#else
+    threads = 1;
+#endif
+    scan.snapshot = snapshot;
+    scan.pattern = pattern;
+    scan.position = position;
+    scan.next_range = 0;
+    counted = (group_counts_t*)malloc(threads*sizeof(group_counts_t));
+    assert(counted);
+    for(n = 0; n < threads; ++n)
+    {
+        counted[n].scan = &scan;
+        counted[n].counts = NULL;
+        counted[n].size = counted[n].capacity = 0;
+    }
+
+    /* The calling thread counts ranges along with the others. */
+#ifdef THREADSAFE
+    for(n = 1; n < threads; ++n)
+    {
+        int result = pthread_create( &counted[n].thread, NULL,
+                                     count_group_ranges, &counted[n] );
+        assert(result == 0);
+    }
+#endif
+    count_group_ranges(&counted[0]);
+#ifdef THREADSAFE
+    for(n = 1; n < threads; ++n)
+    {
+        int result = pthread_join(counted[n].thread, NULL);
+        assert(result == 0);
+    }
+#endif
+
+    /* The threads counted disjoint ranges of nodes, so their counts are
+       merged by concatenating them. */
+    counts = counted[0].counts;
+    *size = counted[0].size;
+    for(n = 1; n < threads; ++n)
+    {
+        if(counted[n].size > 0)
+        {
+            counts = (node_count_t*)realloc( counts,
+                (*size + counted[n].size)*sizeof(node_count_t) );
+            assert(counts);
+            memcpy( counts + *size, counted[n].counts,
+                    counted[n].size*sizeof(node_count_t) );
+            *size += counted[n].size;
+        }
+        free(counted[n].counts);
+    }
+    free(counted);
+
+    if(top > 0)
+    {
+        select_top_counts(counts, *size, top);
+        if(*size > top)
+            *size = top;
+    }
+
+    return counts;
+}
+
+
+node_count_t *group_triples( model_handle model, triple_t *pattern,
+                             int position, unsigned top, unsigned threads,
+                             unsigned *size )
+{
+    snapshot_handle snapshot;
+    node_count_t *counts;
+    stats_timer_t timer;
+
+    STATS_START(timer);
+    snapshot = open_snapshot(model);
+    counts = group_snapshot_triples( snapshot, pattern, position,
+                                     top, threads, size );
+    close_snapshot(snapshot);
+
+    STATS_OPERATION(STATS_OP_GROUP_TRIPLES, timer);
+    return counts;
+}
+
+
+/*  Marks a node as visited in a path traversal. Returns 1 if the node was
+    visited before, or 0 otherwise. Dictionary nodes are tracked in a bitmap
+    indexed by node index; other nodes in a hash table. */
+static int visit_path_node(path_t *path, nid_t nid)
+{
+    unsigned byte, size;
+
+    if(nid.flags != 0)
+    {
+        if(path->visited_other == NULL)
+        {
+            path->visited_other = (ht_t*)malloc(sizeof(ht_t));
+            assert(path->visited_other);
+            ht_create(path->visited_other, hash_fnv1);
+        }
+        if(ht_get(path->visited_other, &nid, sizeof(nid), NULL) != NULL)
+            return 1;
+        ht_put(path->visited_other, &nid, sizeof(nid), "", 1);
+        return 0;
+    }
+
+    byte = nid.index / 8;
+    if(byte >= path->visited_size)
+    {
+        /* Grow bitmap to cover the node, at least doubling its size. */
+        size = 2*path->visited_size;
+        if(size <= byte)
+            size = byte + 1;
+        path->visited = (unsigned char*)realloc(path->visited, size);
+        assert(path->visited);
+        memset(path->visited + path->visited_size, 0, size - path->visited_size);
+        path->visited_size = size;
+    }
+    if(path->visited[byte] & (1 << (nid.index % 8)))
+        return 1;
+    path->visited[byte] |= 1 << (nid.index % 8);
+    return 0;
+}
+
+
+static int compare_nids(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(nid_t));
+}
+
+
+/*  Replaces the current level of a path traversal with the unvisited nodes
+    reachable from it in one step. */
+static void expand_path_level(path_t *path)
+{
+    nid_t *next, nid;
+    triple_t triple;
+    unsigned *triple_indices;
+    unsigned next_size, next_capacity, indices_size, n;
+    triple_entry_t entry, found_entry;
+    const triple_entry_t *found;
+    unsigned char key_data[COMPACT_KEY_SIZE];
+    int result, inverse;
+    DBT key, value;
+
+    inverse = (path->flags & PATH_INVERSE) != 0;
+
+    /* Sort the level, so the model index is scanned in key order. */
+    qsort(path->level, path->level_size, sizeof(nid_t), compare_nids);
+
+    next_capacity = path->level_size + 16;
+    next = (nid_t*)malloc(next_capacity * sizeof(nid_t));
+    assert(next);
+    next_size = 0;
+    triple_indices = NULL;
+    indices_size = 0;
+
+    MUTEX_LOCK(path->model->triples_index_mutex);
+    fold_tombstones(path->model, 0);
+    for(n = 0; n < path->level_size; ++n)
+    {
+        /* Forward traversal uses the (node, predicate, object) entries,
+           which follow the (node, predicate, null) entries. Inverse traversal
+           uses the (null, predicate, node) entries, which do not include the
+           subject; the triples are resolved after the scan. */
+        NID_SET_NULL(entry.triple.nodes[0]);
+        entry.triple.nodes[1] = path->predicate;
+        NID_SET_NULL(entry.triple.nodes[2]);
+        if(inverse)
+        {
+            entry.triple.nodes[2] = path->level[n];
+            entry.index = 0;
+        }
         else
-            NID_SET_NULL(entry.triple.nodes[1]);
+        {
+            entry.triple.nodes[0] = path->level[n];
+            entry.index = (unsigned)-1;
+        }
+        make_entry_key(path->model, &entry, key_data, &key);
+
+        result = path->model->triples_index->seq(
+            path->model->triples_index, &key, &value, R_CURSOR );
+        while(result == 0)
+        {
+            found = read_entry_key(path->model, &key, &found_entry);
+            if( !NID_IS_EQUAL(found->triple.nodes[0], entry.triple.nodes[0]) ||
+                !NID_IS_EQUAL(found->triple.nodes[1], path->predicate) )
+            {
+                break;
+            }
 
-        if(permutation & 4)
-            entry.triple.nodes[2] = triple.nodes[2];
-        else
-            NID_SET_NULL(entry.triple.nodes[2]);
+            if(inverse)
+            {
+                if(!NID_IS_EQUAL(found->triple.nodes[2], path->level[n]))
+                    break;
+                triple_indices = (unsigned*)realloc( triple_indices,
+                    (indices_size + 1) * sizeof(unsigned) );
+                assert(triple_indices);
+                triple_indices[indices_size++] = found->index;
+            }
+            else
+            if( !NID_IS_NULL(found->triple.nodes[2]) &&
+                !visit_path_node(path, found->triple.nodes[2]) )
+            {
+                if(next_size == next_capacity)
+                {
+                    next_capacity *= 2;
+                    next = (nid_t*)realloc(next, next_capacity * sizeof(nid_t));
+                    assert(next);
+                }
+                next[next_size++] = found->triple.nodes[2];
+            }
 
-        result = model->triples_index->del(
-            model->triples_index, &key, 0);
+            result = path->model->triples_index->seq(
+                path->model->triples_index, &key, &value, R_NEXT );
+        }
         assert(result == 0 || result == 1);
     }
-    MUTEX_UNLOCK(model->triples_index_mutex);
-    
-    return (result == 0) ? 1 : 0;
+    MUTEX_UNLOCK(path->model->triples_index_mutex);
+
+    /* Resolve subjects of triples found in an inverse traversal. */
+    for(n = 0; n < indices_size; ++n)
+    {
+        nid.index = triple_indices[n];
+        nid.flags = NID_FTRIPLE;
+        triple = resolve_triple(nid);
+        nid = triple.nodes[0];
+        if(!visit_path_node(path, nid))
+        {
+            if(next_size == next_capacity)
+            {
+                next_capacity *= 2;
+                next = (nid_t*)realloc(next, next_capacity * sizeof(nid_t));
+                assert(next);
+            }
+            next[next_size++] = nid;
+        }
+    }
+    free(triple_indices);
+
+    free(path->level);
+    path->level = next;
+    path->level_size = next_size;
+    path->position = 0;
+    ++path->depth;
 }
 
 
-nid_t find_triple(model_handle model, triple_t *pattern, nid_t previous)
+path_handle open_path( model_handle model, nid_t start, nid_t predicate,
+                       unsigned flags, unsigned max_depth )
+{
+    path_t *path;
+
+    assert(!NID_IS_NULL(start) && !NID_IS_NULL(predicate));
+
+    path = (path_t*)malloc(sizeof(path_t));
+    assert(path);
+    path->model = model;
+    path->predicate = predicate;
+    path->flags = flags;
+    path->max_depth = max_depth;
+    path->depth = 0;
+    path->visited = NULL;
+    path->visited_size = 0;
+    path->visited_other = NULL;
+
+    /* The start node forms level 0; it is only returned (and marked visited)
+       when zero-length paths are included. */
+    path->level = (nid_t*)malloc(sizeof(nid_t));
+    assert(path->level);
+    path->level[0] = start;
+    path->level_size = 1;
+    path->position = 1;
+    if(flags & PATH_ZERO_OR_MORE)
+    {
+        visit_path_node(path, start);
+        path->position = 0;
+    }
+
+    return path;
+}
+
+
+nid_t next_path_node(path_handle path)
 {
     nid_t nid;
-    triple_entry_t entry;
-    int result;
-    DBT key, value;
-    
-    assert(NID_IS_NULL(previous) || NID_IS_TRIPLE(previous));
 
-    entry.triple = *pattern;
-    entry.index  = previous.index + 1;
-    
-    key.data = &entry;
-    key.size = sizeof(entry);
-    
-    MUTEX_LOCK(model->triples_index_mutex);
-    result = model->triples_index->seq( model->triples_index,
-                                        &key, &value, R_CURSOR );
-    assert(result == 0 || result == 1);
-    assert(result != 0 || key.size == sizeof(triple_entry_t));
+    while( path->position == path->level_size && path->level_size > 0 &&
+           (path->max_depth == 0 || path->depth < path->max_depth) )
+    {
+        expand_path_level(path);
+    }
 
-    if( result == 0 &&
-        TRIPLE_IS_EQUAL(((triple_entry_t *)key.data)->triple, *pattern) )
+    if(path->position < path->level_size)
     {
-        /* Next triple found. */
-        nid.index = ((triple_entry_t *)key.data)->index;
-        nid.flags = NID_FTRIPLE;
+        nid = path->level[path->position++];
     }
     else
     {
-        /* No more triples found. */
         NID_SET_NULL(nid);
     }
-    MUTEX_UNLOCK(model->triples_index_mutex);
 
     return nid;
 }
 
 
+void close_path(path_handle path)
+{
+    if(path->visited_other != NULL)
+    {
+        ht_destroy(path->visited_other);
+        free(path->visited_other);
+    }
+    free(path->visited);
+    free(path->level);
+    free(path);
+}
+
+
 unsigned empty_model(model_handle model)
 {
+    triple_entry_t entry;
+    const triple_entry_t *found;
+    DBT key, value;
     int result;
     unsigned removed;
+    stats_timer_t timer;
     
+    STATS_START(timer);
+    assert(!model->read_only);
     MUTEX_LOCK(model->triples_index_mutex);
+    fold_tombstones(model, 0);
     removed = 0;
     while((result = model->triples_index->seq( model->triples_index,
-                                               NULL, NULL, R_FIRST )) == 0)
+                                               &key, &value, R_FIRST )) == 0)
     {
-        ++removed;
+        found = read_entry_key(model, &key, &entry);
+        if(is_primary_entry(found))
+        {
+            ++removed;
+            log_change(model, CHANGE_REMOVE, found->index);
+        }
         model->triples_index->del(model->triples_index, NULL, R_CURSOR);
     }
     assert(result == 1);
+    while((result = model->values_index->seq( model->values_index,
+                                              &key, &value, R_FIRST )) == 0)
+    {
+        model->values_index->del(model->values_index, NULL, R_CURSOR);
+    }
+    assert(result == 1);
+    if(model->filter != NULL)
+    {
+        memset(model->filter->bits, 0, (model->filter->size + 7)/8);
+        model->filter->triples = model->filter->removed = 0;
+    }
     MUTEX_UNLOCK(model->triples_index_mutex);
 
+    STATS_OPERATION(STATS_OP_EMPTY_MODEL, timer);
     return removed;
 }
 
 
 void absorb_model(model_handle destination, model_handle source)
 {
-    DBT key, value;
+    triple_entry_t found_entry;
+    const triple_entry_t *entry;
+    unsigned char typed_value[TYPED_VALUE_SIZE], key_data[COMPACT_KEY_SIZE];
+    DBT source_key, key, value;
     int result;
+    stats_timer_t timer;
     
+    STATS_START(timer);
+    assert(!destination->read_only);
+
     /* Lock models in fixed order, to avoid dead-locks. */
     if(source->triples_index < destination->triples_index)
     {
@@ -577,22 +4800,651 @@ void absorb_model(model_handle destination, model_handle source)
     else
     {
         /* Handles are identical. */
+        STATS_OPERATION(STATS_OP_ABSORB_MODEL, timer);
         return;
     }
-    
-    /* Copy triple index contents of source model to destination model. */
+
+    /* Copy triple index contents of source model to destination model,
+       converting keys if only one of the models uses compact keys. Removed
+       triples of the source model whose entries were not deleted yet are
+       skipped, so that the source model is not modified. */
+    fold_tombstones(destination, 0);
     result = source->triples_index->seq( source->triples_index,
-                                         &key, &value, R_FIRST );
+                                         &source_key, &value, R_FIRST );
     while(result == 0)
     {
-        destination->triples_index->put( destination->triples_index,
-                                         &key, &value, 0 );
+        entry = read_entry_key(source, &source_key, &found_entry);
+        make_entry_key(destination, entry, key_data, &key);
+        if( !is_tombstone(source, entry->index) &&
+            destination->triples_index->put( destination->triples_index,
+                                             &key, &value, R_NOOVERWRITE )
+                == 0 )
+        {
+            if(is_primary_entry(entry))
+            {
+                log_change(destination, CHANGE_ADD, entry->index);
+            }
+            else
+            if( !NID_IS_NULL(entry->triple.nodes[0]) &&
+                !NID_IS_NULL(entry->triple.nodes[1]) &&
+                NID_TYPE(entry->triple.nodes[2]) != 0 )
+            {
+                /* A fully bound entry contains the complete triple, from
+                   which the value index entries are derived. */
+                resolve_typed(entry->triple.nodes[2], typed_value);
+                update_value_index( destination, &entry->triple,
+                                    entry->index, typed_value, 1 );
+            }
+            if( destination->filter != NULL &&
+                is_bound_triple(&entry->triple) )
+            {
+                add_filter_triple(destination->filter, &entry->triple);
+            }
+        }
         result = source->triples_index->seq( source->triples_index,
-                                             &key, &value, R_NEXT );
+                                             &source_key, &value, R_NEXT );
     }
     assert(result == 1);
+    if( destination->filter != NULL &&
+        destination->filter->triples > destination->filter->capacity )
+    {
+        build_filter(destination);
+    }
 
     /* Unlock models; order does not matter. */        
     MUTEX_UNLOCK(source->triples_index_mutex);
     MUTEX_UNLOCK(destination->triples_index_mutex);
+
+    STATS_OPERATION(STATS_OP_ABSORB_MODEL, timer);
+}
+
+
+/*  State used to throttle the I/O rate of a backup. */
+typedef struct throttle
+{
+    unsigned long bandwidth;    /* bytes per second, or 0 if unlimited */
+    double bytes;               /* bytes written so far */
+    struct timeval start;
+} throttle_t;
+
+
+/*  Accounts for 'bytes' bytes written, and sleeps if necessary to keep the
+    average rate below the throttle's bandwidth. */
+static void throttle_io(throttle_t *throttle, size_t bytes)
+{
+    struct timeval now, delay;
+    double elapsed, expected;
+
+    if(throttle->bandwidth == 0)
+        return;
+
+    throttle->bytes += bytes;
+    expected = throttle->bytes / throttle->bandwidth;
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - throttle->start.tv_sec) +
+              (now.tv_usec - throttle->start.tv_usec) / 1e6;
+    if(expected > elapsed + 0.01)
+    {
+        delay.tv_sec  = (long)(expected - elapsed);
+        delay.tv_usec = (long)((expected - elapsed - delay.tv_sec) * 1e6);
+        select(0, NULL, NULL, NULL, &delay);
+    }
+}
+
+
+/*  Creates a database for a backup file in the backup directory. Returns
+    NULL if the file could not be created. */
+static DB *open_backup_database( const char *directory, const char *filename,
+                                 DBTYPE type )
+{
+    char *path;
+    DB *db;
+
+    path = (char*)malloc(strlen(directory) + strlen(filename) + 2);
+    assert(path);
+    sprintf(path, "%s/%s", directory, filename);
+    db = dbopen(path, O_CREAT | O_TRUNC | O_EXLOCK | O_RDWR, 0600, type, NULL);
+    free(path);
+
+    return db;
+}
+
+
+/*  Closes a backup database. */
+static void close_backup_database(DB *db)
+{
+    int result;
+
+    result = db->close(db);
+    assert(result == 0);
+}
+
+
+/*  Writes a snapshot of a model to the backup directory, and closes the
+    snapshot. The model's change log and history are copied up to change
+    'last_change', the last change included in the snapshot. */
+static int backup_model( const char *directory, snapshot_t *snapshot,
+                         recno_t last_change, throttle_t *throttle )
+{
+    model_t *model;
+    recno_t recno;
+    const triple_t *triple;
+    triple_t pattern, triples[SCAN_BATCH];
+    removal_t *entries;
+    unsigned char typed_value[TYPED_VALUE_SIZE], key_data[VALUE_KEY_SIZE],
+                  entry_key_data[COMPACT_KEY_SIZE];
+    nid_t predicate, previous, nids[SCAN_BATCH];
+    char *filename;
+    DB *triples_index, *values_index, *changes, *history_index, *versions;
+    DBT key, value;
+    version_range_t *ranges, *history_ranges[SCAN_BATCH];
+    unsigned history_indices[SCAN_BATCH], history_counts[SCAN_BATCH];
+    unsigned n, m, count, last_index;
+    int result, status;
+
+    model = snapshot->model;
+    status = -1;
+    triples_index = values_index = changes = history_index = versions = NULL;
+
+    filename = model_filename( model->name, model->compact ?
+                               COMPACT_INDEX_SUFFIX : TRIPLES_INDEX_SUFFIX );
+    triples_index = open_backup_database(directory, filename, DB_BTREE);
+    free(filename);
+    filename = model_filename(model->name, "_values_index.db");
+    values_index = open_backup_database(directory, filename, DB_BTREE);
+    free(filename);
+    if(model->changes != NULL)
+    {
+        filename = model_filename(model->name, "_changes.db");
+        changes = open_backup_database(directory, filename, DB_RECNO);
+        free(filename);
+    }
+    if(model->versions != NULL)
+    {
+        filename = model_filename(model->name, "_history_index.db");
+        history_index = open_backup_database(directory, filename, DB_BTREE);
+        free(filename);
+        filename = model_filename(model->name, "_versions.db");
+        versions = open_backup_database(directory, filename, DB_BTREE);
+        free(filename);
+    }
+    if( triples_index == NULL || values_index == NULL ||
+        (model->changes != NULL && changes == NULL) ||
+        ( model->versions != NULL &&
+          (history_index == NULL || versions == NULL) ) )
+    {
+        goto cleanup;
+    }
+
+    /* Copy the triples in the snapshot a batch at a time, regenerating
+       their index entries and value index entries. The all-null pattern
+       matches every triple once. */
+    TRIPLE_SET_NULL(pattern);
+    NID_SET_NULL(previous);
+    do
+    {
+        MUTEX_LOCK(model->triples_index_mutex);
+        count = scan_triples( model, snapshot, &pattern, &previous,
+                              SCAN_BATCH, nids );
+        MUTEX_UNLOCK(model->triples_index_mutex);
+
+        /* prepare_removals() yields the index entries in key order. */
+        entries = prepare_removals(nids, count, triples);
+        value.data = NULL;
+        value.size = 0;
+        for(n = 0; n < 8*count; ++n)
+        {
+            make_entry_key(model, &entries[n].entry, entry_key_data, &key);
+            result = triples_index->put(triples_index, &key, &value, 0);
+            assert(result == 0);
+            throttle_io(throttle, sizeof(triple_entry_t));
+
+            triple = &triples[entries[n].position];
+            if( !is_primary_entry(&entries[n].entry) ||
+                NID_TYPE(triple->nodes[2]) == 0 )
+            {
+                continue;
+            }
+            resolve_typed(triple->nodes[2], typed_value);
+            key.data = key_data;
+            key.size = VALUE_KEY_SIZE;
+            make_value_key( key_data, triple->nodes[1], typed_value,
+                            entries[n].entry.index );
+            result = values_index->put(values_index, &key, &value, 0);
+            assert(result == 0);
+            NID_SET_NULL(predicate);
+            make_value_key( key_data, predicate, typed_value,
+                            entries[n].entry.index );
+            result = values_index->put(values_index, &key, &value, 0);
+            assert(result == 0);
+        }
+        free(entries);
+    } while(count == SCAN_BATCH);
+
+    /* Copy the change log. */
+    for(recno = 1; recno <= last_change; ++recno)
+    {
+        key.data = &recno;
+        key.size = sizeof(recno);
+        MUTEX_LOCK(model->triples_index_mutex);
+        result = model->changes->get(model->changes, &key, &value, 0);
+        assert(result == 0);
+        result = changes->put(changes, &key, &value, 0);
+        assert(result == 0);
+        MUTEX_UNLOCK(model->triples_index_mutex);
+        throttle_io(throttle, value.size);
+    }
+
+    /* Copy the history up to the last change copied, a batch of triples at
+       a time. A batch is read while the model is locked and written after
+       the lock is released, so that throttling does not block the model. */
+    result = versions != NULL ? 0 : 1;
+    last_index = 0;
+    for(n = 0; result == 0; n += m)
+    {
+        MUTEX_LOCK(model->triples_index_mutex);
+        if(n == 0)
+        {
+            result = model->versions->seq( model->versions,
+                                           &key, &value, R_FIRST );
+        }
+        else
+        {
+            /* Resume after the last triple copied. */
+            key.data = &last_index;
+            key.size = sizeof(last_index);
+            result = model->versions->seq( model->versions,
+                                           &key, &value, R_CURSOR );
+            if( result == 0 &&
+                memcmp(key.data, &last_index, sizeof(last_index)) == 0 )
+            {
+                result = model->versions->seq( model->versions,
+                                               &key, &value, R_NEXT );
+            }
+        }
+
+        for(m = 0; m < SCAN_BATCH && result == 0; ++m)
+        {
+            memcpy(&last_index, key.data, sizeof(last_index));
+            history_indices[m] = last_index;
+            history_ranges[m] = (version_range_t*)malloc(value.size);
+            assert(history_ranges[m]);
+            memcpy(history_ranges[m], value.data, value.size);
+            ranges = history_ranges[m];
+            for(count = 0; count < value.size/sizeof(version_range_t) &&
+                           ranges[count].added <= last_change; ++count)
+            {
+                if(ranges[count].removed > last_change)
+                    ranges[count].removed = 0;
+            }
+            history_counts[m] = count;
+            result = model->versions->seq( model->versions,
+                                           &key, &value, R_NEXT );
+        }
+        assert(result == 0 || result == 1);
+        MUTEX_UNLOCK(model->triples_index_mutex);
+
+        for(count = 0; count < m; ++count)
+        {
+            if(history_counts[count] > 0)
+            {
+                key.data = &history_indices[count];
+                key.size = sizeof(history_indices[count]);
+                value.data = history_ranges[count];
+                value.size = history_counts[count]*sizeof(version_range_t);
+                result = versions->put(versions, &key, &value, 0);
+                assert(result == 0);
+                update_history_index( model, history_index,
+                                      history_indices[count], 1 );
+                throttle_io(throttle, value.size);
+            }
+            free(history_ranges[count]);
+        }
+        result = m == SCAN_BATCH ? 0 : 1;
+    }
+
+    status = 0;
+
+cleanup:
+    if(triples_index != NULL)
+        close_backup_database(triples_index);
+    if(values_index != NULL)
+        close_backup_database(values_index);
+    if(changes != NULL)
+        close_backup_database(changes);
+    if(history_index != NULL)
+        close_backup_database(history_index);
+    if(versions != NULL)
+        close_backup_database(versions);
+    close_snapshot(snapshot);
+
+    return status;
+}
+
+
+/*  Copies the first 'last' records of a dictionary to the backup directory,
+    and rebuilds the dictionary index from them. */
+static int backup_dictionary( const char *directory, int is_nodes,
+                              recno_t last, throttle_t *throttle )
+{
+    DB *source, *dictionary, *index;
+    DBT key, value;
+    recno_t recno;
+    int result;
+
+    source = is_nodes ? nodes : triples;
+    dictionary = open_backup_database( directory,
+        is_nodes ? "nodes.db" : "triples.db", DB_RECNO );
+    index = open_backup_database( directory,
+        is_nodes ? "nodes_index.db" : "triples_index.db", DB_HASH );
+    if(dictionary == NULL || index == NULL)
+    {
+        if(dictionary != NULL)
+            close_backup_database(dictionary);
+        if(index != NULL)
+            close_backup_database(index);
+        return -1;
+    }
+
+    for(recno = 1; recno <= last; ++recno)
+    {
+        key.data = &recno;
+        key.size = sizeof(recno);
+
+        /* Records are immutable once written, but the database handle is
+           shared with concurrent writers. */
+        if(is_nodes)
+        {
+            MUTEX_LOCK(nodes_mutex);
+        }
+        else
+        {
+            MUTEX_LOCK(triples_mutex);
+        }
+        result = source->get(source, &key, &value, 0);
+        assert(result == 0);
+        result = dictionary->put(dictionary, &key, &value, 0);
+        assert(result == 0);
+        result = index->put(index, &value, &key, 0);
+        assert(result == 0);
+        if(is_nodes)
+        {
+            MUTEX_UNLOCK(nodes_mutex);
+        }
+        else
+        {
+            MUTEX_UNLOCK(triples_mutex);
+        }
+        throttle_io(throttle, value.size + sizeof(recno));
+    }
+
+    close_backup_database(dictionary);
+    close_backup_database(index);
+
+    return 0;
+}
+
+
+/*  Copies the prefix table to the backup directory. Prefixes are added
+    before the nodes that use them, so this must be called after the node
+    dictionary has been copied. */
+static int backup_prefixes(const char *directory, throttle_t *throttle)
+{
+    DB *destination;
+    DBT key, value;
+    recno_t recno;
+    size_t bytes;
+    int result;
+
+    destination = open_backup_database(directory, "prefixes.db", DB_RECNO);
+    if(destination == NULL)
+        return -1;
+
+    bytes = 0;
+    MUTEX_LOCK(nodes_mutex);
+    for(recno = 1; recno <= prefix_count; ++recno)
+    {
+        key.data = &recno;
+        key.size = sizeof(recno);
+        value.data = prefix_table[recno - 1].data;
+        value.size = prefix_table[recno - 1].size;
+        result = destination->put(destination, &key, &value, 0);
+        assert(result == 0);
+        bytes += value.size + sizeof(recno);
+    }
+    MUTEX_UNLOCK(nodes_mutex);
+    throttle_io(throttle, bytes);
+    close_backup_database(destination);
+
+    return 0;
+}
+
+
+/*  Copies a search index database to the backup directory, omitting entries
+    for dictionary nodes beyond 'last'. The search index is copied in chunks,
+    so that identify_node() is not blocked for long. */
+static int backup_search_index( const char *directory, DB *source,
+                                const char *filename, recno_t last,
+                                throttle_t *throttle )
+{
+    DB *destination;
+    DBT key, value;
+    void *last_key;
+    size_t last_key_size;
+    nid_t nid;
+    unsigned n;
+    int result;
+
+    destination = open_backup_database(directory, filename, DB_BTREE);
+    if(destination == NULL)
+        return -1;
+
+    last_key = NULL;
+    last_key_size = 0;
+    do {
+        MUTEX_LOCK(search_index_mutex);
+        if(last_key == NULL)
+        {
+            result = source->seq(source, &key, &value, R_FIRST);
+        }
+        else
+        {
+            /* Resume after the last key copied. */
+            key.data = last_key;
+            key.size = last_key_size;
+            result = source->seq(source, &key, &value, R_CURSOR);
+            if( result == 0 && key.size == last_key_size &&
+                memcmp(key.data, last_key, last_key_size) == 0 )
+            {
+                result = source->seq(source, &key, &value, R_NEXT);
+            }
+        }
+
+        for(n = 0; n < 1024 && result == 0; ++n)
+        {
+            assert(key.size >= sizeof(nid_t));
+            memcpy(&nid, (char*)key.data + key.size - sizeof(nid_t), sizeof(nid));
+            if(nid.flags != 0 || nid.index <= last)
+            {
+                result = destination->put(destination, &key, &value, 0);
+                assert(result == 0);
+                throttle_io(throttle, key.size);
+            }
+
+            last_key = realloc(last_key, key.size);
+            assert(last_key);
+            memcpy(last_key, key.data, key.size);
+            last_key_size = key.size;
+
+            result = source->seq(source, &key, &value, R_NEXT);
+        }
+        assert(result == 0 || result == 1);
+        MUTEX_UNLOCK(search_index_mutex);
+    } while(result == 0);
+
+    free(last_key);
+    close_backup_database(destination);
+
+    return 0;
+}
+
+
+/*  A model to be backed up, with a snapshot of it and the last change of
+    its change log included in the snapshot. */
+typedef struct backup_source
+{
+    model_t *model;
+    snapshot_t *snapshot;
+    recno_t last_change;
+} backup_source_t;
+
+
+/*  Orders models to be backed up in the order in which they are locked. */
+static int compare_backup_sources(const void *a, const void *b)
+{
+    const DB *db_a, *db_b;
+
+    db_a = ((const backup_source_t*)a)->model->triples_index;
+    db_b = ((const backup_source_t*)b)->model->triples_index;
+
+    return db_a < db_b ? -1 : db_a > db_b ? 1 : 0;
+}
+
+
+int tripledb_backup(const char *directory, unsigned long bandwidth)
+{
+    const char *prefix = "model_", *suffix;
+    throttle_t throttle;
+    DIR *dir;
+    struct dirent *dirent;
+    size_t length;
+    char *name, *encoded, *path;
+    backup_source_t *sources;
+    model_t *model;
+    unsigned count, capacity, n;
+    recno_t backup_last_node, backup_last_triple;
+    int status;
+
+    throttle.bandwidth = bandwidth;
+    throttle.bytes = 0;
+    gettimeofday(&throttle.start, NULL);
+
+    /* Open all named models in the current directory. */
+    dir = opendir(".");
+    if(dir == NULL)
+        return -1;
+    sources = NULL;
+    count = capacity = 0;
+    while((dirent = readdir(dir)) != NULL)
+    {
+        /* Every model has either kind of triple index. */
+        length = strlen(dirent->d_name);
+        suffix = TRIPLES_INDEX_SUFFIX;
+        if( length > strlen(suffix) &&
+            strcmp(dirent->d_name + length - strlen(suffix), suffix) != 0 )
+        {
+            suffix = COMPACT_INDEX_SUFFIX;
+        }
+        if( length <= strlen(prefix) + strlen(suffix) ||
+            strncmp(dirent->d_name, prefix, strlen(prefix)) != 0 ||
+            strcmp(dirent->d_name + length - strlen(suffix), suffix) != 0 )
+        {
+            continue;
+        }
+
+        encoded = (char*)malloc(length + 1);
+        assert(encoded);
+        strcpy(encoded, dirent->d_name + strlen(prefix));
+        encoded[length - strlen(prefix) - strlen(suffix)] = '\0';
+        name = (char*)malloc(urldecoded_length(encoded) + 1);
+        assert(name);
+        urldecode(name, encoded);
+        if(count == capacity)
+        {
+            capacity = 2*capacity + 8;
+            sources = (backup_source_t*)realloc( sources,
+                capacity*sizeof(backup_source_t) );
+            assert(sources);
+        }
+        sources[count++].model = open_model(name);
+        free(name);
+        free(encoded);
+    }
+    closedir(dir);
+
+    /* Snapshot all models and find the last node and triple in a single
+       critical section, so that the backup holds the state of the whole
+       database at one point in time. Models are locked in a fixed order,
+       as in absorb_model(). Triples are created only after their nodes, so
+       the last node is determined after the last triple. */
+    if(count > 1)
+        qsort(sources, count, sizeof(backup_source_t), compare_backup_sources);
+    for(n = 0; n < count; ++n)
+        MUTEX_LOCK(sources[n].model->triples_index_mutex);
+    for(n = 0; n < count; ++n)
+    {
+        /* The snapshot takes over the model reference. */
+        model = sources[n].model;
+        sources[n].snapshot = take_snapshot(model);
+        sources[n].last_change =
+            model->changes != NULL ? model->last_change : 0;
+    }
+    MUTEX_LOCK(triples_mutex);
+    backup_last_triple = read_only ? last_record(triples) : last_triple;
+    MUTEX_UNLOCK(triples_mutex);
+    MUTEX_LOCK(nodes_mutex);
+    backup_last_node = read_only ? last_record(nodes) : last_node;
+    MUTEX_UNLOCK(nodes_mutex);
+    for(n = 0; n < count; ++n)
+        MUTEX_UNLOCK(sources[n].model->triples_index_mutex);
+
+    /* Copy the models; all triples they reference are in the dictionaries
+       up to the last triple. */
+    status = 0;
+    for(n = 0; n < count; ++n)
+    {
+        if(status == 0)
+        {
+            status = backup_model( directory, sources[n].snapshot,
+                                   sources[n].last_change, &throttle );
+        }
+        else
+        {
+            close_snapshot(sources[n].snapshot);
+        }
+    }
+    free(sources);
+    if(status != 0)
+        return status;
+
+    if( backup_dictionary(directory, 0, backup_last_triple, &throttle) != 0 ||
+        backup_dictionary(directory, 1, backup_last_node, &throttle) != 0 ||
+        (prefixes != NULL && backup_prefixes(directory, &throttle) != 0) )
+    {
+        return -1;
+    }
+    if(!short_nodes_stored)
+    {
+        path = (char*)malloc( strlen(directory) +
+                              strlen(INLINE_NODES_MARKER) + 2 );
+        assert(path);
+        sprintf(path, "%s/%s", directory, INLINE_NODES_MARKER);
+        status = create_empty_file(path);
+        free(path);
+        if(status != 0)
+            return -1;
+    }
+
+    if(nodes_prefix_index != NULL)
+    {
+        if( backup_search_index( directory, nodes_prefix_index,
+                "nodes_prefix_index.db", backup_last_node, &throttle ) != 0 ||
+            backup_search_index( directory, nodes_trigram_index,
+                "nodes_trigram_index.db", backup_last_node, &throttle ) != 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
 }
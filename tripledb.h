@@ -7,6 +7,7 @@ extern "C" {
 
 
 #include <stddef.h>
+#include <time.h>
 
 /*  A node identifier; this should be treated as an opaque data structure.
     Some macros are provided that operate on its contents.  */
@@ -28,6 +29,36 @@ typedef struct triple
 typedef struct model *model_handle;
 
 
+/*  A path traversal handle. */
+typedef struct path *path_handle;
+
+
+/*  A model snapshot handle. */
+typedef struct snapshot *snapshot_handle;
+
+
+/*  A node and the number of triples it occurs in, as returned by
+    group_triples(). */
+typedef struct node_count
+{
+    nid_t node;
+    unsigned count;
+} node_count_t;
+
+
+/*  An entry in a model's change log. */
+typedef struct change
+{
+    unsigned sequence;  /* monotonically increasing sequence number */
+    unsigned operation; /* CHANGE_ADD or CHANGE_REMOVE */
+    nid_t nid;          /* triple node identifier */
+} change_t;
+
+/*  Change log operations. */
+#define CHANGE_ADD      1
+#define CHANGE_REMOVE   2
+
+
 /*  Some macro's for manipulating the datatypes declared above follow. */
 
 /* Determines if a node identifier is the NULL node identifier. */
@@ -50,6 +81,38 @@ typedef struct model *model_handle;
 #define NID_IS_TRIPLE(nid) \
     (nid.flags & NID_FTRIPLE)
 
+/*  Flag to indicate a node identifier contains its node data inline, instead
+    of referring to an entry in the node dictionary. */
+#define NID_FINLINE \
+    ((unsigned)2)
+
+/*  The maximum size of node data that is stored inline in a node identifier.
+    The first four bytes are stored in the index field; the remaining bytes
+    are stored in the upper three bytes of the flags field, and the data size
+    in bits 2 through 4 of the flags field. */
+#define NID_INLINE_MAX \
+    7
+
+/* Determines if a node identifier contains its node data inline. */
+#define NID_IS_INLINE(nid) \
+    ((nid).flags & NID_FINLINE)
+
+/*  Flag to indicate a node identifier refers to a typed literal node. The
+    literal type (one of the NID_TYPE_ constants below) is stored in bits 6
+    and 7 of the flags field. */
+#define NID_FTYPED \
+    ((unsigned)32)
+
+/*  Literal types of typed literal nodes. */
+#define NID_TYPE_INTEGER    1
+#define NID_TYPE_DOUBLE     2
+#define NID_TYPE_DATETIME   3
+
+/*  Returns the literal type of a node identifier, or 0 if it does not refer to
+    a typed literal node. */
+#define NID_TYPE(nid) \
+    (((nid).flags & NID_FTYPED) ? (((nid).flags >> 6) & 3) : 0)
+
 /* Determines if two triples are equal (ie. their respective nodes are equal).
    */
 #define TRIPLE_IS_EQUAL(triple_a, triple_b) \
@@ -59,7 +122,52 @@ typedef struct model *model_handle;
       
 #define TRIPLE_SET_NULL(triple) \
     { NID_SET_NULL((triple).nodes[0]); NID_SET_NULL((triple).nodes[1]); \
-      NID_SET_NULL((triple).nodes[0]); }
+      NID_SET_NULL((triple).nodes[2]); }
+
+
+/*  Options that may be passed to tripledb_initialize_options(). */
+typedef struct tripledb_options
+{
+    unsigned flags;
+    unsigned long cache_size;   /* page cache budget in bytes, or 0 */
+} tripledb_options_t;
+
+/*  Flag to maintain a search index over node data, as used by
+    find_node_prefix() and find_node_substring(). Once created, the search
+    index is maintained regardless of this flag. Node data stored inline in
+    node identifiers (see NID_INLINE_MAX) is indexed once a triple uses it;
+    typed literal nodes are not indexed. */
+#define TRIPLEDB_FSEARCH_INDEX \
+    ((unsigned)1)
+
+/*  Flag to open an existing store for reading only, with shared locks, so
+    that several processes can read it concurrently. In read-only mode:
+    - identify_node(), identify_triple() and the identify_ functions for typed
+      literals return the null node identifier for nodes not in the store;
+    - named models can not be modified, and a model that does not exist is
+      opened as an empty model;
+    - the search index is used only if it was created before. */
+#define TRIPLEDB_FREAD_ONLY \
+    ((unsigned)2)
+
+/*  Flag to store the triple index of newly created models with compact keys.
+    Every key is encoded with variable-length integers, which takes about half
+    the space of the fixed 28-byte key for typical node identifiers, so more
+    of a model fits in the page cache. Existing models keep the format they
+    were created with, which is recognized by their file name. */
+#define TRIPLEDB_FCOMPACT_INDEX \
+    ((unsigned)4)
+
+/*  Flag to compress IRI prefixes in a newly created node dictionary. The
+    namespace of stored node data that starts with an IRI scheme, such as
+    "http:" (everything up to the last '/' or '#', if that is long enough),
+    is replaced with a number from a prefix table that
+    is learned as nodes are added and kept in prefixes.db. This is
+    transparent to identify_node() and resolve_node(). Once created, the
+    prefix table is used regardless of this flag; the flag has no effect on
+    an existing node dictionary without one. */
+#define TRIPLEDB_FPREFIX_NODES \
+    ((unsigned)8)
 
 
 /*  Initializes the triple database. Before this function is called, no other
@@ -67,6 +175,128 @@ typedef struct model *model_handle;
 void tripledb_initialize();
 
 
+/*  Initializes the triple database like tripledb_initialize(), using the
+    given options. 'options' may be NULL to use the default options.
+
+    If 'cache_size' is nonzero, it is the total amount of memory used for
+    database page caches. Half of it is divided among the dictionary
+    databases; the other half is a pool from which every newly opened model
+    receives half of the remaining memory, which is returned when the model is
+    closed. If 'cache_size' is zero, every database uses the default cache.
+
+    The pool is thus split by the order in which models are opened, not
+    evenly: of models opened one after another, the first receives half of
+    the pool, the second a quarter, and so on. The size of a model's cache is
+    fixed while it is open, so memory returned by a closed model only goes
+    to models opened later. Models that are used most should be opened
+    first. The history databases of a model (see enable_history()) take
+    another eighth of its share each from the pool when they are opened. */
+void tripledb_initialize_options(const tripledb_options_t *options);
+
+
+/*  Page cache memory allocation, as returned by get_cache_stats(). */
+typedef struct cache_stats
+{
+    unsigned long budget;        /* total cache budget (0 if not managed) */
+    unsigned long dictionaries;  /* assigned to the dictionary databases */
+    unsigned long models;        /* assigned to open models */
+    unsigned long available;     /* not assigned */
+    unsigned open_models;        /* number of open models */
+} cache_stats_t;
+
+
+/*  Stores the current page cache memory allocation in 'stats'. */
+void get_cache_stats(cache_stats_t *stats);
+
+
+/*  Returns the amount of page cache memory assigned to an open model, or 0 if
+    the model uses the default cache. */
+unsigned long get_model_cache_size(model_handle model);
+
+
+/*  Operations whose calls are counted and timed by tripledb_stats(). */
+#define STATS_OP_OPEN_MODEL          0
+#define STATS_OP_CLOSE_MODEL         1
+#define STATS_OP_IDENTIFY_NODE       2
+#define STATS_OP_IDENTIFY_TRIPLE     3
+#define STATS_OP_RESOLVE_NODE        4
+#define STATS_OP_RESOLVE_TRIPLE      5
+#define STATS_OP_ADD_TRIPLE          6
+#define STATS_OP_REMOVE_TRIPLE       7
+#define STATS_OP_FIND_TRIPLE         8
+#define STATS_OP_FIND_DISTINCT       9
+#define STATS_OP_FIND_TRIPLE_RANGE  10
+#define STATS_OP_OPEN_SNAPSHOT      11
+#define STATS_OP_FIND_TRIPLES       12
+#define STATS_OP_GROUP_TRIPLES      13
+#define STATS_OP_EMPTY_MODEL        14
+#define STATS_OP_ABSORB_MODEL       15
+#define STATS_OP_REMOVE_TRIPLES     16
+#define STATS_OPERATIONS            17
+
+/*  Databases whose accesses are counted. The databases of all models are
+    counted together. */
+#define STATS_DB_NODES               0
+#define STATS_DB_NODES_INDEX         1
+#define STATS_DB_TRIPLES             2
+#define STATS_DB_TRIPLES_INDEX       3
+#define STATS_DB_SEARCH_INDEX        4  /* prefix and trigram index */
+#define STATS_DB_MODEL_TRIPLES       5  /* triple indices of models */
+#define STATS_DB_MODEL_VALUES        6  /* value indices of models */
+#define STATS_DB_MODEL_CHANGES       7  /* change logs of models */
+#define STATS_DB_MODEL_HISTORY       8  /* history databases of models */
+#define STATS_DATABASES              9
+
+/*  Locks whose waits are measured. The locks of all models are measured
+    together. */
+#define STATS_LOCK_NODES             0
+#define STATS_LOCK_NODES_INDEX       1
+#define STATS_LOCK_TRIPLES           2
+#define STATS_LOCK_TRIPLES_INDEX     3
+#define STATS_LOCK_MODELS            4
+#define STATS_LOCK_SEARCH_INDEX      5
+#define STATS_LOCK_MODEL             6
+#define STATS_LOCKS                  7
+
+/*  Number of buckets in a latency histogram. Latencies are measured in
+    nanoseconds; every power of two is divided into 8 buckets, so a bucket
+    covers latencies within 12.5% of each other. Latencies below 8ns each have
+    their own bucket, and the last bucket holds all latencies of 2^32ns
+    (about 4.3s) or more. */
+#define STATS_LATENCY_BUCKETS      240
+
+/*  Operation statistics, as returned by tripledb_stats(). */
+typedef struct tripledb_stats
+{
+    int enabled;    /* 0 if the library was built without TRIPLEDB_STATS */
+    unsigned long calls[STATS_OPERATIONS];
+    unsigned long latency[STATS_OPERATIONS][STATS_LATENCY_BUCKETS];
+    unsigned long gets[STATS_DATABASES];
+    unsigned long puts[STATS_DATABASES];
+    unsigned long seqs[STATS_DATABASES];
+    unsigned long dels[STATS_DATABASES];
+    unsigned long lock_waits[STATS_LOCKS];      /* contended acquisitions */
+    double lock_wait_time[STATS_LOCKS];         /* seconds spent waiting */
+} tripledb_stats_t;
+
+
+/*  Stores the operation statistics gathered since the process started in
+    'stats'. Statistics are only gathered if the library is compiled with
+    TRIPLEDB_STATS defined; otherwise, all statistics are zero.
+
+    Every thread counts its own operations, so gathering them adds no
+    contention; they are added up when this function is called. Only locks
+    that could not be acquired immediately count as waits. */
+void tripledb_stats(tripledb_stats_t *stats);
+
+
+/*  Returns the latency in nanoseconds below which the given percentage of
+    calls to an operation completed, rounded up to the end of its histogram
+    bucket, or 0 if the operation was not called. */
+unsigned long stats_percentile( const tripledb_stats_t *stats,
+                                unsigned operation, double percentage );
+
+
 /*  Finalizes the triple database. After this function is called, no other
     functions declared here may be called. Any open handles and borrowed memory
     buffers must be released before calling this function. */
@@ -89,7 +319,12 @@ void close_model(model_handle model);
 
 
 /*  Returns a unique identifier for the given node data. Subsequent calls to
-    this function with the same data will return the same identifier. */
+    this function with the same data will return the same identifier.
+
+    Node data of at most NID_INLINE_MAX bytes is packed into the identifier
+    itself and never stored in the node dictionary. In a store created before
+    inline nodes were introduced, such data that is in the node dictionary
+    already keeps its dictionary identifier. */
 nid_t identify_node(const void *data, size_t size);
 
 
@@ -98,6 +333,23 @@ nid_t identify_node(const void *data, size_t size);
 nid_t identify_triple(triple_t *triple);
 
 
+/*  Returns the typed literal node identifier for an integer, floating point
+    or date/time value. Subsequent calls with the same value return the same
+    identifier. Typed literal nodes are stored in the node dictionary in an
+    encoding that sorts like their values; this is what resolve_node() returns
+    for them. */
+nid_t identify_integer(long value);
+nid_t identify_double(double value);
+nid_t identify_datetime(time_t value);
+
+
+/*  Returns the value of a typed literal node. 'nid' must be a typed literal
+    node identifier of the matching type. */
+long resolve_integer(nid_t nid);
+double resolve_double(nid_t nid);
+time_t resolve_datetime(nid_t nid);
+
+
 /*  Returns the node data for the non-triple node identifier 'nid'.
     
     If 'data' is not NULL, '*size' should contain the size of the data buffer.
@@ -112,6 +364,25 @@ nid_t identify_triple(triple_t *triple);
 const void *resolve_node(nid_t nid, void *data, size_t *size);
 
 
+/*  Finds a node whose data starts with the 'size' bytes at 'prefix'.
+    Requires the search index (see TRIPLEDB_FSEARCH_INDEX).
+
+    Matching nodes are returned in order of their node data. 'previous' must
+    be set to either the node identifier returned by the previous call, or
+    to the null node identifier to find the first match. If no (more)
+    matching nodes were found, the null node identifier is returned. */
+nid_t find_node_prefix(const void *prefix, size_t size, nid_t previous);
+
+
+/*  Finds a node whose data contains the 'size' bytes at 'substring',
+    ignoring the case of ASCII letters. Requires the search index (see
+    TRIPLEDB_FSEARCH_INDEX).
+
+    Matching nodes are returned in no particular order. 'previous' is used as
+    with find_node_prefix(). */
+nid_t find_node_substring(const void *substring, size_t size, nid_t previous);
+
+
 /*  Frees the data returned by resolve_node. */
 void free_data(const void *data);
 
@@ -124,6 +395,112 @@ void free_data(const void *data);
 triple_t resolve_triple(nid_t nid);
 
 
+/*  Determines if 'nid' is a node identifier returned by one of the identify
+    functions (in this or an earlier session of the store), so that it can be
+    passed to the functions above. Returns 0 for the null node identifier.
+    Intended for node identifiers received from untrusted sources; the other
+    functions assume their arguments are valid. */
+int is_valid_nid(nid_t nid);
+
+
+/*  Enables the change log of the given model. From now on, every triple
+    added to or removed from the model by add_triple(), remove_triple(),
+    empty_model() or absorb_model() is recorded with a new sequence number.
+    
+    The change log of a named model is stored with the model and is reopened
+    automatically by open_model(); it does not need to be enabled again. */
+void enable_change_log(model_handle model);
+
+
+/*  Retrieves the first change recorded in the change log of the given model
+    with a sequence number greater than 'sequence'.
+    
+    Returns 1 and stores the change in '*change' if one was found, or 0 if no
+    (more) changes were found or the change log is not enabled.
+    
+    Typically, this function is used in a loop:
+        change_t change;
+        unsigned sequence = -- last sequence number processed, or 0 --;
+        while(next_change(model, sequence, &change))
+        {
+            -- process change --
+            sequence = change.sequence;
+        }
+    */
+int next_change(model_handle model, unsigned sequence, change_t *change);
+
+
+/*  Enables the history of the given model, which also enables its change log.
+    From now on, the model records for every triple the versions at which it
+    was added and removed, so that find_triple_as_of() can return the
+    triples of any earlier version. A version is a change log sequence
+    number: version v is the contents of the model after change v was made.
+    Triples already in the model when the history is enabled are recorded
+    as added at the current version.
+
+    The history of a named model is stored with the model and is reopened
+    automatically by open_model(); it does not need to be enabled again. */
+void enable_history(model_handle model);
+
+
+/*  Returns the current version of the given model: the sequence number of
+    the last change in its change log, or 0 if it is not enabled. To query
+    the model as it is now at a later time, record this number. */
+unsigned current_version(model_handle model);
+
+
+/*  Finds a triple matching 'pattern' in the given model as it was at
+    'version', like find_triple(). The history of the model must be enabled
+    (see enable_history()); versions before it was enabled contain only the
+    triples it was enabled with, and versions before the one passed to
+    prune_history() lack the triples removed before that version. */
+nid_t find_triple_as_of( model_handle model, triple_t *pattern,
+                         nid_t previous, unsigned version );
+
+
+/*  Discards the history of the given model before 'version': triples that
+    were removed at or before 'version' are forgotten, so that
+    find_triple_as_of() remains exact only for 'version' and later versions.
+    This is the retention policy of a history; for example, a daily job
+    could prune everything before the version recorded 30 days ago. */
+void prune_history(model_handle model, unsigned version);
+
+
+/*  Enables a Bloom filter over the triples in the given model. With the
+    filter, find_triple() with a pattern that has all three nodes bound and
+    remove_triple() return at once for almost all triples that are not in
+    the model, without searching the model's index. The filter takes about
+    10 bits per triple; about 1% of the triples not in the model still need a
+    search. It is resized as the model grows and rebuilt after many triples
+    were removed.
+
+    The filter of a named model is saved with the model when it is closed,
+    and is loaded automatically by open_model(); it does not need to be
+    enabled again. If the model was not closed properly, the filter is
+    rebuilt from the model when it is loaded. */
+void enable_triple_filter(model_handle model);
+
+
+/*  Enables deferred removal for the given open model. From now on,
+    remove_triple() and remove_triples() do not delete the index entries of
+    a triple, but record a tombstone for it, which find_triple() skips. The
+    tombstones are folded into the model's index by compact_model(), which
+    is started on a background thread once many tombstones have been
+    recorded, and which runs before any other operation that reads the index
+    and when the model is closed.
+
+    Tombstones are kept in memory only: removals made since the last
+    compaction are lost if the process exits without closing the model. */
+void enable_deferred_removal(model_handle model);
+
+
+/*  Folds the tombstones of a model with deferred removal into its index (see
+    enable_deferred_removal()). The tombstones are folded in batches, so the
+    model can be used by other threads meanwhile. Has no effect on a model
+    without deferred removal. */
+void compact_model(model_handle model);
+
+
 /*  Adds a triple in the given model. If the triple already exists, no
     modifications are made. 'model' must be a valid model handle, 'triple'
     must be a triple node identifier.
@@ -141,6 +518,15 @@ unsigned add_triple(model_handle model, nid_t nid);
 unsigned remove_triple(model_handle model, nid_t nid);
 
 
+/*  Removes 'count' triples from the given model, like calling
+    remove_triple() for each of them. The index entries of all triples are
+    sorted and deleted in index order, which touches every index page once
+    instead of once per triple.
+
+    Returns the number of triples removed. */
+unsigned remove_triples(model_handle model, const nid_t *nids, unsigned count);
+
+
 /*  Finds a node in the model (given by the valid model handle 'model'), which
     matches the pattern specified in the pointer to the triple structure
     'pattern'. Each of the three fields in this triple may be set to either a
@@ -171,6 +557,216 @@ unsigned remove_triple(model_handle model, nid_t nid);
 nid_t find_triple(model_handle model, triple_t *pattern, nid_t previous);
 
 
+/*  Finds a distinct node at position 'position' (0 for the subject, 1 for
+    the predicate or 2 for the object) of the triples in the model that match
+    'pattern'. The node at this position in 'pattern' must be the null node
+    identifier.
+
+    Each distinct node is returned once, in no particular order. Rather than
+    visiting every matching triple, the model index is searched once or twice
+    per distinct node, so this is efficient even if each node occurs in
+    many triples. 'previous' is used as with find_triple(), but refers to the
+    node returned by the previous call. */
+nid_t find_distinct( model_handle model, triple_t *pattern, int position,
+                     nid_t previous );
+
+
+/*  Finds a triple in the model whose object is a typed literal node with a
+    value in the range from 'low' to 'high' (inclusive). 'low' and 'high' must
+    be typed literal node identifiers of the same type. If 'predicate' is not
+    the null node identifier, only triples with this predicate are matched.
+
+    Unlike find_triple(), matching triples are returned in order of increasing
+    object value, by scanning a value-ordered index that each model maintains
+    for triples with typed literal objects.
+
+    'previous' must be set to either the triple node identifier returned by the
+    previous call, or to the null node identifier to find the first match.
+    If no (more) matching nodes were found, the null node identifier is
+    returned. */
+nid_t find_triple_range( model_handle model, nid_t predicate,
+                         nid_t low, nid_t high, nid_t previous );
+
+
+/*  Returns a snapshot of the current contents of the given model, which must
+    be released with close_snapshot(). The snapshot is not affected by
+    subsequent modifications of the model, and may be used even after the
+    model handle is closed.
+
+    Opening a snapshot copies nothing. A snapshot searches the model index
+    itself, and undoes the changes made since it was opened: while snapshots
+    of a model are open, every change is also appended to an undo log, which
+    is discarded once the oldest snapshot using it is closed. Searches lock
+    the model for a batch of triples at a time, so long scans only briefly
+    block writers to the model. The memory used by a snapshot is
+    proportional to the number of changes made since it was opened, plus
+    one node identifier per 256 matches for its rank checkpoints (see
+    find_snapshot_triples()). */
+snapshot_handle open_snapshot(model_handle model);
+
+
+/*  Releases a snapshot handle returned by open_snapshot(). */
+void close_snapshot(snapshot_handle snapshot);
+
+
+/*  Finds a triple in a snapshot, like find_triple() does in a model. */
+nid_t find_snapshot_triple( snapshot_handle snapshot, triple_t *pattern,
+                            nid_t previous );
+
+
+/*  Returns the number of triples in a snapshot that match 'pattern'.
+
+    The first call for a pattern visits all matches, and records rank
+    checkpoints for them (see find_snapshot_triples()); later calls for the
+    same pattern return the number recorded. */
+unsigned count_snapshot_triples(snapshot_handle snapshot, triple_t *pattern);
+
+
+/*  Stores the node identifiers of at most 'limit' triples in a snapshot that
+    match 'pattern' in 'nids', skipping the first 'offset' matches. Matches
+    are returned in the order in which find_snapshot_triple() returns them.
+    Returns the number of identifiers stored.
+
+    The snapshot keeps rank checkpoints for each pattern it is searched
+    with: the position of every 256th match, which are recorded as matches
+    are visited. A page is found by seeking to the last checkpoint before
+    'offset' and skipping less than 256 matches, so pages can be requested
+    in any order. Only matches beyond the last checkpoint are visited to add
+    checkpoints. The checkpoints are kept until the snapshot is closed. */
+unsigned find_snapshot_triples( snapshot_handle snapshot, triple_t *pattern,
+                                unsigned offset, unsigned limit, nid_t *nids );
+
+
+/*  Stores the node identifiers of at most 'limit' triples in a model that
+    match 'pattern' and follow 'previous' in 'nids', in the order in which
+    find_triple() returns them. 'previous' is either the last triple of the
+    previous batch, or the null node identifier to start at the first match.
+    Returns the number of identifiers stored, which is less than 'limit' only
+    if no more triples match.
+
+    The model is locked once, and its index is searched once per batch
+    rather than once per triple; as with find_triple(), a pattern with all
+    nodes bound is first checked against the triple filter of the model,
+    if any. A model keeps no rank checkpoints, so batches continue from a
+    previous triple rather than an offset; to page by offset, use
+    find_snapshot_triples() on a snapshot. */
+unsigned find_triples( model_handle model, triple_t *pattern,
+                       nid_t previous, unsigned limit, nid_t *nids );
+
+
+/*  Groups the triples in a snapshot that match 'pattern' by their node at
+    position 'position' (0 for the subject, 1 for the predicate or 2 for the
+    object), which must be the null node identifier in 'pattern', and counts
+    the triples in each group.
+
+    If 'top' is 0, the counts of all groups are returned in no particular
+    order. Otherwise, only the 'top' groups with the largest counts are
+    returned, in order of decreasing count.
+
+    The index is scanned a group at a time, searching for the start of the
+    next group rather than visiting every triple. The nodes are divided into
+    256 ranges by the first byte of their identifiers, which are counted by
+    up to 'threads' threads (including the calling thread), and the counts
+    of the threads are merged before the top groups are selected. Reading
+    the index of a model is serialized, so threads overlap counting with
+    each other's index reads rather than reading the index concurrently.
+
+    Returns an array of node counts which must be freed with free_data(), and
+    sets '*size' to the number of counts in it. */
+node_count_t *group_snapshot_triples( snapshot_handle snapshot,
+                                      triple_t *pattern, int position,
+                                      unsigned top, unsigned threads,
+                                      unsigned *size );
+
+
+/*  Number of triples that next_partition_triple() fetches from the index of
+    a model at a time. */
+#define PARTITION_BATCH 256
+
+/*  A part of the triples matching a pattern in a snapshot, as returned by
+    partition_snapshot(). */
+typedef struct snapshot_partition
+{
+    triple_t pattern;
+    nid_t previous;         /* last triple fetched, or the null node */
+    unsigned remaining;     /* number of triples not fetched yet */
+    nid_t batch[PARTITION_BATCH];   /* triples fetched */
+    unsigned batch_size, batch_position;  /* next triple of 'batch' */
+} snapshot_partition_t;
+
+
+/*  Splits the triples in a snapshot that match 'pattern' into at most
+    'count' partitions of nearly equal size, which are stored in
+    'partitions'. Returns the number of partitions stored, which is less than
+    'count' only if fewer than 'count' triples match.
+
+    Every matching triple is in exactly one partition. The partitions are
+    separated at index keys found from the snapshot's rank checkpoints (see
+    find_snapshot_triples()); the first partitioning, counting or paging of
+    a pattern visits all its matches once to record them. Each partition
+    starts at the last checkpoint before it, skipping fewer than 256
+    matches. */
+unsigned partition_snapshot( snapshot_handle snapshot, triple_t *pattern,
+                             snapshot_partition_t *partitions,
+                             unsigned count );
+
+
+/*  Returns the next triple in a partition returned by partition_snapshot(),
+    and advances the partition past it. Returns the null node identifier if
+    no more triples remain in the partition.
+
+    Partitions can be iterated concurrently, e.g. by a thread per partition,
+    as each one continues from its own last triple. A batch of
+    PARTITION_BATCH triples is fetched with the model locked and a single
+    search of its index; the triples of a batch are then returned without
+    locking, so threads only contend for the index while fetching. */
+nid_t next_partition_triple( snapshot_handle snapshot,
+                             snapshot_partition_t *partition );
+
+
+/*  Like group_snapshot_triples(), on a snapshot of the current contents of
+    the given model (see open_snapshot()). */
+node_count_t *group_triples( model_handle model, triple_t *pattern,
+                             int position, unsigned top, unsigned threads,
+                             unsigned *size );
+
+
+/*  Flags for open_path(). */
+
+/*  Include the start node itself (at depth 0) in a traversal; otherwise it is
+    only included if it can be reached from itself. */
+#define PATH_ZERO_OR_MORE \
+    ((unsigned)1)
+
+/*  Follow triples from object to subject, instead of subject to object. */
+#define PATH_INVERSE \
+    ((unsigned)2)
+
+
+/*  Starts a traversal of the nodes reachable from node 'start' by following
+    one or more triples with predicate 'predicate' in the given model. If
+    'max_depth' is not 0, only nodes reachable in at most 'max_depth' steps
+    are returned. 'flags' is a combination of the PATH_ flags defined above.
+
+    The nodes are expanded breadth-first, a level at a time: the nodes in each
+    level are sorted and looked up in a single pass over the model index. Each
+    reachable node is returned only once.
+
+    Returns a path handle that must be released with close_path(). */
+path_handle open_path( model_handle model, nid_t start, nid_t predicate,
+                       unsigned flags, unsigned max_depth );
+
+
+/*  Returns the next node reachable in the given path traversal, or the null
+    node identifier if no more nodes are reachable. Nodes are returned in
+    order of increasing depth. */
+nid_t next_path_node(path_handle path);
+
+
+/*  Releases a path traversal handle returned by open_path(). */
+void close_path(path_handle path);
+
+
 /*  Removes all triples from the given model.
     Returns the number of triples removed. */
 unsigned empty_model(model_handle model);
@@ -178,10 +774,37 @@ unsigned empty_model(model_handle model);
 
 /*  Adds all triples in the model referenced by 'source' to the model
     referenced by 'destination'. The destination model may be expanded but
-    the source model is never modified. */
+    the source model is never modified. Both models are locked while the
+    index of the source model is copied. */
 void absorb_model(model_handle destination, model_handle source);
 
 
+/*  Writes a consistent copy of the triple database, including all named
+    models stored in the current directory, to the existing directory
+    'directory'. Other threads may continue to use and modify the database
+    while the backup is made.
+
+    Snapshots of all models (see open_snapshot()) are taken at the same
+    time as the last node and triple in the dictionaries are determined,
+    while all models are locked. The models are then copied from their
+    snapshots, and the dictionaries up to the last node and triple. Since
+    dictionaries are only appended to, this yields the state of the whole
+    database at the time the snapshots were taken.
+
+    The copy is logical, made record by record: model indices are
+    regenerated from the triples in the snapshots, and dictionary indices
+    are rebuilt rather than copied. A backup therefore takes time
+    proportional to the size of the database, during which writers to the
+    models also log their changes for the snapshots. Anonymous models and
+    models created after the backup started are not copied.
+
+    If 'bandwidth' is not 0, the backup is throttled to write approximately
+    'bandwidth' bytes per second.
+
+    Returns 0 on success, or -1 if the backup files could not be created. */
+int tripledb_backup(const char *directory, unsigned long bandwidth);
+
+
 #ifdef __cplusplus
 }
 #endif
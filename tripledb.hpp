@@ -0,0 +1,406 @@
+#ifndef TRIPLEDB_HPP_INCLUDED
+#define TRIPLEDB_HPP_INCLUDED
+
+#include "tripledb.h"
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <string_view>
+#include <utility>
+
+/*  C++17 interface to the triple database (header only).
+
+    The store, models, snapshots and node data returned by resolve_node() are
+    wrapped in move-only types that release them when they go out of scope.
+    Triples matching a pattern are iterated with a range-based for loop:
+
+        tripledb::store store;
+        tripledb::model model("example");
+        nid_t knows = tripledb::identify("knows");
+        for(nid_t triple : model.find<tripledb::predicate>(knows))
+            ...
+
+    The template argument of find() names the bound positions of the pattern
+    (a combination of subject, predicate and object), and the arguments are
+    the nodes at those positions, in order. The matches are looked up a
+    batch at a time with find_triples() (or find_snapshot_triples() on a
+    snapshot), which lock the model and search its index once per batch, so
+    that most steps of the iteration only read the next identifier from a
+    buffer. */
+
+namespace tripledb {
+
+/*  Positions of a triple, which are combined in the 'Bound' argument of the
+    templates below. */
+enum position : unsigned
+{
+    subject = 1,
+    predicate = 2,
+    object = 4,
+    all = subject | predicate | object
+};
+
+
+/*  The null node identifier. */
+inline constexpr nid_t null_nid = { 0, 0 };
+
+
+/*  Returns the node identifier for node data (see identify_node()). */
+inline nid_t identify(std::string_view data)
+{
+    return identify_node(data.data(), data.size());
+}
+
+
+/*  Returns the triple node identifier for a triple (see identify_triple()). */
+inline nid_t identify(nid_t subject, nid_t predicate, nid_t object)
+{
+    triple_t triple = { { subject, predicate, object } };
+
+    return identify_triple(&triple);
+}
+
+
+/*  Initializes the triple database on construction, and finalizes it on
+    destruction. Only one store may exist at a time, and all other objects
+    declared here must be destroyed before it. */
+class store
+{
+public:
+    explicit store(unsigned flags = 0, unsigned long cache_size = 0)
+    {
+        tripledb_options_t options = { flags, cache_size };
+
+        tripledb_initialize_options(&options);
+    }
+
+    store(store &&other) noexcept
+        : owner_(std::exchange(other.owner_, false)) { }
+
+    store(const store &) = delete;
+    store &operator=(const store &) = delete;
+    store &operator=(store &&) = delete;
+
+    ~store()
+    {
+        if(owner_)
+            tripledb_finalize();
+    }
+
+private:
+    bool owner_ = true;
+};
+
+
+/*  The data of a node, as returned by resolve_node(), which is freed on
+    destruction. */
+class node_data
+{
+public:
+    explicit node_data(nid_t nid)
+    {
+        data_ = resolve_node(nid, nullptr, &size_);
+    }
+
+    node_data(node_data &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)) { }
+
+    node_data &operator=(node_data &&other) noexcept
+    {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    node_data(const node_data &) = delete;
+    node_data &operator=(const node_data &) = delete;
+
+    ~node_data()
+    {
+        if(data_ != nullptr)
+            free_data(data_);
+    }
+
+    const void *data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    /*  Returns the data as characters, which remain valid as long as this
+        object exists. */
+    std::string_view view() const
+    {
+        return std::string_view(static_cast<const char *>(data_), size_);
+    }
+
+private:
+    const void *data_;
+    std::size_t size_;
+};
+
+
+/*  Returns the data of a node. */
+inline node_data resolve(nid_t nid)
+{
+    return node_data(nid);
+}
+
+
+/*  A triple pattern with the positions in 'Bound' bound to the nodes given
+    on construction, in order, and the other positions null. The number of
+    nodes is checked at compile time, and that none of them is null on
+    construction: the null positions of a pattern select the entries of the
+    model index that are searched, so they are fixed to those outside
+    'Bound' once the pattern is built. */
+template<unsigned Bound>
+class pattern
+{
+    static_assert(Bound <= all, "invalid bound positions");
+
+public:
+    /*  The number of bound positions. */
+    static constexpr std::size_t size =
+        (Bound & 1) + ((Bound >> 1) & 1) + ((Bound >> 2) & 1);
+
+    template<class... Nodes>
+    explicit pattern(Nodes... nodes)
+    {
+        static_assert( sizeof...(Nodes) == size,
+                       "one node is needed for every bound position" );
+        std::array<nid_t, size> bound = { { nodes... } };
+        std::size_t next = 0;
+
+        for(unsigned n = 0; n < 3; ++n)
+        {
+            if(Bound & (1u << n))
+            {
+                triple_.nodes[n] = bound[next++];
+                assert(!NID_IS_NULL(triple_.nodes[n]));
+            }
+            else
+                triple_.nodes[n] = null_nid;
+        }
+    }
+
+    const triple_t &triple() const { return triple_; }
+    triple_t *get() { return &triple_; }
+
+private:
+    triple_t triple_;
+};
+
+
+/*  The triples matching a pattern in a model or snapshot, which can be
+    iterated once with a range-based for loop. A range on a model iterates
+    over its current contents; triples added or removed during the
+    iteration may or may not be returned. */
+template<unsigned Bound>
+class matches
+{
+public:
+    /*  Number of triples looked up at once. */
+    static constexpr unsigned batch_size = 256;
+
+    /*  Marks the end of a range. */
+    struct sentinel { };
+
+    class iterator
+    {
+    public:
+        explicit iterator(matches *range) : range_(range) { }
+
+        nid_t operator*() const
+        {
+            return range_->batch_[range_->position_];
+        }
+
+        iterator &operator++()
+        {
+            if(++range_->position_ == range_->size_ && !range_->exhausted_)
+                range_->fill();
+            return *this;
+        }
+
+        bool operator!=(sentinel) const
+        {
+            return range_->position_ < range_->size_;
+        }
+
+        bool operator==(sentinel end) const
+        {
+            return !(*this != end);
+        }
+
+    private:
+        matches *range_;
+    };
+
+    matches(model_handle model, const pattern<Bound> &pattern)
+        : pattern_(pattern), model_(model), snapshot_(nullptr)
+    {
+        fill();
+    }
+
+    matches(snapshot_handle snapshot, const pattern<Bound> &pattern)
+        : pattern_(pattern), model_(nullptr), snapshot_(snapshot)
+    {
+        fill();
+    }
+
+    /*  Ranges are returned by value only through copy elision, since
+        iterators refer to them. */
+    matches(const matches &) = delete;
+    matches &operator=(const matches &) = delete;
+
+    iterator begin() { return iterator(this); }
+    sentinel end() const { return sentinel(); }
+
+    /*  Determines if no (more) triples match. */
+    bool empty() const { return position_ == size_; }
+
+private:
+    /*  Looks up the next batch of matches, after the last triple of the
+        current batch in a model, or at the next offset in a snapshot. Since
+        batches of a snapshot start at multiples of its checkpoint interval,
+        each one starts at the checkpoint recorded by the previous one. At
+        most one triple matches a pattern with all positions bound. */
+    void fill()
+    {
+        constexpr unsigned limit = Bound == all ? 1 : batch_size;
+
+        if(model_ != nullptr)
+        {
+            nid_t previous = size_ > 0 ? batch_[size_ - 1] : null_nid;
+
+            size_ = find_triples( model_, pattern_.get(), previous, limit,
+                                  batch_.data() );
+        }
+        else
+        {
+            offset_ += size_;
+            size_ = find_snapshot_triples( snapshot_, pattern_.get(), offset_,
+                                           limit, batch_.data() );
+        }
+        position_ = 0;
+        exhausted_ = Bound == all || size_ < batch_size;
+    }
+
+    pattern<Bound> pattern_;
+    model_handle model_;
+    snapshot_handle snapshot_;
+    unsigned size_ = 0, position_ = 0, offset_ = 0;
+    bool exhausted_ = false;
+    std::array<nid_t, batch_size> batch_;
+};
+
+
+/*  A model, which is opened on construction and closed on destruction. */
+class model
+{
+public:
+    /*  Opens the named model, or a new anonymous model if 'name' is
+        nullptr. */
+    explicit model(const char *name) : handle_(open_model(name))
+    {
+        assert(handle_ != nullptr);
+    }
+
+    model(model &&other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)) { }
+
+    model &operator=(model &&other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+
+    model(const model &) = delete;
+    model &operator=(const model &) = delete;
+
+    ~model()
+    {
+        if(handle_ != nullptr)
+            close_model(handle_);
+    }
+
+    model_handle get() const { return handle_; }
+
+    bool add(nid_t triple) { return add_triple(handle_, triple) != 0; }
+    bool remove(nid_t triple) { return remove_triple(handle_, triple) != 0; }
+
+    unsigned remove(const nid_t *triples, unsigned count)
+    {
+        return remove_triples(handle_, triples, count);
+    }
+
+    /*  Returns the triples matching the pattern with the positions in
+        'Bound' bound to 'nodes'. */
+    template<unsigned Bound, class... Nodes>
+    matches<Bound> find(Nodes... nodes) const
+    {
+        return matches<Bound>(handle_, pattern<Bound>(nodes...));
+    }
+
+    bool contains(nid_t subject, nid_t predicate, nid_t object) const
+    {
+        return !find<all>(subject, predicate, object).empty();
+    }
+
+private:
+    model_handle handle_;
+};
+
+
+/*  A snapshot of a model, which is taken on construction and released on
+    destruction (see open_snapshot()). */
+class snapshot
+{
+public:
+    explicit snapshot(const model &model) : handle_(open_snapshot(model.get()))
+    {
+    }
+
+    snapshot(snapshot &&other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)) { }
+
+    snapshot &operator=(snapshot &&other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+
+    ~snapshot()
+    {
+        if(handle_ != nullptr)
+            close_snapshot(handle_);
+    }
+
+    snapshot_handle get() const { return handle_; }
+
+    /*  Returns the triples matching a pattern, like model::find(). The
+        range must not outlive the snapshot. */
+    template<unsigned Bound, class... Nodes>
+    matches<Bound> find(Nodes... nodes) const
+    {
+        return matches<Bound>(handle_, pattern<Bound>(nodes...));
+    }
+
+    /*  Returns the number of triples matching a pattern. */
+    template<unsigned Bound, class... Nodes>
+    unsigned count(Nodes... nodes) const
+    {
+        pattern<Bound> pattern(nodes...);
+
+        return count_snapshot_triples(handle_, pattern.get());
+    }
+
+private:
+    snapshot_handle handle_;
+};
+
+}  // namespace tripledb
+
+#endif /* ndef TRIPLEDB_HPP_INCLUDED */
@@ -72,7 +72,7 @@ void urlencode(char *dst, const char *src)
 
 void urldecode(char *dst, const char *src)
 {
-    for( ; *src; ++src)
+    while(*src)
     {
         if( src[0] == '%' &&
             ( ( src[1] >= '0' && src[1] <= '9' ) ||